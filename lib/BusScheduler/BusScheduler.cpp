@@ -0,0 +1,751 @@
+/**
+ * Command queue and bus task in front of HunterRoam.
+ *
+ * Zigbee callbacks must return quickly, but a SmartPort frame keeps the bus
+ * busy for ~640 ms. Commands are queued here and a single task, which is the
+ * only user of the HunterRoam instance, sends them one after another and
+ * reports each result once its frame has left the bus.
+ *
+ * HA automations often send bursts (duplicate OFFs, OFF then ON) for the same
+ * zone. Only the last command per zone is kept, so a burst of N commands costs
+ * at most one frame per zone.
+ *
+ * With at most BUS_SLOTS pending commands, picking the next one by scanning
+ * all slots is cheaper than keeping a queue per priority in order while
+ * commands are replaced.
+ */
+
+#include "BusScheduler.h"
+#include "esp_timer.h"
+
+/**
+ * Constructor for the object BusScheduler.
+ *
+ * @param hunter bus to send the commands to. It must not be used directly
+ * 		once begin() has been called.
+ */
+BusScheduler::BusScheduler(HunterRoam &hunter) : _hunter(hunter) {
+}
+
+/**
+ * Create the command queue and start the bus task.
+ *
+ * @param callback called from the bus task with the result of every command
+ * @param arg passed unchanged to the callback
+ * @param priority FreeRTOS priority of the bus task
+ * @return true if the task is running
+ */
+bool BusScheduler::begin(BusResultCallback callback, void *arg, UBaseType_t priority) {
+    if (_task != nullptr) {
+        return true;
+    }
+
+    _callback = callback;
+    _callbackArg = arg;
+    _txDone = xSemaphoreCreateBinary();
+    if (_txDone == nullptr) {
+        return false;
+    }
+#if CONFIG_PM_ENABLE
+    if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "hunter_bus", &_pmLock) != ESP_OK) {
+        _pmLock = nullptr;
+    }
+#endif
+
+    if (xTaskCreate(taskEntry, "hunter_bus", 4096, this, priority, &_task) != pdPASS) {
+        _task = nullptr;
+        return false;
+    }
+    _hunter.onTransmitDone(transmitDone, this);
+    return true;
+}
+
+/**
+ * Tell the scheduler a zone is known to be off, e.g. from the state saved
+ * before a reset, so a stop for it is not sent. Only before begin().
+ *
+ * @param zone zone number (1-48)
+ * @return false if the zone number is out of range or the task already runs
+ */
+bool BusScheduler::assumeStopped(byte zone) {
+    if (_task != nullptr || zone < 1 || zone > BUS_MAX_ZONES) {
+        return false;
+    }
+    _zoneState[zone - 1] = ZONE_STOPPED;
+    return true;
+}
+
+/**
+ * Queue a zone start.
+ *
+ * @param zone zone number (1-48)
+ * @param time time in minutes (0-240)
+ * @param requestedUs esp_timer_get_time() when the request arrived, for the
+ * 		latency figures in BusCommand::timing; 0 means now
+ * @param timed time is the run time that was asked for, handed back in BusCommand::timed
+ * @return false if the zone number is out of range
+ */
+bool BusScheduler::startZone(byte zone, byte time, int64_t requestedUs, bool timed) {
+    return submit({BUS_START_ZONE, zone, time, BUS_PRIORITY_START, {}, 0, timed}, requestedUs);
+}
+
+/**
+ * Queue a zone stop.
+ *
+ * @param zone zone number (1-48)
+ * @param requestedUs esp_timer_get_time() when the request arrived, for the
+ * 		latency figures in BusCommand::timing; 0 means now
+ * @param emergency send it ahead of every other stop, aborting the frame
+ * 		on the bus unless that is an emergency stop too
+ * @return false if the zone number is out of range
+ */
+bool BusScheduler::stopZone(byte zone, int64_t requestedUs, bool emergency) {
+    return submit({BUS_STOP_ZONE, zone, 0, emergency ? BUS_PRIORITY_EMERGENCY : BUS_PRIORITY_STOP, {}, 0, false}, requestedUs);
+}
+
+/**
+ * Queue a program start.
+ *
+ * @param num program number (1-4)
+ * @param requestedUs esp_timer_get_time() when the request arrived, for the
+ * 		latency figures in BusCommand::timing; 0 means now
+ * @return false if the program number is out of range
+ */
+bool BusScheduler::startProgram(byte num, int64_t requestedUs) {
+    return submit({BUS_START_PROGRAM, num, 0, BUS_PRIORITY_PROGRAM, {}, 0, false}, requestedUs);
+}
+
+/**
+ * Queue a calibration of the reset impulse and gap, see calibrationStep().
+ * Needs readback on the bus. The zone gets a few dozen stop frames, so pick
+ * one that is not in use; the calibration ends early if it is started.
+ * Once it succeeds, calibrationResult() returns the timing it found. That
+ * timing is not used until it is handed to setTiming().
+ *
+ * @param zone zone number (1-48) the calibration frames are sent to
+ * @param requestedUs esp_timer_get_time() when the request arrived; 0 means now
+ * @return false if the zone number is out of range
+ */
+bool BusScheduler::calibrate(byte zone, int64_t requestedUs) {
+    return submit({BUS_CALIBRATE, zone, 0, BUS_PRIORITY_MAINTENANCE, {}, 0, false}, requestedUs);
+}
+
+/**
+ * Send the frames from the next one on with this reset impulse and gap.
+ * Any task, also before begin().
+ *
+ * @param timing see HunterRoam::validTiming()
+ * @return false if the timing is out of range
+ */
+bool BusScheduler::setTiming(const HunterTiming &timing) {
+    if (!HunterRoam::validTiming(timing)) {
+        return false;
+    }
+    portENTER_CRITICAL(&_lock);
+    _timing = timing;
+    _timingChanged = true;
+    portEXIT_CRITICAL(&_lock);
+    return true;
+}
+
+/**
+ * @return the timing frames are sent with (calibration trials aside)
+ */
+HunterTiming BusScheduler::timing() {
+    portENTER_CRITICAL(&_lock);
+    HunterTiming timing = _timing;
+    portEXIT_CRITICAL(&_lock);
+    return timing;
+}
+
+/**
+ * @return the timing the last successful calibration found, the standard one before that
+ */
+HunterTiming BusScheduler::calibrationResult() {
+    portENTER_CRITICAL(&_lock);
+    HunterTiming timing = _calibrationResult;
+    portEXIT_CRITICAL(&_lock);
+    return timing;
+}
+
+/**
+ * Queue an emergency stop for stations 1 to zones, in one pass and with a
+ * single wake-up of the bus task. Stations known to be off are skipped by the
+ * bus task without a frame, the others are stopped back to back. Each stop
+ * still starts with the full reset impulse and gap of timing(): no shorter
+ * one is known to be taken by the controller.
+ *
+ * Program starts still waiting are dropped, and one on the bus is aborted and
+ * not sent again: either would have the controller water again right after
+ * the stops. They are reported with HunterError::TransmitAborted.
+ *
+ * @param zones number of stations wired to the controller (1-48)
+ * @param requestedUs esp_timer_get_time() when the request arrived, for the
+ * 		latency figures in BusCommand::timing; 0 means now
+ * @return false if the number of stations is out of range
+ */
+bool BusScheduler::stopAll(byte zones, int64_t requestedUs) {
+    if (zones < 1 || zones > BUS_MAX_ZONES || _task == nullptr) {
+        return false;
+    }
+
+    BusCommand command = {BUS_STOP_ZONE, 0, 0, BUS_PRIORITY_EMERGENCY, {}, 0, false};
+    command.timing.queuedUs = esp_timer_get_time();
+    command.timing.requestedUs = requestedUs != 0 ? requestedUs : command.timing.queuedUs;
+
+    bool abort = false;
+    portENTER_CRITICAL(&_lock);
+    for (byte zone = 1; zone <= zones; zone++) {
+        command.target = zone;
+        abort |= place(command);
+    }
+    for (uint8_t slot = BUS_MAX_ZONES; slot < BUS_MAX_ZONES + BUS_MAX_PROGRAMS; slot++) {
+        if (_pending[slot]) {
+            _pending[slot] = false;
+            _pendingCount--;
+            _cancelledPrograms |= 1 << (slot - BUS_MAX_ZONES);
+        }
+    }
+    if (_inFlight >= 0 && _current.action == BUS_START_PROGRAM) {
+        _cancelCurrent = true;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (abort) {
+        xSemaphoreGive(_txDone);
+    }
+    xTaskNotifyGive(_task);
+    return true;
+}
+
+/**
+ * @return true when called from the bus task, e.g. from inside the result callback.
+ */
+bool BusScheduler::inBusTask() {
+    return _task != nullptr && xTaskGetCurrentTaskHandle() == _task;
+}
+
+/**
+ * Copy the totals of this bus since boot. Any task.
+ */
+void BusScheduler::stats(BusStats &stats) {
+    portENTER_CRITICAL(&_lock);
+    stats = _stats;
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * For a stall monitor: since when the bus task has been on its current command
+ * (frame and result callback), or, between commands, since when the oldest
+ * pending one has been waiting for the task to pick it up. Any task.
+ *
+ * @param context set to action << 16 | priority << 8 | target of that command
+ * @return its esp_timer_get_time(), 0 if the bus has nothing to do
+ */
+int64_t BusScheduler::busySince(uint32_t &context) {
+    int64_t since = 0;
+    const BusCommand *command = nullptr;
+
+    portENTER_CRITICAL(&_lock);
+    if (_inFlight >= 0) {
+        command = &_current;
+        since = _current.timing.dequeuedUs;
+    } else {
+        for (int slot = 0; slot < BUS_SLOTS; slot++) {
+            if (_pending[slot] && (since == 0 || _slots[slot].timing.queuedUs < since)) {
+                command = &_slots[slot];
+                since = command->timing.queuedUs;
+            }
+        }
+    }
+    if (command != nullptr) {
+        context = (uint32_t)command->action << 16 | (uint32_t)command->priority << 8 | command->target;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return since;
+}
+
+/**
+ * Store a command in its slot without blocking, replacing any pending command
+ * for the same zone or program.
+ */
+bool BusScheduler::submit(BusCommand command, int64_t requestedUs) {
+    if (command.target < 1 || command.target > (command.action == BUS_START_PROGRAM ? BUS_MAX_PROGRAMS : BUS_MAX_ZONES)) {
+        return false;
+    }
+    if (_task == nullptr) {
+        return false;
+    }
+
+    command.timing.queuedUs = esp_timer_get_time();
+    command.timing.requestedUs = requestedUs != 0 ? requestedUs : command.timing.queuedUs;
+
+    portENTER_CRITICAL(&_lock);
+    bool abort = place(command);
+    portEXIT_CRITICAL(&_lock);
+
+    if (abort) {
+        // Wake the bus task from its wait for the frame on the bus
+        xSemaphoreGive(_txDone);
+    }
+    xTaskNotifyGive(_task);
+    return true;
+}
+
+/**
+ * @return the pending slot of a validated command
+ */
+uint8_t BusScheduler::slotOf(const BusCommand &command) {
+    switch (command.action) {
+        case BUS_START_PROGRAM:
+            return BUS_MAX_ZONES + command.target - 1;
+        case BUS_CALIBRATE:
+            return BUS_CALIBRATION_SLOT;
+        default:
+            return command.target - 1;
+    }
+}
+
+/**
+ * Put a validated command in its slot. Call with _lock held.
+ *
+ * @return true if the frame on the bus has to be aborted for it
+ */
+bool BusScheduler::place(const BusCommand &command) {
+    uint8_t slot = slotOf(command);
+
+    BusPriority priority = command.priority;
+    if (_pending[slot] && _slots[slot].action == command.action && _slots[slot].priority > priority) {
+        // A plain stop must not demote a pending emergency stop
+        priority = _slots[slot].priority;
+    }
+    _slots[slot] = command;
+    _slots[slot].priority = priority;
+    if (command.action == BUS_START_PROGRAM) {
+        // Asked for again after stopAll(): this one is reported instead
+        _cancelledPrograms &= ~(1 << (command.target - 1));
+    }
+    if (!_pending[slot]) {
+        _pending[slot] = true;
+        _arrival[slot] = _nextArrival++;
+        if (++_pendingCount > _stats.pendingHighWater) {
+            _stats.pendingHighWater = _pendingCount;
+        }
+    }
+    if (priority == BUS_PRIORITY_EMERGENCY && _inFlight >= 0 && _inFlight < BUS_PRIORITY_EMERGENCY) {
+        _abort = true;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Pop the pending command with the highest priority, the oldest among equals.
+ *
+ * @return false if nothing is pending
+ */
+bool BusScheduler::takeNext(BusCommand &command) {
+    int best = -1;
+
+    portENTER_CRITICAL(&_lock);
+    for (int slot = 0; slot < BUS_SLOTS; slot++) {
+        if (!_pending[slot]) {
+            continue;
+        }
+        if (best < 0 || _slots[slot].priority > _slots[best].priority
+                || (_slots[slot].priority == _slots[best].priority
+                    && (int32_t)(_arrival[slot] - _arrival[best]) < 0)) {
+            best = slot;
+        }
+    }
+    if (best >= 0) {
+        _pending[best] = false;
+        _pendingCount--;
+        command = _slots[best];
+        command.timing.dequeuedUs = esp_timer_get_time();
+        _current = command;
+        _inFlight = command.priority;
+    } else {
+        _inFlight = -1;
+    }
+    _abort = false;
+    _cancelCurrent = false;
+    portEXIT_CRITICAL(&_lock);
+
+    return best >= 0;
+}
+
+/**
+ * Put back a command whose frame was aborted, at the head of its priority,
+ * unless a newer command for the same zone or program has arrived meanwhile.
+ *
+ * @return false if stopAll() cancelled it instead
+ */
+bool BusScheduler::requeue(const BusCommand &command) {
+    uint8_t slot = slotOf(command);
+
+    portENTER_CRITICAL(&_lock);
+    bool cancelled = _cancelCurrent;
+    if (!_pending[slot] && !cancelled) {
+        _slots[slot] = command;
+        _pending[slot] = true;
+        _pendingCount++;
+        _arrival[slot] = _nextArrival - 0x80000000u; // older than anything pending
+    }
+    portEXIT_CRITICAL(&_lock);
+    return !cancelled;
+}
+
+/**
+ * Report the program starts stopAll() dropped before they were sent.
+ */
+void BusScheduler::reportCancelled() {
+    BusCommand cancelled[BUS_MAX_PROGRAMS];
+    uint8_t count = 0;
+
+    portENTER_CRITICAL(&_lock);
+    for (uint8_t program = 0; program < BUS_MAX_PROGRAMS; program++) {
+        if (_cancelledPrograms >> program & 1) {
+            cancelled[count++] = _slots[BUS_MAX_ZONES + program];
+        }
+    }
+    _cancelledPrograms = 0;
+    portEXIT_CRITICAL(&_lock);
+
+    for (uint8_t i = 0; i < count && _callback != nullptr; i++) {
+        _callback(cancelled[i], HunterError::TransmitAborted, _callbackArg);
+    }
+}
+
+/**
+ * @return true if a command more urgent than this one is waiting. Any task.
+ */
+bool BusScheduler::outranked(const BusCommand &command) {
+    bool outranked = false;
+
+    portENTER_CRITICAL(&_lock);
+    for (int slot = 0; slot < BUS_SLOTS && !outranked; slot++) {
+        outranked = _pending[slot] && _slots[slot].priority > command.priority;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return outranked;
+}
+
+/**
+ * Send one command and wait until its frame has left the bus. A frame that
+ * fails its readback is sent again at once, unless a more urgent command
+ * has come in meanwhile: it must not wait for the resends (a stop would
+ * otherwise take up to three frames), so the frame goes back in line.
+ *
+ * @return HunterError::None once the frame has been sent, TransmitAborted
+ * 		when it has to be sent again after another command
+ */
+HunterError BusScheduler::execute(BusCommand &command) {
+    // Drop any completion left over from a previous frame
+    xSemaphoreTake(_txDone, 0);
+
+#if CONFIG_PM_ENABLE
+    if (_pmLock != nullptr) {
+        esp_pm_lock_acquire(_pmLock);
+    }
+#endif
+    HunterError err = transmit(command);
+    while ((err == HunterError::ReadbackMismatch || err == HunterError::ReadbackMissing)
+            && command.retries < BUS_READBACK_RETRIES && !_abort) {
+        command.retries++;
+        portENTER_CRITICAL(&_lock);
+        _stats.resent++;
+        portEXIT_CRITICAL(&_lock);
+        if (outranked(command)) {
+            // Resent once the other command is through, see run()
+            err = HunterError::TransmitAborted;
+            break;
+        }
+        err = transmit(command);
+    }
+#if CONFIG_PM_ENABLE
+    if (_pmLock != nullptr) {
+        esp_pm_lock_release(_pmLock);
+    }
+#endif
+    return err;
+}
+
+/**
+ * Hand one command to HunterRoam and wait for its transmit-done signal.
+ * Fills in the bus stages of command.timing.
+ */
+HunterError BusScheduler::transmit(BusCommand &command) {
+    HunterError err;
+
+    switch (command.action) {
+        case BUS_START_ZONE:
+            err = _hunter.startZone(command.target, command.minutes);
+            break;
+        case BUS_STOP_ZONE:
+        case BUS_CALIBRATE:
+            err = _hunter.stopZone(command.target);
+            break;
+        case BUS_START_PROGRAM:
+            err = _hunter.startProgram(command.target);
+            break;
+        default:
+            return HunterError::Unknown;
+    }
+
+    if (err != HunterError::None) {
+        return err;
+    }
+    command.timing.sentUs = _hunter.lastTransmitStart();
+    portENTER_CRITICAL(&_lock);
+    _stats.frames++;
+    _stats.bytes += _hunter.lastFrameBytes();
+    portEXIT_CRITICAL(&_lock);
+
+    if (!waitForTransmit()) {
+        return HunterError::TransmitTimeout;
+    }
+    if (_abort && _hunter.isBusy()) {
+        if (_hunter.abortTransmit()) {
+            return HunterError::TransmitAborted;
+        }
+        // Could not be stopped, let it finish
+        if (xSemaphoreTake(_txDone, pdMS_TO_TICKS(BUS_TRANSMIT_TIMEOUT_MS)) != pdTRUE) {
+            return HunterError::TransmitTimeout;
+        }
+    }
+    command.timing.doneUs = _hunter.lastTransmitEnd();
+    return _hunter.verifyTransmit(BUS_READBACK_TIMEOUT_MS);
+}
+
+/**
+ * Hand a timing from setTiming() to the bus, before the next frame.
+ */
+void BusScheduler::applyTiming() {
+    portENTER_CRITICAL(&_lock);
+    bool changed = _timingChanged;
+    HunterTiming timing = _timing;
+    _timingChanged = false;
+    portEXIT_CRITICAL(&_lock);
+
+    if (changed) {
+        _hunter.setTiming(timing);
+    }
+}
+
+/**
+ * Send one calibration frame and move the search on.
+ *
+ * Starting from the standard timing, the reset impulse is shortened a step
+ * at a time as long as BUS_CALIBRATION_PASSES frames in a row read back
+ * clean, down to HUNTER_MIN_RESET_HIGH_US; then the gap, the same way. The
+ * result is one step longer than the shortest timing that passed, but never
+ * longer than the standard one.
+ *
+ * The readback is armed half way through the gap, so it checks the bits
+ * that follow, not the reset and gap being shortened, and it cannot tell
+ * whether the controller took the frame. The result is therefore only a
+ * candidate: it is kept for calibrationResult() and not put in use.
+ *
+ * @param done set to false while more frames are needed
+ * @return the error that ended the calibration, None once it succeeded
+ */
+HunterError BusScheduler::calibrationStep(BusCommand &command, bool &done) {
+    ZoneState &state = _zoneState[command.target - 1];
+
+    done = true;
+    if (!_hunter.readbackEnabled()) {
+        // Nothing tells a good timing from a bad one without it
+        return HunterError::ReadbackMissing;
+    }
+    if (state == ZONE_RUNNING) {
+        // Its next calibration frame would stop it
+        _calibrating = false;
+        return HunterError::InvalidZone;
+    }
+    if (!_calibrating) {
+        _calibrating = true;
+        _calibratingGap = false;
+        _calibrationPasses = 0;
+        _calibrationGood = HUNTER_STANDARD_TIMING;
+        _calibrationTrial = HUNTER_STANDARD_TIMING;
+        nextCalibrationTrial(true);
+    }
+
+    _hunter.setTiming(_calibrationTrial);
+    // Only a frame that reads back clean the first time counts, no resends
+    command.retries = BUS_READBACK_RETRIES;
+    HunterError err = execute(command);
+    _hunter.setTiming(timing());
+    // The controller may or may not have taken the stop
+    state = ZONE_UNKNOWN;
+
+    if (err == HunterError::TransmitAborted) {
+        // Cut short for an emergency stop, try the same timing again
+        done = false;
+        return err;
+    }
+    bool passed = err == HunterError::None;
+    if (!passed && err != HunterError::ReadbackMismatch && err != HunterError::ReadbackMissing) {
+        // The bus itself failed, which says nothing about the timing
+        _calibrating = false;
+        return err;
+    }
+    if (passed && ++_calibrationPasses < BUS_CALIBRATION_PASSES) {
+        done = false;
+        return HunterError::None;
+    }
+    if (passed) {
+        _calibrationGood = _calibrationTrial;
+    }
+    _calibrationPasses = 0;
+    if (nextCalibrationTrial(passed)) {
+        done = false;
+        return HunterError::None;
+    }
+
+    _calibrating = false;
+    HunterTiming result = {
+        min(_calibrationGood.resetHighUs + BUS_CALIBRATION_STEP_HIGH_US, HUNTER_STANDARD_TIMING.resetHighUs),
+        min(_calibrationGood.resetLowUs + BUS_CALIBRATION_STEP_LOW_US, HUNTER_STANDARD_TIMING.resetLowUs)
+    };
+    portENTER_CRITICAL(&_lock);
+    _calibrationResult = result;
+    portEXIT_CRITICAL(&_lock);
+    return HunterError::None;
+}
+
+/**
+ * Pick the timing for the next calibration frames.
+ *
+ * @param passed true if the last trial timing passed
+ * @return false once there is nothing shorter left to try
+ */
+bool BusScheduler::nextCalibrationTrial(bool passed) {
+    if (!_calibratingGap) {
+        if (passed && _calibrationGood.resetHighUs >= HUNTER_MIN_RESET_HIGH_US + BUS_CALIBRATION_STEP_HIGH_US) {
+            _calibrationTrial = {_calibrationGood.resetHighUs - BUS_CALIBRATION_STEP_HIGH_US, _calibrationGood.resetLowUs};
+            return true;
+        }
+        // The gap is shortened from the shortest reset impulse that passed
+        _calibratingGap = true;
+        passed = true;
+    }
+    if (passed && _calibrationGood.resetLowUs >= HUNTER_MIN_RESET_LOW_US + BUS_CALIBRATION_STEP_LOW_US) {
+        _calibrationTrial = {_calibrationGood.resetHighUs, _calibrationGood.resetLowUs - BUS_CALIBRATION_STEP_LOW_US};
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Wait for the transmit-done signal, or for submit() asking to abort.
+ *
+ * @return false on timeout
+ */
+bool BusScheduler::waitForTransmit() {
+    // An abort requested before the frame started may have had its signal
+    // dropped with the stale completion in execute()
+    if (_abort) {
+        return true;
+    }
+    return xSemaphoreTake(_txDone, pdMS_TO_TICKS(BUS_TRANSMIT_TIMEOUT_MS)) == pdTRUE;
+}
+
+/**
+ * Bus task body: drain the pending commands, then sleep until the next submit.
+ */
+void BusScheduler::run() {
+    BusCommand command;
+
+    for (;;) {
+        reportCancelled();
+        while (takeNext(command)) {
+            reportCancelled();
+            applyTiming();
+
+            if (command.action == BUS_CALIBRATE) {
+                bool done;
+                HunterError err = calibrationStep(command, done);
+                if (!done) {
+                    // Behind everything else again, the remaining steps wait their turn
+                    portENTER_CRITICAL(&_lock);
+                    if (!_pending[BUS_CALIBRATION_SLOT]) {
+                        place(command);
+                    }
+                    portEXIT_CRITICAL(&_lock);
+                } else if (_callback != nullptr) {
+                    _callback(command, err, _callbackArg);
+                }
+                continue;
+            }
+
+            HunterError err = HunterError::None;
+            bool isZone = command.action != BUS_START_PROGRAM;
+            ZoneState &state = _zoneState[isZone ? command.target - 1 : 0];
+            int64_t &runEnds = _runEndsUs[isZone ? command.target - 1 : 0];
+
+            if (command.action == BUS_STOP_ZONE && state == ZONE_RUNNING
+                    && esp_timer_get_time() >= runEnds - BUS_TIMED_STOP_MARGIN_MS * 1000LL) {
+                // The run time sent with the start is (about to be) over
+                state = ZONE_STOPPED;
+            }
+
+            // A stop for a zone we know is already off would only cost bus time
+            if (!(command.action == BUS_STOP_ZONE && state == ZONE_STOPPED)) {
+                err = execute(command);
+                if (err == HunterError::TransmitAborted) {
+                    // Only part of the frame went out, which the controller
+                    // ignores, or it failed its readback: send it again after
+                    // the emergency stop or the more urgent command
+                    if (isZone) {
+                        state = ZONE_UNKNOWN;
+                    }
+                    if (!requeue(command) && _callback != nullptr) {
+                        // A program start cut short by stopAll(), never to be sent
+                        _callback(command, err, _callbackArg);
+                    }
+                    continue;
+                }
+                if (isZone) {
+                    if (err == HunterError::None) {
+                        bool running = command.action == BUS_START_ZONE && command.minutes > 0;
+                        state = running ? ZONE_RUNNING : ZONE_STOPPED;
+                        // The controller starts counting once the frame is in
+                        runEnds = command.timing.doneUs + command.minutes * 60 * 1000000LL;
+                    } else {
+                        // The frame may or may not have reached the controller
+                        state = ZONE_UNKNOWN;
+                    }
+                } else if (err == HunterError::None) {
+                    // The program runs zones of its own choosing, no stop may be skipped now
+                    memset(_zoneState, ZONE_UNKNOWN, sizeof(_zoneState));
+                }
+            }
+
+            if (err != HunterError::None) {
+                portENTER_CRITICAL(&_lock);
+                _stats.failed++;
+                portEXIT_CRITICAL(&_lock);
+            }
+            if (_callback != nullptr) {
+                _callback(command, err, _callbackArg);
+            }
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+void BusScheduler::taskEntry(void *arg) {
+    ((BusScheduler *)arg)->run();
+}
+
+/**
+ * HunterRoam transmit-done hook, wakes the bus task.
+ */
+bool IRAM_ATTR BusScheduler::transmitDone(void *arg) {
+    BusScheduler *self = (BusScheduler *)arg;
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(self->_txDone, &woken);
+    return woken == pdTRUE;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#ifndef BusScheduler_h
+#define BusScheduler_h
+
+#include <Arduino.h>
+#include "HunterRoam.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+#define BUS_MAX_ZONES HUNTER_MAX_ZONES
+#define BUS_MAX_PROGRAMS HUNTER_MAX_PROGRAMS
+// One pending slot per zone and per program, and one for a calibration
+#define BUS_CALIBRATION_SLOT (BUS_MAX_ZONES + BUS_MAX_PROGRAMS)
+#define BUS_SLOTS (BUS_CALIBRATION_SLOT + 1)
+// A zone frame takes ~640 ms; anything much longer means the transfer is stuck.
+#define BUS_TRANSMIT_TIMEOUT_MS 2000
+// A frame the readback pin saw corrupted (or not at all) is sent again this often
+#define BUS_READBACK_RETRIES 2
+// The capture ends HUNTER_READBACK_IDLE_US after the frame, plus scheduling slack
+#define BUS_READBACK_TIMEOUT_MS (HUNTER_READBACK_IDLE_US / 1000 + 40)
+// A stop this close to the end of a run is left to the controller's own timer
+#define BUS_TIMED_STOP_MARGIN_MS 5000
+// Calibration shortens the reset impulse, then the gap, by these steps while
+// BUS_CALIBRATION_PASSES frames in a row read back clean at each step
+#define BUS_CALIBRATION_STEP_HIGH_US 25000
+#define BUS_CALIBRATION_STEP_LOW_US 5000
+#define BUS_CALIBRATION_PASSES 3
+
+enum BusAction : uint8_t {
+    BUS_START_ZONE,
+    BUS_STOP_ZONE,
+    BUS_START_PROGRAM,
+    BUS_CALIBRATE    // one calibration frame, a stop for the target zone
+};
+
+/**
+ * Transmit order, highest first. Within one priority commands are sent in
+ * the order they were submitted.
+ */
+enum BusPriority : uint8_t {
+    BUS_PRIORITY_MAINTENANCE, // only when nothing else is pending
+    BUS_PRIORITY_PROGRAM,
+    BUS_PRIORITY_START,
+    BUS_PRIORITY_STOP,
+    BUS_PRIORITY_EMERGENCY // may abort a lower priority frame already on the bus
+};
+
+/**
+ * Where a command spent its time, all esp_timer_get_time() microseconds.
+ * A stage that did not happen (e.g. a skipped stop never reaches the bus) is 0.
+ */
+struct BusTiming {
+    int64_t requestedUs; // the caller received the request (callback entry)
+    int64_t queuedUs;    // stored in its pending slot
+    int64_t dequeuedUs;  // picked up by the bus task, frame encoding starts
+    int64_t sentUs;      // frame encoded and handed to the bus
+    int64_t doneUs;      // last symbol left the bus
+};
+
+/**
+ * Running totals of one bus since boot, see BusScheduler::stats().
+ */
+struct BusStats {
+    uint32_t frames;          // put on the bus, resends included
+    uint32_t bytes;           // payload bytes of those frames
+    uint32_t resent;          // frames sent again after a failed readback
+    uint32_t failed;          // commands that ended in an error
+    uint8_t pendingHighWater; // most commands waiting at once
+};
+
+struct BusCommand {
+    BusAction action;
+    uint8_t target;  // zone (1-48) or program (1-4) number, the zone that gets the calibration stops
+    uint8_t minutes; // run time for BUS_START_ZONE
+    BusPriority priority;
+    BusTiming timing;
+    uint8_t retries; // frames sent again after a failed readback
+    bool timed;      // BUS_START_ZONE: minutes is a run time that was asked for, not a safety limit
+};
+
+/**
+ * Called from the bus task once a command has been handled.
+ * error is HunterError::None when the frame has been completely sent (or was
+ * not needed), otherwise the reason it was not (see HunterRoam::errorHint).
+ * Commands replaced by a newer one for the same zone are not reported, nor
+ * are frames aborted for an emergency stop, or that failed their readback
+ * while a more urgent command was waiting: those are sent again. Program
+ * starts cancelled by stopAll() are reported with HunterError::TransmitAborted.
+ * A calibration is reported once, when it ends.
+ */
+typedef void (*BusResultCallback)(const BusCommand &command, HunterError error, void *arg);
+
+/**
+ * Owns a HunterRoam bus and serializes every command sent to it on a dedicated
+ * FreeRTOS task. The submit functions only fill a pending slot, so they take
+ * constant time and can be called from Zigbee callbacks.
+ *
+ * Stops are sent before starts and starts before programs, so a stop waits
+ * for at most the frame already on the bus. An emergency stop does not even
+ * wait for that one: the frame is aborted and sent again afterwards.
+ *
+ * Pending commands are coalesced per zone: a newer command replaces one that
+ * has not been sent yet (last writer wins) while keeping its place in line,
+ * and a stop for a zone already known to be stopped is not sent at all.
+ * Neither is a stop for a zone whose run time (sent in its start frame) is
+ * over, or nearly so: the controller switches it off by itself.
+ *
+ * With readback enabled on the HunterRoam bus, every frame is checked against
+ * what the readback pin saw and sent again if it differs: at once, or after
+ * a more urgent command that has come in meanwhile, so a stop still waits
+ * for one frame at most.
+ *
+ * calibrate() looks for the shortest reset impulse and gap after which the
+ * frames still read back clean, see calibrationStep(). Its frames are stops
+ * for one zone, sent one at a time whenever the bus has nothing else to do.
+ * The result is only a candidate: nothing on the bus shows the controller
+ * took those frames, so it is not used unless handed to setTiming().
+ *
+ * With power management enabled the chip is kept out of light sleep while a
+ * frame is on the bus.
+ */
+class BusScheduler {
+    public:
+        BusScheduler(HunterRoam &hunter);
+        bool begin(BusResultCallback callback, void *arg, UBaseType_t priority = 3);
+        bool assumeStopped(byte zone);
+        bool startZone(byte zone, byte time, int64_t requestedUs = 0, bool timed = false);
+        bool stopZone(byte zone, int64_t requestedUs = 0, bool emergency = false);
+        bool stopAll(byte zones, int64_t requestedUs = 0);
+        bool startProgram(byte num, int64_t requestedUs = 0);
+        bool calibrate(byte zone, int64_t requestedUs = 0);
+        bool setTiming(const HunterTiming &timing);
+        HunterTiming timing();
+        HunterTiming calibrationResult();
+        bool inBusTask();
+        int64_t busySince(uint32_t &context);
+        void stats(BusStats &stats);
+
+    private:
+        enum ZoneState : uint8_t { ZONE_UNKNOWN, ZONE_STOPPED, ZONE_RUNNING };
+
+        HunterRoam &_hunter;
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+        BusCommand _slots[BUS_SLOTS];
+        bool _pending[BUS_SLOTS] = {};
+        uint32_t _arrival[BUS_SLOTS];  // submit order of each pending slot
+        uint32_t _nextArrival = 0;
+        uint8_t _pendingCount = 0;
+        BusStats _stats = {};          // under _lock
+        int _inFlight = -1;            // priority of the command being sent, -1 when idle
+        BusCommand _current;           // the command being sent, valid while _inFlight >= 0
+        volatile bool _abort = false;  // an emergency stop wants the bus
+        bool _cancelCurrent = false;   // stopAll() cancelled the command being sent, under _lock
+        uint8_t _cancelledPrograms = 0; // bit = program whose pending start stopAll() dropped, under _lock
+        ZoneState _zoneState[BUS_MAX_ZONES] = {}; // only touched by the bus task
+        int64_t _runEndsUs[BUS_MAX_ZONES] = {};   // when the controller ends a running zone, bus task only
+        TaskHandle_t _task = nullptr;
+        SemaphoreHandle_t _txDone = nullptr;
+#if CONFIG_PM_ENABLE
+        esp_pm_lock_handle_t _pmLock = nullptr;
+#endif
+        BusResultCallback _callback = nullptr;
+        void *_callbackArg = nullptr;
+        HunterTiming _timing = HUNTER_STANDARD_TIMING; // for every frame but calibration trials
+        bool _timingChanged = false;                   // _timing not handed to the bus yet
+        bool _calibrating = false;                     // the calibration state below is in use, bus task only
+        bool _calibratingGap = false;                  // the reset impulse is done, shortening the gap
+        uint8_t _calibrationPasses = 0;                // clean frames in a row with the trial timing
+        HunterTiming _calibrationGood;                 // shortest timing that passed so far
+        HunterTiming _calibrationTrial;                // timing being tried
+        HunterTiming _calibrationResult = HUNTER_STANDARD_TIMING; // of the last calibration that succeeded, under _lock
+
+        bool submit(BusCommand command, int64_t requestedUs);
+        static uint8_t slotOf(const BusCommand &command);
+        bool place(const BusCommand &command);
+        bool takeNext(BusCommand &command);
+        bool requeue(const BusCommand &command);
+        bool outranked(const BusCommand &command);
+        void reportCancelled();
+        bool waitForTransmit();
+        HunterError execute(BusCommand &command);
+        HunterError transmit(BusCommand &command);
+        void applyTiming();
+        HunterError calibrationStep(BusCommand &command, bool &done);
+        bool nextCalibrationTrial(bool passed);
+        void run();
+        static void taskEntry(void *arg);
+        static bool transmitDone(void *arg);
+};
+
+#endif
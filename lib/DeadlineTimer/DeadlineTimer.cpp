@@ -0,0 +1,230 @@
+/**
+ * Min-heap of deadlines used for the zone safety timers and any other
+ * per-zone timeout. See DeadlineTimer.h.
+ */
+
+#include "DeadlineTimer.h"
+
+/**
+ * Constructor for the object DeadlineTimer. All slots start disarmed.
+ */
+DeadlineTimer::DeadlineTimer() {
+    memset(_position, NOT_ARMED, sizeof(_position));
+}
+
+/**
+ * Arm a timer, or move it if it is already armed.
+ *
+ * @param id timer slot (0 to DEADLINE_TIMER_CAPACITY - 1)
+ * @param deadlineUs absolute time in esp_timer_get_time() microseconds
+ * @return false if id is out of range
+ */
+bool DeadlineTimer::arm(uint8_t id, int64_t deadlineUs) {
+    if (id >= DEADLINE_TIMER_CAPACITY) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&_lock);
+    uint8_t index = _position[id];
+    if (index == NOT_ARMED) {
+        index = _size++;
+        place(index, {deadlineUs, id});
+        siftUp(index);
+    } else {
+        int64_t previous = _heap[index].deadline;
+        _heap[index].deadline = deadlineUs;
+        if (deadlineUs < previous) {
+            siftUp(index);
+        } else {
+            siftDown(index);
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+    return true;
+}
+
+/**
+ * Arm a timer relative to now.
+ *
+ * @param id timer slot
+ * @param delayUs microseconds from now
+ */
+bool DeadlineTimer::armIn(uint8_t id, int64_t delayUs) {
+    return arm(id, esp_timer_get_time() + delayUs);
+}
+
+/**
+ * Disarm a timer.
+ *
+ * @param id timer slot
+ * @return true if it was armed
+ */
+bool DeadlineTimer::cancel(uint8_t id) {
+    if (id >= DEADLINE_TIMER_CAPACITY) {
+        return false;
+    }
+
+    bool armed = false;
+    portENTER_CRITICAL(&_lock);
+    if (_position[id] != NOT_ARMED) {
+        removeAt(_position[id]);
+        armed = true;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return armed;
+}
+
+/**
+ * @param id timer slot
+ * @return true if the timer is armed (expired timers stay armed until popped)
+ */
+bool DeadlineTimer::isArmed(uint8_t id) {
+    return id < DEADLINE_TIMER_CAPACITY && _position[id] != NOT_ARMED;
+}
+
+/**
+ * @param id timer slot
+ * @return the deadline of the timer, or DEADLINE_NONE if it is not armed
+ */
+int64_t DeadlineTimer::deadline(uint8_t id) {
+    int64_t result = DEADLINE_NONE;
+    portENTER_CRITICAL(&_lock);
+    if (isArmed(id)) {
+        result = _heap[_position[id]].deadline;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return result;
+}
+
+/**
+ * @return the earliest armed deadline, or DEADLINE_NONE
+ */
+int64_t DeadlineTimer::nextDeadline() {
+    int64_t result = DEADLINE_NONE;
+    portENTER_CRITICAL(&_lock);
+    if (_size > 0) {
+        result = _heap[0].deadline;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return result;
+}
+
+/**
+ * @return milliseconds (rounded up) until the earliest deadline, 0 if it has
+ * 		already passed, or UINT32_MAX if no timer is armed
+ */
+uint32_t DeadlineTimer::msUntilNext() {
+    int64_t next = nextDeadline();
+    if (next == DEADLINE_NONE) {
+        return UINT32_MAX;
+    }
+    int64_t remaining = next - esp_timer_get_time();
+    if (remaining <= 0) {
+        return 0;
+    }
+    int64_t ms = (remaining + 999) / 1000;
+    return ms >= UINT32_MAX ? UINT32_MAX - 1 : (uint32_t)ms;
+}
+
+/**
+ * Disarm one timer if it has expired, for timers shared by several users that
+ * each only look at their own ids.
+ *
+ * @param id timer slot
+ * @param nowUs current esp_timer_get_time()
+ * @return true if it was armed and has expired
+ */
+bool DeadlineTimer::takeExpired(uint8_t id, int64_t nowUs) {
+    if (id >= DEADLINE_TIMER_CAPACITY) {
+        return false;
+    }
+
+    bool expired = false;
+    portENTER_CRITICAL(&_lock);
+    uint8_t index = _position[id];
+    if (index != NOT_ARMED && _heap[index].deadline <= nowUs) {
+        removeAt(index);
+        expired = true;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return expired;
+}
+
+/**
+ * Disarm and return the earliest timer if it has expired.
+ *
+ * @param nowUs current esp_timer_get_time()
+ * @param id set to the expired timer slot
+ * @return false if no timer has expired
+ */
+bool DeadlineTimer::popExpired(int64_t nowUs, uint8_t &id) {
+    bool expired = false;
+    portENTER_CRITICAL(&_lock);
+    if (_size > 0 && _heap[0].deadline <= nowUs) {
+        id = _heap[0].id;
+        removeAt(0);
+        expired = true;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return expired;
+}
+
+/**
+ * @return number of armed timers
+ */
+uint8_t DeadlineTimer::count() {
+    return _size;
+}
+
+void DeadlineTimer::place(uint8_t index, const Entry &entry) {
+    _heap[index] = entry;
+    _position[entry.id] = index;
+}
+
+void DeadlineTimer::siftUp(uint8_t index) {
+    Entry entry = _heap[index];
+    while (index > 0) {
+        uint8_t parent = (index - 1) / 2;
+        if (_heap[parent].deadline <= entry.deadline) {
+            break;
+        }
+        place(index, _heap[parent]);
+        index = parent;
+    }
+    place(index, entry);
+}
+
+void DeadlineTimer::siftDown(uint8_t index) {
+    Entry entry = _heap[index];
+    for (;;) {
+        unsigned child = 2 * index + 1;
+        if (child >= _size) {
+            break;
+        }
+        if (child + 1 < _size && _heap[child + 1].deadline < _heap[child].deadline) {
+            child++;
+        }
+        if (entry.deadline <= _heap[child].deadline) {
+            break;
+        }
+        place(index, _heap[child]);
+        index = child;
+    }
+    place(index, entry);
+}
+
+void DeadlineTimer::removeAt(uint8_t index) {
+    _position[_heap[index].id] = NOT_ARMED;
+    _size--;
+    if (index == _size) {
+        return;
+    }
+    // Move the last entry into the hole and restore the heap order
+    Entry moved = _heap[_size];
+    place(index, moved);
+    if (index > 0 && moved.deadline < _heap[(index - 1) / 2].deadline) {
+        siftUp(index);
+    } else {
+        siftDown(index);
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#ifndef DeadlineTimer_h
+#define DeadlineTimer_h
+
+#include <Arduino.h>
+
+// Number of timer slots, e.g. one per zone. Ids are 0 to DEADLINE_TIMER_CAPACITY - 1.
+#ifndef DEADLINE_TIMER_CAPACITY
+#define DEADLINE_TIMER_CAPACITY 64
+#endif
+
+#define DEADLINE_NONE INT64_MAX
+
+/**
+ * Fixed-capacity deadline scheduler keyed by esp_timer_get_time() (64-bit
+ * microseconds, so it does not roll over like millis()).
+ *
+ * Deadlines live in a binary min-heap with a per-id position index:
+ * arming, re-arming and cancelling are O(log n), the next deadline and the
+ * number of armed timers are O(1). Safe to use from several tasks.
+ */
+class DeadlineTimer {
+    public:
+        DeadlineTimer();
+        bool arm(uint8_t id, int64_t deadlineUs);
+        bool armIn(uint8_t id, int64_t delayUs);
+        bool cancel(uint8_t id);
+        bool isArmed(uint8_t id);
+        int64_t deadline(uint8_t id);
+        int64_t nextDeadline();
+        uint32_t msUntilNext();
+        bool popExpired(int64_t nowUs, uint8_t &id);
+        bool takeExpired(uint8_t id, int64_t nowUs);
+        uint8_t count();
+
+    private:
+        struct Entry {
+            int64_t deadline;
+            uint8_t id;
+        };
+
+        static const uint8_t NOT_ARMED = 0xff;
+
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+        Entry _heap[DEADLINE_TIMER_CAPACITY];
+        uint8_t _position[DEADLINE_TIMER_CAPACITY]; // heap index of each id, or NOT_ARMED
+        uint8_t _size = 0;
+
+        void place(uint8_t index, const Entry &entry);
+        void siftUp(uint8_t index);
+        void siftDown(uint8_t index);
+        void removeAt(uint8_t index);
+};
+
+static_assert(DEADLINE_TIMER_CAPACITY < 0xff, "DeadlineTimer ids and heap indexes are 8 bit");
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * Deferred event log, see EventLog.h.
+ *
+ * The ring is a bounded multi-producer queue with a sequence number per cell
+ * (D. Vyukov's design): a producer claims a position with one compare-and-swap
+ * and publishes the record by bumping the cell's sequence, the consumer only
+ * reads cells whose sequence says they are complete. Nothing spins on another
+ * task, so a producer preempted mid-write never blocks the others.
+ */
+
+#include "EventLog.h"
+#include <SPIFFS.h>
+#include "esp_system.h"
+
+/**
+ * Constructor for the object EventLog.
+ *
+ * @param formatter turns the application's records into text, see LogFormatter
+ */
+EventLog::EventLog(LogFormatter formatter) : _formatter(formatter) {
+    for (uint32_t i = 0; i < EVENT_LOG_CAPACITY; i++) {
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Start the flush task. Mounting the spiffs partition (which can take a while,
+ * and formats it on first use) is left to the task, so this returns at once.
+ * Records logged before this are kept and flushed once the task runs.
+ *
+ * @param persist true to append every record to EVENT_LOG_FILE
+ * @param priority FreeRTOS priority of the flush task, keep it below the bus and Zigbee tasks
+ * @param history if set, the task first prints the records kept from previous
+ * 		boots to it, as printPersisted()
+ * @return true if the task is running (even if persisting is not available)
+ */
+bool EventLog::begin(bool persist, UBaseType_t priority, Print *history) {
+    if (_task != nullptr) {
+        return true;
+    }
+
+    _persistRequested = persist;
+    _history = history;
+    log(EVENT_LOG_BOOT, 0, esp_reset_reason());
+
+    if (xTaskCreate(taskEntry, "event_log", 4096, this, priority, &_task) != pdPASS) {
+        _task = nullptr;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Queue a record. Never blocks; do not call it from an ISR.
+ *
+ * @param event application defined event id, 0 is reserved (EVENT_LOG_BOOT)
+ * @return false if the ring is full and the record was dropped
+ */
+bool EventLog::log(uint16_t event, uint16_t arg0, uint32_t arg1, uint32_t arg2) {
+    uint32_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    Cell *cell;
+
+    for (;;) {
+        cell = &_cells[pos & (EVENT_LOG_CAPACITY - 1)];
+        uint32_t sequence = cell->sequence.load(std::memory_order_acquire);
+        int32_t diff = (int32_t)(sequence - pos);
+        if (diff == 0) {
+            // The cell is free for this position, try to claim it
+            if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Still holds a record the flush task has not read
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->record = {(uint32_t)millis(), event, arg0, arg1, arg2};
+    cell->sequence.store(pos + 1, std::memory_order_release);
+
+    if (_task != nullptr) {
+        xTaskNotifyGive(_task);
+    }
+    return true;
+}
+
+/**
+ * Wait until everything logged so far has been printed and written to flash,
+ * e.g. right before a deliberate reboot.
+ *
+ * @param timeoutMs maximum time to wait in milliseconds
+ * @return true if the log was flushed in time
+ */
+bool EventLog::flush(uint32_t timeoutMs) {
+    if (_task == nullptr) {
+        return false;
+    }
+    _flushRequested.store(true);
+    xTaskNotifyGive(_task);
+
+    uint32_t start = millis();
+    while (_flushRequested.load()) {
+        if (millis() - start >= timeoutMs) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return true;
+}
+
+/**
+ * @return number of records dropped because the ring was full, since boot
+ */
+uint32_t EventLog::dropped() {
+    return _dropped.load(std::memory_order_relaxed);
+}
+
+/**
+ * Print the records kept in flash, oldest first. Call it before begin() to
+ * see what happened before the last reboot.
+ *
+ * @param out where to print, e.g. Serial
+ */
+void EventLog::printPersisted(Print &out) {
+    if (!SPIFFS.begin(false)) {
+        return;
+    }
+    const char *files[] = {EVENT_LOG_OLD_FILE, EVENT_LOG_FILE};
+    for (const char *path : files) {
+        File file = SPIFFS.open(path, FILE_READ);
+        if (!file) {
+            continue;
+        }
+        LogRecord record;
+        while (file.read((uint8_t *)&record, sizeof(record)) == sizeof(record)) {
+            print(out, record);
+        }
+        file.close();
+    }
+}
+
+/**
+ * Take the oldest complete record, flush task only.
+ *
+ * @return false if there is none
+ */
+bool EventLog::pop(LogRecord &record) {
+    Cell &cell = _cells[_dequeuePos & (EVENT_LOG_CAPACITY - 1)];
+    uint32_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if ((int32_t)(sequence - (_dequeuePos + 1)) < 0) {
+        return false;
+    }
+    record = cell.record;
+    // Hand the cell back to the producers, one lap ahead
+    cell.sequence.store(_dequeuePos + EVENT_LOG_CAPACITY, std::memory_order_release);
+    _dequeuePos++;
+    return true;
+}
+
+/**
+ * Format one record as a line, prefixed with the time since boot.
+ */
+void EventLog::print(Print &out, const LogRecord &record) {
+    char line[EVENT_LOG_LINE];
+
+    if (record.event == EVENT_LOG_BOOT) {
+        snprintf(line, sizeof(line), "--- boot, reset reason %lu ---", (unsigned long)record.arg1);
+    } else if (_formatter != nullptr) {
+        _formatter(record, line, sizeof(line));
+    } else {
+        snprintf(line, sizeof(line), "event %u (%u, %lu, %lu)", record.event, record.arg0,
+                 (unsigned long)record.arg1, (unsigned long)record.arg2);
+    }
+    out.printf("[%lu.%03lu] %s\n", (unsigned long)(record.timeMs / 1000), (unsigned long)(record.timeMs % 1000), line);
+}
+
+/**
+ * Mount the partition for persisting, flush task only. Nothing has been
+ * appended yet, so the history can still be read as it was at boot.
+ */
+void EventLog::openStorage() {
+    if (_history != nullptr) {
+        _history->println("Events kept from previous boots:");
+        printPersisted(*_history);
+    }
+    if (!_persistRequested || !SPIFFS.begin(true)) {
+        return;
+    }
+    _persist = true;
+    File file = SPIFFS.open(EVENT_LOG_FILE, FILE_READ);
+    if (file) {
+        _persistedRecords = file.size() / sizeof(LogRecord);
+        file.close();
+    }
+}
+
+/**
+ * Add a record to the batch going to flash.
+ */
+void EventLog::persist(const LogRecord &record) {
+    if (_batchCount == 0) {
+        _batchStartMs = millis();
+    }
+    _batch[_batchCount++] = record;
+    if (_batchCount >= EVENT_LOG_PERSIST_BATCH) {
+        writeBatch();
+    }
+}
+
+/**
+ * Append the batch to EVENT_LOG_FILE, rotating it once it holds
+ * EVENT_LOG_PERSIST_RECORDS records so the partition never fills up.
+ */
+void EventLog::writeBatch() {
+    if (_batchCount == 0) {
+        return;
+    }
+    if (_persistedRecords + _batchCount > EVENT_LOG_PERSIST_RECORDS) {
+        SPIFFS.remove(EVENT_LOG_OLD_FILE);
+        SPIFFS.rename(EVENT_LOG_FILE, EVENT_LOG_OLD_FILE);
+        _persistedRecords = 0;
+    }
+
+    File file = SPIFFS.open(EVENT_LOG_FILE, FILE_APPEND);
+    if (file) {
+        file.write((const uint8_t *)_batch, _batchCount * sizeof(LogRecord));
+        file.close();
+        _persistedRecords += _batchCount;
+    }
+    _batchCount = 0;
+}
+
+/**
+ * Flush task body: print and batch every record, then sleep until the next
+ * log() or until the pending batch is due for flash.
+ */
+void EventLog::run() {
+    uint32_t reportedDrops = 0;
+
+    openStorage();
+
+    for (;;) {
+        TickType_t wait = portMAX_DELAY;
+        if (_batchCount > 0) {
+            uint32_t age = millis() - _batchStartMs;
+            wait = age >= EVENT_LOG_PERSIST_MS ? 0 : pdMS_TO_TICKS(EVENT_LOG_PERSIST_MS - age);
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        LogRecord record;
+        while (pop(record)) {
+            print(Serial, record);
+            if (_persist) {
+                persist(record);
+            }
+        }
+
+        uint32_t drops = dropped();
+        if (drops != reportedDrops) {
+            Serial.printf("(%lu log records dropped)\n", (unsigned long)(drops - reportedDrops));
+            reportedDrops = drops;
+        }
+
+        bool flushNow = _flushRequested.load();
+        if (_batchCount > 0 && (flushNow || millis() - _batchStartMs >= EVENT_LOG_PERSIST_MS)) {
+            writeBatch();
+        }
+        if (flushNow) {
+            _flushRequested.store(false);
+        }
+    }
+}
+
+void EventLog::taskEntry(void *arg) {
+    ((EventLog *)arg)->run();
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#ifndef EventLog_h
+#define EventLog_h
+
+#include <Arduino.h>
+#include <atomic>
+
+// Records buffered between the producers and the flush task, a power of two
+#ifndef EVENT_LOG_CAPACITY
+#define EVENT_LOG_CAPACITY 64
+#endif
+// The persisted log keeps between this many and twice as many of the latest records
+#ifndef EVENT_LOG_PERSIST_RECORDS
+#define EVENT_LOG_PERSIST_RECORDS 256
+#endif
+// Flushed records are written to flash in batches of this many, or after EVENT_LOG_PERSIST_MS
+#define EVENT_LOG_PERSIST_BATCH 16
+#define EVENT_LOG_PERSIST_MS 10000
+#define EVENT_LOG_FILE "/events.bin"
+#define EVENT_LOG_OLD_FILE "/events.old"
+// Longest formatted line
+#define EVENT_LOG_LINE 128
+
+// Event id 0 is written by begin() to mark a reboot, arg1 = esp_reset_reason()
+#define EVENT_LOG_BOOT 0
+
+static_assert((EVENT_LOG_CAPACITY & (EVENT_LOG_CAPACITY - 1)) == 0, "EVENT_LOG_CAPACITY must be a power of two");
+
+/**
+ * One log entry, stored as is in RAM and flash. What the arguments mean is
+ * up to the event.
+ */
+struct LogRecord {
+    uint32_t timeMs; // millis() when it was logged
+    uint16_t event;
+    uint16_t arg0;
+    uint32_t arg1;
+    uint32_t arg2;
+};
+
+/**
+ * Turns a record into text, called from the flush task. Must not need the
+ * terminating newline, it is added by the caller.
+ *
+ * @return number of characters written, as snprintf()
+ */
+typedef int (*LogFormatter)(const LogRecord &record, char *buffer, size_t size);
+
+/**
+ * Deferred binary event log.
+ *
+ * log() copies a fixed-size record into a lock-free ring and returns; it never
+ * formats, allocates, takes a lock or waits on the serial port, so it can be
+ * used from Zigbee callbacks and the bus tasks. A low-priority task formats
+ * the records to Serial and appends them to a file on the spiffs partition,
+ * which survives a reboot for post-mortem (see printPersisted()).
+ *
+ * The ring accepts any number of producer tasks and one consumer. When it is
+ * full new records are dropped and counted, the producers never wait.
+ */
+class EventLog {
+    public:
+        EventLog(LogFormatter formatter);
+        bool begin(bool persist, UBaseType_t priority = 1, Print *history = nullptr);
+        bool log(uint16_t event, uint16_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0);
+        bool flush(uint32_t timeoutMs);
+        uint32_t dropped();
+        void printPersisted(Print &out);
+
+    private:
+        struct Cell {
+            std::atomic<uint32_t> sequence;
+            LogRecord record;
+        };
+
+        Cell _cells[EVENT_LOG_CAPACITY];
+        std::atomic<uint32_t> _enqueuePos{0};
+        uint32_t _dequeuePos = 0; // only touched by the flush task
+        std::atomic<uint32_t> _dropped{0};
+        std::atomic<bool> _flushRequested{false};
+        TaskHandle_t _task = nullptr;
+        LogFormatter _formatter = nullptr;
+        bool _persistRequested = false;
+        bool _persist = false;    // the partition is mounted, flush task only
+        Print *_history = nullptr;
+        LogRecord _batch[EVENT_LOG_PERSIST_BATCH];
+        uint8_t _batchCount = 0;
+        uint32_t _batchStartMs = 0;
+        uint32_t _persistedRecords = 0; // records in EVENT_LOG_FILE
+
+        bool pop(LogRecord &record);
+        void print(Print &out, const LogRecord &record);
+        void openStorage();
+        void persist(const LogRecord &record);
+        void writeBatch();
+        void run();
+        static void taskEntry(void *arg);
+};
+
+#endif
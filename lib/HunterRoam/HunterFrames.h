@@ -0,0 +1,222 @@
+#pragma once
+
+#ifndef HunterFrames_h
+#define HunterFrames_h
+
+#include <array>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HUNTER_MAX_ZONES 48
+#define HUNTER_MAX_PROGRAMS 4
+#define HUNTER_ZONE_FRAME_LEN 15
+#define HUNTER_PROGRAM_FRAME_LEN 7
+
+/**
+ * Compile-time SmartPort frame tables.
+ *
+ * Everything in a zone frame except the run time depends only on the zone
+ * number, so the frames for zones 1-48 (with a run time of 0) and programs 1-4
+ * are built by the compiler and stored in flash. At runtime a zone frame is a
+ * copy of its table entry with the time nibbles OR'ed in at fixed offsets.
+ */
+namespace HunterFrames {
+
+typedef std::array<uint8_t, HUNTER_ZONE_FRAME_LEN> ZoneFrame;
+typedef std::array<uint8_t, HUNTER_PROGRAM_FRAME_LEN> ProgramFrame;
+
+/**
+ * Set a value with an arbitrary bit width to a bit position within a blob.
+ * Bits are numbered from the MSB of the first byte and the value is written
+ * LSB first, as the bus expects.
+ *
+ * @param bits blob to write the value to
+ * @param pos position within the blob
+ * @param val to write
+ * @param len in bits of the value
+ */
+template <size_t N>
+constexpr void setBits(std::array<uint8_t, N> &bits, uint8_t pos, uint8_t val, uint8_t len) {
+    while (len > 0) {
+        if (val & 0x1) {
+            bits[pos / 8] = bits[pos / 8] | 0x80 >> (pos % 8);
+        } else {
+            bits[pos / 8] = bits[pos / 8] & ~(0x80 >> (pos % 8));
+        }
+        len--;
+        val = val >> 1;
+        pos++;
+    }
+}
+
+/**
+ * Build the frame that starts a zone with a run time of 0.
+ *
+ * @param zone zone number (1-48)
+ */
+constexpr ZoneFrame buildZoneFrame(uint8_t zone) {
+    // Start out with a base frame
+    ZoneFrame frame = {0xff,0x00,0x00,0x00,0x10,0x00,0x00,0x04,0x00,0x00,0x01,0x00,0x01,0xb8,0x3f};
+
+    // The bus protocol is a little bizzare, not sure why
+
+    // Bits 9:10 are 0x1 for zones > 12 and 0x2 otherwise
+    setBits(frame, 9, zone > 12 ? 0x1 : 0x2, 2);
+
+    // Zone + 0x17 is at bits 23:29 and 36:42
+    setBits(frame, 23, zone + 0x17, 7);
+    setBits(frame, 36, zone + 0x17, 7);
+
+    // Zone + 0x23 is at bits 49:55 and 62:68
+    setBits(frame, 49, zone + 0x23, 7);
+    setBits(frame, 62, zone + 0x23, 7);
+
+    // Zone + 0x2f is at bits 75:81 and 88:94
+    setBits(frame, 75, zone + 0x2f, 7);
+    setBits(frame, 88, zone + 0x2f, 7);
+
+    // Time is encoded in three places and broken up by nibble
+    // Low nibble: bits 31:34, 57:60, and 83:86
+    // High nibble: bits 44:47, 70:73, and 96:99
+    // They are cleared here and filled in by setZoneTime()
+    setBits(frame, 31, 0, 4);
+    setBits(frame, 44, 0, 4);
+    setBits(frame, 57, 0, 4);
+    setBits(frame, 70, 0, 4);
+    setBits(frame, 83, 0, 4);
+    setBits(frame, 96, 0, 4);
+
+    // Bottom nibble of zone - 1 is at bits 109:112
+    setBits(frame, 109, zone - 1, 4);
+
+    return frame;
+}
+
+/**
+ * Build the frame that runs a program.
+ *
+ * @param num program number (1-4)
+ */
+constexpr ProgramFrame buildProgramFrame(uint8_t num) {
+    // Start with a basic program frame
+    ProgramFrame frame = {0xff, 0x40, 0x03, 0x96, 0x09 ,0xbd ,0x7f};
+
+    // Program number - 1 is at bits 31:32
+    setBits(frame, 31, num - 1, 2);
+
+    return frame;
+}
+
+template <size_t... I>
+constexpr std::array<ZoneFrame, sizeof...(I)> buildZoneTable(std::index_sequence<I...>) {
+    return {{ buildZoneFrame(I + 1)... }};
+}
+
+template <size_t... I>
+constexpr std::array<ProgramFrame, sizeof...(I)> buildProgramTable(std::index_sequence<I...>) {
+    return {{ buildProgramFrame(I + 1)... }};
+}
+
+// Index with zone - 1 / program - 1
+constexpr std::array<ZoneFrame, HUNTER_MAX_ZONES> zoneFrames =
+    buildZoneTable(std::make_index_sequence<HUNTER_MAX_ZONES>());
+constexpr std::array<ProgramFrame, HUNTER_MAX_PROGRAMS> programFrames =
+    buildProgramTable(std::make_index_sequence<HUNTER_MAX_PROGRAMS>());
+
+template <size_t N>
+constexpr bool sameFrame(const std::array<uint8_t, N> &a, const std::array<uint8_t, N> &b) {
+    for (size_t i = 0; i < N; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Zone 1, run time 0, as produced by the original bit-by-bit encoder
+static_assert(sameFrame(zoneFrames[0], ZoneFrame{0xff,0x20,0x00,0x30,0x11,0x80,0x12,0x04,0x90,0x01,0x81,0x0c,0x01,0xb8,0x3f}),
+              "zone frame table does not match the SmartPort layout");
+static_assert(sameFrame(programFrames[0], ProgramFrame{0xff,0x40,0x03,0x96,0x09,0xbd,0x7f}),
+              "program frame table does not match the SmartPort layout");
+
+// The 4 bits of a nibble in reverse order, as written by setBits()
+constexpr uint8_t reversedNibble[16] = {
+    0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf
+};
+
+/**
+ * OR a nibble into a cleared 4-bit field. Pos is a template parameter so the
+ * byte offsets and shift are constants.
+ */
+template <uint8_t Pos, size_t N>
+constexpr void orNibble(std::array<uint8_t, N> &frame, uint8_t nibble) {
+    static_assert(Pos / 8 + (Pos % 8 > 4 ? 1 : 0) < N, "nibble outside of frame");
+    uint16_t bits = (uint16_t)(reversedNibble[nibble & 0xf] << (12 - Pos % 8));
+    frame[Pos / 8] |= bits >> 8;
+    if (Pos % 8 > 4) {
+        frame[Pos / 8 + 1] |= bits & 0xff;
+    }
+}
+
+/**
+ * Fill the run time into a frame copied from zoneFrames.
+ *
+ * @param frame zone frame with a run time of 0
+ * @param time time in minutes (0-240)
+ */
+constexpr void setZoneTime(ZoneFrame &frame, uint8_t time) {
+    orNibble<31>(frame, time);
+    orNibble<44>(frame, time >> 4);
+    orNibble<57>(frame, time);
+    orNibble<70>(frame, time >> 4);
+    orNibble<83>(frame, time);
+    orNibble<96>(frame, time >> 4);
+}
+
+/**
+ * The original encoder: base frame with every field, time included, set bit
+ * by bit. Only used to check the tables at compile time.
+ */
+constexpr ZoneFrame referenceZoneFrame(uint8_t zone, uint8_t time) {
+    ZoneFrame frame = {0xff,0x00,0x00,0x00,0x10,0x00,0x00,0x04,0x00,0x00,0x01,0x00,0x01,0xb8,0x3f};
+    setBits(frame, 9, zone > 12 ? 0x1 : 0x2, 2);
+    setBits(frame, 23, zone + 0x17, 7);
+    setBits(frame, 36, zone + 0x17, 7);
+    setBits(frame, 49, zone + 0x23, 7);
+    setBits(frame, 62, zone + 0x23, 7);
+    setBits(frame, 75, zone + 0x2f, 7);
+    setBits(frame, 88, zone + 0x2f, 7);
+    setBits(frame, 31, time, 4);
+    setBits(frame, 44, time >> 4, 4);
+    setBits(frame, 57, time, 4);
+    setBits(frame, 70, time >> 4, 4);
+    setBits(frame, 83, time, 4);
+    setBits(frame, 96, time >> 4, 4);
+    setBits(frame, 109, zone - 1, 4);
+    return frame;
+}
+
+/**
+ * @return true if table + setZoneTime() gives the same frame as the original
+ * 		encoder for every zone between first and last. The time nibbles are
+ * 		independent fields, so times 0-15 and 16, 32, ... 240 already put every
+ * 		value in every nibble.
+ */
+constexpr bool zoneFramesMatchReference(uint8_t first, uint8_t last) {
+    for (unsigned zone = first; zone <= last; zone++) {
+        for (unsigned step = 0; step < 31; step++) {
+            uint8_t time = step < 16 ? step : (step - 15) * 16;
+            ZoneFrame frame = zoneFrames[zone - 1];
+            setZoneTime(frame, time);
+            if (!sameFrame(frame, referenceZoneFrame(zone, time))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+}
+
+#endif
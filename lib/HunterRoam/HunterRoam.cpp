@@ -10,8 +10,8 @@
  * The modifications made are:
  * 		1) It is now a class, for easier use in case several Hunter products are controlled
  * 			by the same device.
- * 		2) Public functions now return a byte, to make it easier to programatically check
- * 			if there has been an error. Use HunterRoam::errorHint(byte error) to obtain
+ * 		2) Public functions now return a HunterError, to make it easier to programatically check
+ * 			if there has been an error. Use HunterRoam::errorHint(HunterError error) to obtain
  * 			a user friendly description of the error.
  * 		3) Updated functions documentation format so that IDEs can parse them.
  * 			        ------ Eloi Codina Torras - July 2020 ------
@@ -23,9 +23,21 @@
  * 
  * --- Komal-SkyNET (Komal Venkatesh Ganesan) --- Sept 2025
  * 
- * /
+ * Frames are now encoded once into RMT symbols and clocked out by the RMT peripheral
+ * in the background, so the ~0.6 s it takes to send a zone frame no longer blocks the
+ * caller. If the RMT channel cannot be set up, the original bit-banged writer is used.
+ * 
+ * Optionally the REM line is read back on a second GPIO with RMT RX and compared
+ * with the frame that was meant to go out, see enableReadback().
+ * 
+ * Sending a command never touches the heap: frames are fixed-size arrays copied from
+ * flash tables, errors are a HunterError and their descriptions are constant strings.
+ * test/test_allocations counts every allocation while each command is sent.
+ */
 
 #include "HunterRoam.h"
+#include <type_traits>
+#include "soc/soc_caps.h"
 
 /**
  * Constructor for the object HunterRoam.
@@ -38,24 +50,367 @@ HunterRoam::HunterRoam(int pin) {
 }
 
 /**
- * Function to convert the error number returned by any function
+ * Set up the RMT channel used to transmit frames. Must be called from setup(),
+ * not from a global constructor.
+ * 
+ * @return true if frames will be sent through RMT, false if the library falls
+ * 		back to bit-banging the bus.
+ */
+bool HunterRoam::begin() {
+	if (_channel != nullptr) {
+		return true;
+	}
+
+	rmt_tx_channel_config_t channelConfig = {};
+	channelConfig.gpio_num = (gpio_num_t)_pin;
+	channelConfig.clk_src = RMT_CLK_SRC_DEFAULT;
+	channelConfig.resolution_hz = HUNTER_RMT_RESOLUTION_HZ;
+	channelConfig.mem_block_symbols = 48;
+	channelConfig.trans_queue_depth = 1;
+	if (rmt_new_tx_channel(&channelConfig, &_channel) != ESP_OK) {
+		_channel = nullptr;
+		return false;
+	}
+
+	rmt_copy_encoder_config_t encoderConfig = {};
+	rmt_tx_event_callbacks_t callbacks = {};
+	callbacks.on_trans_done = rmtDone;
+	if (rmt_new_copy_encoder(&encoderConfig, &_encoder) != ESP_OK
+			|| rmt_tx_register_event_callbacks(_channel, &callbacks, this) != ESP_OK
+			|| rmt_enable(_channel) != ESP_OK) {
+		rmt_del_channel(_channel);
+		_channel = nullptr;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Register a function to be called when a frame has been completely sent.
+ * With RMT it is called from the transmit-done ISR; in bit-bang mode it is
+ * called from the sending task right before startZone/startProgram return.
+ * 
+ * @param callback function to call, or nullptr to remove it
+ * @param arg passed unchanged to the callback
+ */
+void HunterRoam::onTransmitDone(HunterTxDoneCallback callback, void *arg) {
+	_txDoneCallback = callback;
+	_txDoneArg = arg;
+}
+
+/**
+ * @return true while a frame is still being clocked out of the bus.
+ */
+bool HunterRoam::isBusy() {
+	return _busy;
+}
+
+/**
+ * Block until the frame currently being sent has completed.
+ * 
+ * @param timeoutMs maximum time to wait in milliseconds
+ * @return true if the bus is idle
+ */
+bool HunterRoam::waitForTransmit(uint32_t timeoutMs) {
+	if (_channel == nullptr || !_busy) {
+		return true;
+	}
+	return rmt_tx_wait_all_done(_channel, (int)timeoutMs) == ESP_OK;
+}
+
+/**
+ * Cut the frame currently being sent short. The controller drops a frame
+ * that does not complete, and the next one starts with a reset impulse, so
+ * the line may be left at whatever level the frame was at.
+ * The transmit-done callback is not called for an aborted frame.
+ * 
+ * @return true if the bus is idle, false if no frame could be stopped
+ * 		(the blocking fallback cannot be interrupted)
+ */
+bool HunterRoam::abortTransmit() {
+	if (!_busy) {
+		return true;
+	}
+	if (_channel == nullptr) {
+		return false;
+	}
+	// Disabling the channel stops the transaction in flight and drops it
+	if (rmt_disable(_channel) != ESP_OK || rmt_enable(_channel) != ESP_OK) {
+		return false;
+	}
+	resetReadback();
+	_txEndUs = esp_timer_get_time();
+	_busy = false;
+	return true;
+}
+
+/**
+ * Capture every frame on a second GPIO, wired to the REM line through a
+ * divider, so verifyTransmit() can tell a frame that was corrupted on the way
+ * out. Call after begin(); needs the RMT transmitter (no bit-banging) and an
+ * RMT receive channel.
+ * 
+ * @param pin GPIO the line is read on
+ * @param inverted true if the tap inverts the level (e.g. a transistor stage)
+ * @return true if readback is on
+ */
+bool HunterRoam::enableReadback(int pin, bool inverted) {
+#if SOC_RMT_SUPPORT_RX_PINGPONG
+	if (_rxChannel != nullptr) {
+		return true;
+	}
+	if (_channel == nullptr) {
+		return false;
+	}
+
+	rmt_rx_channel_config_t channelConfig = {};
+	channelConfig.gpio_num = (gpio_num_t)pin;
+	channelConfig.clk_src = RMT_CLK_SRC_DEFAULT;
+	channelConfig.resolution_hz = HUNTER_RMT_RESOLUTION_HZ;
+	// A frame is about three blocks; the driver copies them out as they fill (partial receive)
+	channelConfig.mem_block_symbols = 48;
+	channelConfig.flags.invert_in = inverted;
+	if (rmt_new_rx_channel(&channelConfig, &_rxChannel) != ESP_OK) {
+		_rxChannel = nullptr;
+		return false;
+	}
+
+	rmt_rx_event_callbacks_t callbacks = {};
+	callbacks.on_recv_done = rmtReceived;
+	esp_timer_create_args_t timerArgs = {};
+	timerArgs.callback = armReadback;
+	timerArgs.arg = this;
+	timerArgs.name = "hunter_rx";
+	_rxDone = xSemaphoreCreateBinary();
+	if (_rxDone == nullptr
+			|| esp_timer_create(&timerArgs, &_rxArmTimer) != ESP_OK
+			|| rmt_rx_register_event_callbacks(_rxChannel, &callbacks, this) != ESP_OK
+			|| rmt_enable(_rxChannel) != ESP_OK) {
+		rmt_del_channel(_rxChannel);
+		_rxChannel = nullptr;
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+ * @return true if frames are read back, see enableReadback()
+ */
+bool HunterRoam::readbackEnabled() {
+	return _rxChannel != nullptr;
+}
+
+/**
+ * Compare the frame captured on the readback pin with the one sent. Call once
+ * the frame has left the bus; the capture ends HUNTER_READBACK_IDLE_US later.
+ * 
+ * @param timeoutMs how long to wait for the capture to end
+ * @return HunterError::None if the frame matches or readback is off,
+ * 		ReadbackMissing if nothing was captured, ReadbackMismatch otherwise
+ */
+HunterError HunterRoam::verifyTransmit(uint32_t timeoutMs) {
+	if (_rxChannel == nullptr) {
+		return HunterError::None;
+	}
+	if (xSemaphoreTake(_rxDone, pdMS_TO_TICKS(timeoutMs)) != pdTRUE) {
+		resetReadback();
+		return HunterError::ReadbackMissing;
+	}
+	if (_rxCount == 0) {
+		return HunterError::ReadbackMissing;
+	}
+	return readbackMatches(_symbols, _numSymbols, _rxSymbols, _rxCount) ? HunterError::None : HunterError::ReadbackMismatch;
+}
+
+/**
+ * Change the reset impulse and gap for the frames sent from now on. Only
+ * from the task that sends the frames, not while one is on the bus.
+ * 
+ * @param timing see validTiming()
+ * @return false if the timing is out of range, the previous one is kept
+ */
+bool HunterRoam::setTiming(const HunterTiming &timing) {
+	if (!validTiming(timing)) {
+		return false;
+	}
+	_timing = timing;
+	return true;
+}
+
+/**
+ * @return the reset impulse and gap frames are sent with
+ */
+HunterTiming HunterRoam::timing() {
+	return _timing;
+}
+
+/**
+ * @return true if the timing lies between HUNTER_MIN_RESET_*_US and the
+ * 		standard one, which the symbol buffer is sized for
+ */
+bool HunterRoam::validTiming(const HunterTiming &timing) {
+	return timing.resetHighUs >= HUNTER_MIN_RESET_HIGH_US && timing.resetHighUs <= HUNTER_STANDARD_TIMING.resetHighUs
+		&& timing.resetLowUs >= HUNTER_MIN_RESET_LOW_US && timing.resetLowUs <= HUNTER_STANDARD_TIMING.resetLowUs;
+}
+
+/**
+ * Drop a capture in progress and any pending arming, ready for the next frame.
+ */
+void HunterRoam::resetReadback() {
+	if (_rxChannel == nullptr) {
+		return;
+	}
+	esp_timer_stop(_rxArmTimer);
+	rmt_disable(_rxChannel);
+	rmt_enable(_rxChannel);
+	xSemaphoreTake(_rxDone, 0);
+}
+
+/**
+ * Sort a high pulse into start, short or long, with the boundaries half way
+ * between the nominal lengths so the lead may stretch or shrink it a lot.
+ */
+static uint8_t pulseClass(uint16_t highUs) {
+	if (highUs < (SHORT_INTERVAL + START_INTERVAL) / 2) {
+		return 0;
+	}
+	return highUs < (START_INTERVAL + LONG_INTERVAL) / 2 ? 1 : 2;
+}
+
+/**
+ * Compare a captured frame with the symbols it was sent from. The reset
+ * impulse is not captured, every pulse after it must be there with the same
+ * meaning; how long the line stays low after each one is not checked.
+ * 
+ * @param sent symbols from encodeSymbols()
+ * @param received symbols captured from the start pulse on
+ * @return true if they carry the same frame
+ */
+bool HunterRoam::readbackMatches(const rmt_symbol_word_t *sent, size_t sentCount, const rmt_symbol_word_t *received, size_t receivedCount) {
+	size_t first = 0;
+	// Constant level symbols make up the reset impulse
+	while (first < sentCount && sent[first].level0 == sent[first].level1) {
+		first++;
+	}
+	if (receivedCount != sentCount - first) {
+		return false;
+	}
+	for (size_t i = 0; i < receivedCount; i++) {
+		if (received[i].level0 != HIGH || pulseClass(received[i].duration0) != pulseClass(sent[first + i].duration0)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @return payload bytes of the last frame handed to the bus
+ */
+size_t HunterRoam::lastFrameBytes() {
+	return _txBytes;
+}
+
+/**
+ * @return esp_timer_get_time() when the last frame was handed to the bus,
+ * 		i.e. after it was encoded, or 0 if nothing has been sent yet.
+ */
+int64_t HunterRoam::lastTransmitStart() {
+	return _txStartUs;
+}
+
+/**
+ * @return esp_timer_get_time() when the last frame finished, or 0 if
+ * 		nothing has been sent yet. Only valid once the frame is done.
+ */
+int64_t HunterRoam::lastTransmitEnd() {
+	return _txEndUs;
+}
+
+/**
+ * RMT receive-done ISR, called for every filled chunk of a capture and once at its end.
+ */
+bool IRAM_ATTR HunterRoam::rmtReceived(rmt_channel_handle_t channel, const rmt_rx_done_event_data_t *edata, void *ctx) {
+	HunterRoam *self = (HunterRoam *)ctx;
+	BaseType_t woken = pdFALSE;
+	self->_rxCount = self->_rxCount + edata->num_symbols;
+	if (edata->flags.is_last) {
+		xSemaphoreGiveFromISR(self->_rxDone, &woken);
+	}
+	return woken == pdTRUE;
+}
+
+/**
+ * esp_timer callback: the reset impulse is over, start capturing the frame.
+ */
+void HunterRoam::armReadback(void *arg) {
+	HunterRoam *self = (HunterRoam *)arg;
+	rmt_receive_config_t config = {};
+	config.signal_range_min_ns = HUNTER_READBACK_GLITCH_NS;
+	config.signal_range_max_ns = HUNTER_READBACK_IDLE_US * 1000UL;
+	config.flags.en_partial_rx = true;
+	if (rmt_receive(self->_rxChannel, self->_rxSymbols, sizeof(self->_rxSymbols), &config) != ESP_OK) {
+		// Reported as a missing frame
+		xSemaphoreGive(self->_rxDone);
+	}
+}
+
+/**
+ * RMT transmit-done ISR.
+ */
+bool IRAM_ATTR HunterRoam::rmtDone(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *ctx) {
+	HunterRoam *self = (HunterRoam *)ctx;
+	self->_txEndUs = esp_timer_get_time();
+	self->_busy = false;
+	if (self->_txDoneCallback != nullptr) {
+		return self->_txDoneCallback(self->_txDoneArg);
+	}
+	return false;
+}
+
+static constexpr const char *errorHints[] = {
+	"No error.",
+	"Invalid zone number.",
+	"Invalid watering time.",
+	"Invalid program number.",
+	"Bus transmit timed out.",
+	"Bus transmit failed.",
+	"Bus transmit aborted.",
+	"Frame not seen on the readback pin.",
+	"Frame read back differs from the one sent.",
+	"Unknown error."
+};
+
+static_assert(sizeof(errorHints) / sizeof(errorHints[0]) == (size_t)HunterError::Unknown + 1,
+		"every HunterError needs a hint");
+// Every zone frame the tables can produce matches the original bit-by-bit encoder
+static_assert(HunterFrames::zoneFramesMatchReference(1, HUNTER_MAX_ZONES),
+		"zone frame tables differ from the original encoder");
+// Bus timings must fit in a single RMT symbol half
+static_assert(START_INTERVAL <= HUNTER_RMT_MAX_DURATION && LONG_INTERVAL <= HUNTER_RMT_MAX_DURATION,
+		"bus intervals too long for an RMT symbol");
+// No valid timing is longer than the standard one
+static_assert(hunterSymbolCount(HUNTER_ZONE_FRAME_LEN, true) <= HUNTER_RMT_MAX_SYMBOLS,
+		"HUNTER_RMT_MAX_SYMBOLS too small for a zone frame");
+// Frames are copied by value on the command path; they must stay plain arrays
+static_assert(std::is_trivially_copyable<HunterFrames::ZoneFrame>::value
+		&& std::is_trivially_copyable<HunterFrames::ProgramFrame>::value,
+		"SmartPort frames must not own heap memory");
+
+/**
+ * Function to convert the error returned by any function
  * to a user-friendly description.
  * 
- * @param error number returned by a public function of this library
+ * @param error value returned by a public function of this library
  */
-String HunterRoam::errorHint(byte error) {
-	switch (error) {
-		case 0:
-			return String("No error.");
-		case 1:
-			return String("Invalid zone number.");
-		case 2:
-			return String("Invalid watering time.");
-		case 3:
-			return String("Invalid program number.");
-		default:
-			return String("Unknonwn error.");
+const char *HunterRoam::errorHint(HunterError error) {
+	size_t index = (size_t)error;
+	if (index >= sizeof(errorHints) / sizeof(errorHints[0])) {
+		index = (size_t)HunterError::Unknown;
 	}
+	return errorHints[index];
 }
 
 /**
@@ -80,18 +435,125 @@ void HunterRoam::sendHigh() {
 	delayMicroseconds(SHORT_INTERVAL);
 }
 
+/**
+ * Append a constant level to an RMT symbol buffer. Durations longer than a
+ * symbol can hold are spread over as many symbols as needed.
+ * 
+ * @param level HIGH or LOW
+ * @param durationUs how long to hold the level, in microseconds
+ */
+static void appendLevel(rmt_symbol_word_t *symbols, size_t &count, size_t maxSymbols, byte level, uint32_t durationUs) {
+	uint32_t parts = (durationUs + 2 * HUNTER_RMT_MAX_DURATION - 1) / (2 * HUNTER_RMT_MAX_DURATION);
+	for (uint32_t i = 0; i < parts && count < maxSymbols; i++) {
+		// Share the duration evenly, the first symbols take the remainder
+		uint32_t share = durationUs / parts + (i < durationUs % parts ? 1 : 0);
+		rmt_symbol_word_t &symbol = symbols[count++];
+		symbol.level0 = level;
+		symbol.duration0 = share / 2;
+		symbol.level1 = level;
+		symbol.duration1 = share - share / 2;
+	}
+}
+
+/**
+ * Append a high pulse followed by a low gap as a single RMT symbol.
+ */
+static void appendPulse(rmt_symbol_word_t *symbols, size_t &count, size_t maxSymbols, uint16_t highUs, uint16_t lowUs) {
+	if (count >= maxSymbols) {
+		return;
+	}
+	rmt_symbol_word_t &symbol = symbols[count++];
+	symbol.level0 = HIGH;
+	symbol.duration0 = highUs;
+	symbol.level1 = LOW;
+	symbol.duration1 = lowUs;
+}
+
+/**
+ * Encode a frame into RMT symbols (1 tick = 1 us), with exactly the timing
+ * the bit-banged writer produces.
+ * 
+ * @param buffer blob containing the bits to transmit
+ * @param length number of bytes in buffer
+ * @param extrabit if true, then write an extra 1 bit
+ * @param symbols where to write the symbols
+ * @param maxSymbols capacity of symbols, HUNTER_RMT_MAX_SYMBOLS is enough for any frame
+ * @param timing reset impulse and gap to start the frame with
+ * @return number of symbols written
+ */
+size_t HunterRoam::encodeSymbols(const byte *buffer, size_t length, bool extrabit, rmt_symbol_word_t *symbols, size_t maxSymbols,
+		const HunterTiming &timing) {
+	size_t count = 0;
+
+	// Resetimpulse
+	appendLevel(symbols, count, maxSymbols, HIGH, timing.resetHighUs);
+	appendLevel(symbols, count, maxSymbols, LOW, timing.resetLowUs);
+
+	// Startimpulse
+	appendPulse(symbols, count, maxSymbols, START_INTERVAL, SHORT_INTERVAL);
+
+	// High order bits first, same as sendHigh()/sendLow()
+	for (size_t i = 0; i < length; i++) {
+		for (byte inner = 0; inner < 8; inner++) {
+			bool high = buffer[i] & (0x80 >> inner);
+			appendPulse(symbols, count, maxSymbols, high ? LONG_INTERVAL : SHORT_INTERVAL, high ? SHORT_INTERVAL : LONG_INTERVAL);
+		}
+	}
+
+	// Include an extra 1 bit
+	if (extrabit) {
+		appendPulse(symbols, count, maxSymbols, LONG_INTERVAL, SHORT_INTERVAL);
+	}
+
+	// Write the stop pulse
+	appendPulse(symbols, count, maxSymbols, SHORT_INTERVAL, LONG_INTERVAL);
+
+	return count;
+}
+
 /**
  * Write the bit sequence out of the bus
  * 
+ * With RMT this only encodes the frame and starts the transfer; it returns as
+ * soon as the previous frame (if any) has left the bus.
+ * 
  * @param buffer blob containing the bits to transmit
+ * @param length number of bytes in buffer
  * @param extrabit if true, then write an extra 1 bit
  */
-void HunterRoam::writeBus(std::vector<byte> buffer, bool extrabit) {
+HunterError HunterRoam::writeBus(const byte *buffer, size_t length, bool extrabit) {
+	_txBytes = length;
+	if (_channel != nullptr) {
+		// The symbol buffer is read by the driver until the transfer is done
+		rmt_tx_wait_all_done(_channel, -1);
+		_numSymbols = encodeSymbols(buffer, length, extrabit, _symbols, HUNTER_RMT_MAX_SYMBOLS, _timing);
+
+		rmt_transmit_config_t transmitConfig = {};
+		transmitConfig.loop_count = 0;
+		transmitConfig.flags.eot_level = LOW;
+		_busy = true;
+		_txStartUs = esp_timer_get_time();
+		if (_rxChannel != nullptr) {
+			// Also drops a capture left over from a frame that was never verified
+			resetReadback();
+			_rxCount = 0;
+			esp_timer_start_once(_rxArmTimer, _timing.resetHighUs + _timing.resetLowUs / 2);
+		}
+		if (rmt_transmit(_channel, _encoder, _symbols, _numSymbols * sizeof(rmt_symbol_word_t), &transmitConfig) != ESP_OK) {
+			resetReadback();
+			_busy = false;
+			return HunterError::TransmitFailed;
+		}
+		return HunterError::None;
+	}
+
+	_txStartUs = esp_timer_get_time();
+
 	// Resetimpulse
 	digitalWrite(_pin, HIGH);
-	delay(325); //milliseconds
+	delay(_timing.resetHighUs / 1000); //milliseconds
 	digitalWrite(_pin, LOW);
-	delay(65); //milliseconds
+	delay(_timing.resetLowUs / 1000); //milliseconds
 
 	// Startimpulse
 	digitalWrite(_pin, HIGH);
@@ -100,7 +562,8 @@ void HunterRoam::writeBus(std::vector<byte> buffer, bool extrabit) {
 	delayMicroseconds(SHORT_INTERVAL);
 
 	// Write the bits out
-	for (auto &sendByte : buffer) {
+	for (size_t i = 0; i < length; i++) {
+		byte sendByte = buffer[i];
 		for (byte inner = 0; inner < 8; inner++) {
 			// Send high order bits first
 			(sendByte & 0x80) ? sendHigh() : sendLow();
@@ -115,27 +578,12 @@ void HunterRoam::writeBus(std::vector<byte> buffer, bool extrabit) {
 
 	// Write the stop pulse
 	sendLow();
-}
 
-/**	
- * Set a value with an arbitrary bit width to a bit position within a blob.
- * 
- * @param bits blob to write the value to
- * @param pos position within the blob
- * @param val to write
- * @param len in bits of the value
- */
-void HunterRoam::hunterBitfield(std::vector <byte> &bits, byte pos, byte val, byte len) {
-	while (len > 0) {
-		if (val & 0x1) {
-			bits[pos / 8] = bits[pos / 8] | 0x80 >> (pos % 8);
-		} else {
-			bits[pos / 8] = bits[pos / 8] & ~(0x80 >> (pos % 8));
-		}
-		len--;
-		val = val >> 1;
-		pos++;
+	_txEndUs = esp_timer_get_time();
+	if (_txDoneCallback != nullptr) {
+		_txDoneCallback(_txDoneArg);
 	}
+	return HunterError::None;
 }
 
 /**
@@ -144,57 +592,39 @@ void HunterRoam::hunterBitfield(std::vector <byte> &bits, byte pos, byte val, by
  * @param zone zone number (1-48)
  * @param time time in minutes (0-240)
  */
-byte HunterRoam::startZone(byte zone, byte time) {
-
-	// Start out with a base frame
-	std::vector<byte> buffer = {0xff,0x00,0x00,0x00,0x10,0x00,0x00,0x04,0x00,0x00,0x01,0x00,0x01,0xb8,0x3f};
-
-	if (zone < 1 || zone > 48) {
-		return 1;
-	}
+HunterError HunterRoam::startZone(byte zone, byte time) {
+	HunterFrames::ZoneFrame frame;
+	HunterError err = encodeZone(zone, time, frame);
 
-	if (time < 0 || time > 240) {
-		return 2;
+	if (err != HunterError::None) {
+		return err;
 	}
 
-	// The bus protocol is a little bizzare, not sure why
+	// Write the bits out of the bus
+	return writeBus(frame, true);
+}
 
-	// Bits 9:10 are 0x1 for zones > 12 and 0x2 otherwise
-	if (zone > 12) {
-		hunterBitfield(buffer, 9, 0x1, 2);
-	} else {
-		hunterBitfield(buffer, 9, 0x2, 2);
+/**
+ * Build the frame that starts a zone, without sending it.
+ * 
+ * @param zone zone number (1-48)
+ * @param time time in minutes (0-240)
+ * @param frame receives the frame
+ */
+HunterError HunterRoam::encodeZone(byte zone, byte time, HunterFrames::ZoneFrame &frame) {
+	if (zone < 1 || zone > HUNTER_MAX_ZONES) {
+		return HunterError::InvalidZone;
 	}
 
-	// Zone + 0x17 is at bits 23:29 and 36:42
-	hunterBitfield(buffer, 23, zone + 0x17, 7);
-	hunterBitfield(buffer, 36, zone + 0x17, 7);
-
-	// Zone + 0x23 is at bits 49:55 and 62:68
-	hunterBitfield(buffer, 49, zone + 0x23, 7);
-	hunterBitfield(buffer, 62, zone + 0x23, 7);
-
-	// Zone + 0x2f is at bits 75:81 and 88:94
-	hunterBitfield(buffer, 75, zone + 0x2f, 7);
-	hunterBitfield(buffer, 88, zone + 0x2f, 7);
-
-	// Time is encoded in three places and broken up by nibble
-	// Low nibble: bits 31:34, 57:60, and 83:86
-	// High nibble: bits 44:47, 70:73, and 96:99
-	hunterBitfield(buffer, 31, time, 4);
-	hunterBitfield(buffer, 44, time >> 4, 4);
-	hunterBitfield(buffer, 57, time, 4);
-	hunterBitfield(buffer, 70, time >> 4, 4);
-	hunterBitfield(buffer, 83, time, 4);
-	hunterBitfield(buffer, 96, time >> 4, 4);
-
-	// Bottom nibble of zone - 1 is at bits 109:112
-	hunterBitfield(buffer, 109, zone - 1, 4);
+	if (time > 240) {
+		return HunterError::InvalidTime;
+	}
 
-	// Write the bits out of the bus
-	writeBus(buffer, true);
+	// Start out with the precomputed frame for this zone and fill in the time
+	frame = HunterFrames::zoneFrames[zone - 1];
+	HunterFrames::setZoneTime(frame, time);
 
-	return 0;
+	return HunterError::None;
 }
 
 /**
@@ -202,7 +632,7 @@ byte HunterRoam::startZone(byte zone, byte time) {
  * 
  * @param zone - zone number (1-48)
  */
-byte HunterRoam::stopZone(byte zone) {
+HunterError HunterRoam::stopZone(byte zone) {
 	return startZone(zone, 0);
 }
 
@@ -211,17 +641,10 @@ byte HunterRoam::stopZone(byte zone) {
  * 
  * @param num - program number (1-4)
  */
-byte HunterRoam::startProgram(byte num) {
-	// Start with a basic program frame
-	std::vector<byte> buffer = {0xff, 0x40, 0x03, 0x96, 0x09 ,0xbd ,0x7f};
-
-	if (num < 1 || num > 4) {
-		return 3;
+HunterError HunterRoam::startProgram(byte num) {
+	if (num < 1 || num > HUNTER_MAX_PROGRAMS) {
+		return HunterError::InvalidProgram;
 	}
 
-	// Program number - 1 is at bits 31:32
-	hunterBitfield(buffer, 31, num - 1, 2);
-	writeBus(buffer, false);
-
-	return 0;
-}
\ No newline at end of file
+	return writeBus(HunterFrames::programFrames[num - 1], false);
+}
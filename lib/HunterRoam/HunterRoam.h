@@ -3,29 +3,150 @@
 #ifndef HunterRoam_h
 #define HunterRoam_h
 
-#include <vector>
 #include <Arduino.h>
+#include "driver/rmt_tx.h"
+#include "driver/rmt_rx.h"
+#include "esp_timer.h"
+#include "HunterFrames.h"
 
 #define START_INTERVAL 900
 #define SHORT_INTERVAL 208
 #define LONG_INTERVAL 1875
 
+// Standard reset impulse and the gap after it, see HunterTiming
+#define RESET_HIGH_MS 325
+#define RESET_LOW_MS 65
+
+// Shortest reset impulse and gap setTiming() accepts. Below them the readback
+// has no room to arm inside the gap, and no controller is known to cope anyway.
+#define HUNTER_MIN_RESET_HIGH_US 100000
+#define HUNTER_MIN_RESET_LOW_US 20000
+
 #define HUNTER_PIN 16 // D0
 
+// RMT tick is 1 us so the intervals above can be used as durations directly.
+#define HUNTER_RMT_RESOLUTION_HZ 1000000
+// A symbol half holds at most 15 bits of duration.
+#define HUNTER_RMT_MAX_DURATION 32767
+// Reset/gap symbols + start + 15 bytes of data + extra bit + stop, with some headroom.
+#define HUNTER_RMT_MAX_SYMBOLS 144
+
+// Readback: the receiver is armed half way through the gap after the reset
+// impulse, so it captures from the start pulse on. The line staying at one
+// level this long ends the capture; longer than any bit.
+#define HUNTER_READBACK_IDLE_US 10000
+// Edges closer together than this are noise on the lead
+#define HUNTER_READBACK_GLITCH_NS 2000
+
+/**
+ * Reset impulse that starts every frame and the gap before its start pulse.
+ * The bit timings are fixed, but some controllers take a frame after a much
+ * shorter reset than the standard one, which is most of a frame's length.
+ */
+struct HunterTiming {
+    uint32_t resetHighUs;
+    uint32_t resetLowUs;
+};
+
+constexpr HunterTiming HUNTER_STANDARD_TIMING = {RESET_HIGH_MS * 1000UL, RESET_LOW_MS * 1000UL};
+
+/**
+ * Time a frame of the given length keeps the bus busy, in microseconds.
+ */
+constexpr uint32_t hunterFrameDurationUs(size_t length, bool extrabit, HunterTiming timing = HUNTER_STANDARD_TIMING) {
+    return timing.resetHighUs + timing.resetLowUs + START_INTERVAL + SHORT_INTERVAL
+        + (8 * length + (extrabit ? 1 : 0) + 1) * (SHORT_INTERVAL + LONG_INTERVAL);
+}
+
+/**
+ * Number of RMT symbols encodeSymbols() produces for a frame of the given length.
+ */
+constexpr size_t hunterSymbolCount(size_t length, bool extrabit, HunterTiming timing = HUNTER_STANDARD_TIMING) {
+    return (timing.resetHighUs + 2 * HUNTER_RMT_MAX_DURATION - 1) / (2 * HUNTER_RMT_MAX_DURATION)
+        + (timing.resetLowUs + 2 * HUNTER_RMT_MAX_DURATION - 1) / (2 * HUNTER_RMT_MAX_DURATION)
+        + 1 + 8 * length + (extrabit ? 1 : 0) + 1;
+}
+
+/**
+ * Result of every public bus function. HunterRoam::errorHint() gives a
+ * user friendly description.
+ */
+enum class HunterError : byte {
+    None = 0,
+    InvalidZone,
+    InvalidTime,
+    InvalidProgram,
+    TransmitTimeout,
+    TransmitFailed,
+    TransmitAborted,
+    ReadbackMissing,
+    ReadbackMismatch,
+    Unknown
+};
+
+/**
+ * Called once the last symbol of a frame has left the RMT peripheral.
+ * Runs in ISR context: keep it short and only use the *FromISR FreeRTOS calls.
+ * Return true if a higher priority task was woken.
+ */
+typedef bool (*HunterTxDoneCallback)(void *arg);
+
 class HunterRoam {
     public:
         HunterRoam(int pin);
-        byte stopZone(byte zone);
-        byte startZone(byte zone, byte time);
-        byte startProgram(byte num);
-        String errorHint(byte error);
+        bool begin();
+        HunterError stopZone(byte zone);
+        HunterError startZone(byte zone, byte time);
+        HunterError startProgram(byte num);
+        static const char *errorHint(HunterError error);
+        void onTransmitDone(HunterTxDoneCallback callback, void *arg);
+        bool isBusy();
+        bool waitForTransmit(uint32_t timeoutMs);
+        bool abortTransmit();
+        bool enableReadback(int pin, bool inverted = false);
+        bool readbackEnabled();
+        HunterError verifyTransmit(uint32_t timeoutMs);
+        bool setTiming(const HunterTiming &timing);
+        HunterTiming timing();
+        static bool validTiming(const HunterTiming &timing);
+        int64_t lastTransmitStart();
+        int64_t lastTransmitEnd();
+        size_t lastFrameBytes();
+        static HunterError encodeZone(byte zone, byte time, HunterFrames::ZoneFrame &frame);
+        static size_t encodeSymbols(const byte *buffer, size_t length, bool extrabit, rmt_symbol_word_t *symbols, size_t maxSymbols,
+                                    const HunterTiming &timing = HUNTER_STANDARD_TIMING);
+        static bool readbackMatches(const rmt_symbol_word_t *sent, size_t sentCount, const rmt_symbol_word_t *received, size_t receivedCount);
     
     private:
         int _pin;
-        void hunterBitfield(std::vector <byte> &bits, byte pos, byte val, byte len);
-        void writeBus(std::vector<byte> buffer, bool extrabit);
+        HunterTiming _timing = HUNTER_STANDARD_TIMING;
+        rmt_channel_handle_t _channel = nullptr;
+        rmt_encoder_handle_t _encoder = nullptr;
+        rmt_symbol_word_t _symbols[HUNTER_RMT_MAX_SYMBOLS];
+        size_t _numSymbols = 0;
+        volatile bool _busy = false;
+        volatile int64_t _txStartUs = 0; // esp_timer_get_time() of the first edge of the last frame
+        volatile int64_t _txEndUs = 0;   // and of its end, set from the transmit-done ISR
+        size_t _txBytes = 0;             // payload of the last frame
+        HunterTxDoneCallback _txDoneCallback = nullptr;
+        void *_txDoneArg = nullptr;
+        rmt_channel_handle_t _rxChannel = nullptr;
+        rmt_symbol_word_t _rxSymbols[HUNTER_RMT_MAX_SYMBOLS];
+        volatile size_t _rxCount = 0;
+        SemaphoreHandle_t _rxDone = nullptr;
+        esp_timer_handle_t _rxArmTimer = nullptr;
+
+        template <size_t N>
+        HunterError writeBus(const std::array<byte, N> &frame, bool extrabit) {
+            return writeBus(frame.data(), N, extrabit);
+        }
+        HunterError writeBus(const byte *buffer, size_t length, bool extrabit);
         void sendLow(void);
         void sendHigh(void);
+        void resetReadback();
+        static bool rmtDone(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *ctx);
+        static bool rmtReceived(rmt_channel_handle_t channel, const rmt_rx_done_event_data_t *edata, void *ctx);
+        static void armReadback(void *arg);
 };
 
 #endif
@@ -0,0 +1,122 @@
+/**
+ * Latency histograms for the command path, from the Zigbee callback to the
+ * last edge on the SmartPort bus.
+ *
+ * Timestamps come from esp_timer_get_time() rather than the CPU cycle counter:
+ * with power management the CPU clock changes (and stops in light sleep), so
+ * cycle counts cannot be turned back into time.
+ */
+
+#include "LatencyStats.h"
+
+/**
+ * Record every stage of a handled command. Stages the command did not go
+ * through (their timestamps are 0) are left out.
+ *
+ * @param timing BusCommand::timing as passed to the BusResultCallback
+ */
+void LatencyStats::record(const BusTiming &timing) {
+    record(LATENCY_CALLBACK, timing.requestedUs, timing.queuedUs);
+    record(LATENCY_QUEUED, timing.queuedUs, timing.dequeuedUs);
+    record(LATENCY_ENCODE, timing.dequeuedUs, timing.sentUs);
+    record(LATENCY_TRANSMIT, timing.sentUs, timing.doneUs);
+    record(LATENCY_TOTAL, timing.requestedUs, timing.doneUs);
+
+    portENTER_CRITICAL(&_lock);
+    _samples++;
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * Record one stage.
+ *
+ * @param stage stage to add the sample to
+ * @param fromUs esp_timer_get_time() when the stage started, 0 if it did not
+ * @param toUs esp_timer_get_time() when it ended, 0 if it did not
+ */
+void LatencyStats::record(LatencyStage stage, int64_t fromUs, int64_t toUs) {
+    if (stage >= LATENCY_STAGES || fromUs == 0 || toUs < fromUs) {
+        return;
+    }
+    int64_t elapsed = toUs - fromUs;
+    uint32_t us = elapsed > (int64_t)UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+    uint8_t bucket = bucketFor(us);
+
+    portENTER_CRITICAL(&_lock);
+    LatencyHistogram &histogram = _stages[stage];
+    histogram.buckets[bucket]++;
+    histogram.count++;
+    if (us > histogram.maxUs) {
+        histogram.maxUs = us;
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * Copy one stage's histogram.
+ */
+void LatencyStats::snapshot(LatencyStage stage, LatencyHistogram &histogram) {
+    if (stage >= LATENCY_STAGES) {
+        histogram = {};
+        return;
+    }
+    portENTER_CRITICAL(&_lock);
+    histogram = _stages[stage];
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * @return number of commands recorded since boot or the last reset()
+ */
+uint32_t LatencyStats::samples() {
+    portENTER_CRITICAL(&_lock);
+    uint32_t samples = _samples;
+    portEXIT_CRITICAL(&_lock);
+    return samples;
+}
+
+/**
+ * Clear all histograms.
+ */
+void LatencyStats::reset() {
+    portENTER_CRITICAL(&_lock);
+    memset(_stages, 0, sizeof(_stages));
+    _samples = 0;
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * @return the histogram bucket a duration falls in
+ */
+uint8_t LatencyStats::bucketFor(uint32_t us) {
+    uint8_t bucket = 0;
+    while (us > 1 && bucket < LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/**
+ * Estimate a percentile from the histogram.
+ *
+ * @param percent 1-100
+ * @return upper edge of the bucket holding the percentile in microseconds,
+ * 		capped at the largest sample, or 0 if the histogram is empty
+ */
+uint32_t LatencyHistogram::percentileUs(uint8_t percent) const {
+    if (count == 0) {
+        return 0;
+    }
+    // Rank of the sample we are after, rounded up
+    uint32_t rank = ((uint64_t)count * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank && i < LATENCY_BUCKETS - 1) {
+            uint32_t upper = (2UL << i) - 1;
+            return upper < maxUs ? upper : maxUs;
+        }
+    }
+    return maxUs;
+}
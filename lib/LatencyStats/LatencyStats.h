@@ -0,0 +1,57 @@
+#pragma once
+
+#ifndef LatencyStats_h
+#define LatencyStats_h
+
+#include <Arduino.h>
+#include "BusScheduler.h"
+
+// Bucket 0 counts samples under 2 us, bucket i (> 0) the ones in [2^i, 2^(i+1)) us
+// and the last one everything slower, so 24 buckets reach past 8 s.
+#define LATENCY_BUCKETS 24
+
+/**
+ * Command latency split into the stages of BusTiming.
+ */
+enum LatencyStage : uint8_t {
+    LATENCY_CALLBACK,  // callback entry to queue push
+    LATENCY_QUEUED,    // queue push to the bus task picking it up
+    LATENCY_ENCODE,    // frame encode until the frame is handed to the bus
+    LATENCY_TRANSMIT,  // first to last edge on the bus
+    LATENCY_TOTAL,     // callback entry to the end of the frame
+    LATENCY_STAGES
+};
+
+/**
+ * Copy of one stage's histogram, taken with LatencyStats::snapshot().
+ */
+struct LatencyHistogram {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t maxUs;
+
+    uint32_t percentileUs(uint8_t percent) const;
+};
+
+/**
+ * Fixed-size log2 histograms of the time commands spend in each stage on
+ * their way to the bus. Recording is O(1) and never allocates, so it can be
+ * called from the bus tasks; reading takes a consistent copy.
+ */
+class LatencyStats {
+    public:
+        void record(const BusTiming &timing);
+        void record(LatencyStage stage, int64_t fromUs, int64_t toUs);
+        void snapshot(LatencyStage stage, LatencyHistogram &histogram);
+        uint32_t samples();
+        void reset();
+
+        static uint8_t bucketFor(uint32_t us);
+
+    private:
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+        LatencyHistogram _stages[LATENCY_STAGES] = {};
+        uint32_t _samples = 0; // commands recorded, for telling whether anything changed
+};
+
+#endif
@@ -0,0 +1,220 @@
+/**
+ * On-device watering sequence, see SequenceEngine.h.
+ *
+ * Programs are written as a compact byte string:
+ * 		byte 0       format version (SEQUENCE_VERSION)
+ * 		byte 1       number of steps (1-SEQUENCE_MAX_STEPS)
+ * 		byte 2 + 2i  zone of step i
+ * 		byte 3 + 2i  minutes of step i
+ * e.g. {1, 2, 1, 10, 2, 30} runs zone 1 for 10 minutes, then zone 2 for 30.
+ */
+
+#include "SequenceEngine.h"
+
+/**
+ * Constructor for the object SequenceEngine.
+ *
+ * @param zoneCount highest zone number a step may use
+ * @param maxMinutes longest step allowed, in minutes
+ */
+SequenceEngine::SequenceEngine(uint8_t zoneCount, uint8_t maxMinutes)
+    : _zoneCount(zoneCount), _maxMinutes(maxMinutes) {
+}
+
+/**
+ * Replace the program. Refused while a run is in progress.
+ *
+ * @param data encoded program, see the top of this file
+ * @param length number of bytes in data
+ * @return false if the program is malformed or a run is in progress; the
+ * 		previous program is kept
+ */
+bool SequenceEngine::load(const uint8_t *data, size_t length) {
+    if (_state == SEQUENCE_RUNNING) {
+        return false;
+    }
+    SequenceStep steps[SEQUENCE_MAX_STEPS];
+    uint8_t count;
+    if (!parse(data, length, steps, count)) {
+        _state = SEQUENCE_INVALID;
+        return false;
+    }
+    memcpy(_steps, steps, count * sizeof(SequenceStep));
+    _stepCount = count;
+    _state = SEQUENCE_IDLE;
+    return true;
+}
+
+/**
+ * Encode the current program.
+ *
+ * @param data where to write it, SEQUENCE_MAX_BYTES is always enough
+ * @param size capacity of data
+ * @return number of bytes written, 0 if it does not fit
+ */
+size_t SequenceEngine::encode(uint8_t *data, size_t size) {
+    size_t length = SEQUENCE_HEADER_BYTES + _stepCount * SEQUENCE_STEP_BYTES;
+    if (length > size) {
+        return 0;
+    }
+    data[0] = SEQUENCE_VERSION;
+    data[1] = _stepCount;
+    for (uint8_t i = 0; i < _stepCount; i++) {
+        data[SEQUENCE_HEADER_BYTES + i * SEQUENCE_STEP_BYTES] = _steps[i].zone;
+        data[SEQUENCE_HEADER_BYTES + i * SEQUENCE_STEP_BYTES + 1] = _steps[i].minutes;
+    }
+    return length;
+}
+
+/**
+ * Store the program in NVS so it survives a reset.
+ *
+ * @return true if it was written
+ */
+bool SequenceEngine::save() {
+    uint8_t data[SEQUENCE_MAX_BYTES];
+    size_t length = encode(data, sizeof(data));
+    Preferences prefs;
+    if (!prefs.begin(SEQUENCE_NAMESPACE, false)) {
+        return false;
+    }
+    bool ok = prefs.putBytes("program", data, length) == length;
+    prefs.end();
+    return ok;
+}
+
+/**
+ * Load the program stored by save().
+ *
+ * @return false if there is none or it no longer fits the configuration
+ */
+bool SequenceEngine::restore() {
+    uint8_t data[SEQUENCE_MAX_BYTES];
+    Preferences prefs;
+    if (!prefs.begin(SEQUENCE_NAMESPACE, true)) {
+        return false;
+    }
+    size_t length = prefs.getBytes("program", data, sizeof(data));
+    prefs.end();
+    if (length == 0) {
+        return false;
+    }
+    bool ok = load(data, length);
+    if (!ok) {
+        // A stale program is not an error the user needs to see as the state
+        _state = SEQUENCE_IDLE;
+    }
+    return ok;
+}
+
+/**
+ * Start a run from the first step.
+ *
+ * @param first set to the step to turn on
+ * @return false if there is no program or a run is already in progress
+ */
+bool SequenceEngine::start(SequenceStep &first) {
+    if (_stepCount == 0 || _state == SEQUENCE_RUNNING) {
+        return false;
+    }
+    _current = 0;
+    _state = SEQUENCE_RUNNING;
+    first = _steps[0];
+    return true;
+}
+
+/**
+ * The running step is over, move to the next one.
+ *
+ * @param next set to the step to turn on
+ * @return false if the run is complete (or not running)
+ */
+bool SequenceEngine::advance(SequenceStep &next) {
+    if (_state != SEQUENCE_RUNNING) {
+        return false;
+    }
+    if (++_current >= _stepCount) {
+        _state = SEQUENCE_DONE;
+        return false;
+    }
+    next = _steps[_current];
+    return true;
+}
+
+/**
+ * Stop the run early.
+ *
+ * @param current set to the step that was running
+ * @return false if no run was in progress
+ */
+bool SequenceEngine::abort(SequenceStep &current) {
+    if (_state != SEQUENCE_RUNNING) {
+        return false;
+    }
+    current = _steps[_current];
+    _state = SEQUENCE_ABORTED;
+    return true;
+}
+
+/**
+ * Leave out the rest of the run, from the step that was about to start.
+ *
+ * @param skipped set to that step
+ * @return false if no run was in progress
+ */
+bool SequenceEngine::skip(SequenceStep &skipped) {
+    if (_state != SEQUENCE_RUNNING) {
+        return false;
+    }
+    skipped = _steps[_current];
+    _state = SEQUENCE_SKIPPED;
+    return true;
+}
+
+/**
+ * @param step set to the running step
+ * @return false if no run is in progress
+ */
+bool SequenceEngine::current(SequenceStep &step) {
+    if (_state != SEQUENCE_RUNNING) {
+        return false;
+    }
+    step = _steps[_current];
+    return true;
+}
+
+SequenceState SequenceEngine::state() {
+    return _state;
+}
+
+/**
+ * @return the running step (1-based), or 0 when no run is in progress
+ */
+uint8_t SequenceEngine::stepNumber() {
+    return _state == SEQUENCE_RUNNING ? _current + 1 : 0;
+}
+
+uint8_t SequenceEngine::stepCount() {
+    return _stepCount;
+}
+
+/**
+ * Validate an encoded program and decode its steps.
+ */
+bool SequenceEngine::parse(const uint8_t *data, size_t length, SequenceStep *steps, uint8_t &count) {
+    if (length < SEQUENCE_HEADER_BYTES || data[0] != SEQUENCE_VERSION) {
+        return false;
+    }
+    count = data[1];
+    if (count < 1 || count > SEQUENCE_MAX_STEPS || length != (size_t)(SEQUENCE_HEADER_BYTES + count * SEQUENCE_STEP_BYTES)) {
+        return false;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        steps[i].zone = data[SEQUENCE_HEADER_BYTES + i * SEQUENCE_STEP_BYTES];
+        steps[i].minutes = data[SEQUENCE_HEADER_BYTES + i * SEQUENCE_STEP_BYTES + 1];
+        if (steps[i].zone < 1 || steps[i].zone > _zoneCount || steps[i].minutes < 1 || steps[i].minutes > _maxMinutes) {
+            return false;
+        }
+    }
+    return true;
+}
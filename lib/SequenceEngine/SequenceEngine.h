@@ -0,0 +1,66 @@
+#pragma once
+
+#ifndef SequenceEngine_h
+#define SequenceEngine_h
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#define SEQUENCE_MAX_STEPS 16
+#define SEQUENCE_VERSION 1
+// Encoded program: version, step count, then zone and minutes for every step
+#define SEQUENCE_HEADER_BYTES 2
+#define SEQUENCE_STEP_BYTES 2
+#define SEQUENCE_MAX_BYTES (SEQUENCE_HEADER_BYTES + SEQUENCE_MAX_STEPS * SEQUENCE_STEP_BYTES)
+#define SEQUENCE_NAMESPACE "sequence"
+
+struct SequenceStep {
+    uint8_t zone;    // 1 to the zone count
+    uint8_t minutes; // run time, at least 1
+};
+
+enum SequenceState : uint8_t {
+    SEQUENCE_IDLE,    // nothing has run since boot or since a new program
+    SEQUENCE_RUNNING,
+    SEQUENCE_DONE,    // last run completed
+    SEQUENCE_ABORTED, // last run was stopped early
+    SEQUENCE_INVALID, // the last program written was rejected, the previous one is kept
+    SEQUENCE_SKIPPED  // last run was left out from a step on, because a skip rule held
+};
+
+/**
+ * Watering program run on the device: an ordered list of zones and how long
+ * each one runs, one zone at a time.
+ *
+ * The engine only keeps the program and the position in it; the caller
+ * switches the zones and times the steps (e.g. with a DeadlineTimer), calling
+ * advance() when a step is over. Not thread-safe, use it from one task.
+ */
+class SequenceEngine {
+    public:
+        SequenceEngine(uint8_t zoneCount, uint8_t maxMinutes);
+        bool load(const uint8_t *data, size_t length);
+        size_t encode(uint8_t *data, size_t size);
+        bool save();
+        bool restore();
+        bool start(SequenceStep &first);
+        bool advance(SequenceStep &next);
+        bool abort(SequenceStep &current);
+        bool skip(SequenceStep &skipped);
+        bool current(SequenceStep &step);
+        SequenceState state();
+        uint8_t stepNumber();
+        uint8_t stepCount();
+
+    private:
+        uint8_t _zoneCount;
+        uint8_t _maxMinutes;
+        SequenceStep _steps[SEQUENCE_MAX_STEPS];
+        uint8_t _stepCount = 0;
+        uint8_t _current = 0; // index of the running step
+        SequenceState _state = SEQUENCE_IDLE;
+
+        bool parse(const uint8_t *data, size_t length, SequenceStep *steps, uint8_t &count);
+};
+
+#endif
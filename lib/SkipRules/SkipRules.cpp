@@ -0,0 +1,235 @@
+/**
+ * Skip rules of the on-device schedule, see SkipRules.h.
+ *
+ * Rules are written as a compact byte string:
+ * 		byte 0       format version (SKIP_RULES_VERSION)
+ * 		byte 1       number of rules (0-SKIP_RULES_MAX, 0 never skips)
+ * 		byte 2 + 3i  SkipInput of rule i
+ * 		byte 3 + 3i  SkipComparison of rule i
+ * 		byte 4 + 3i  threshold of rule i
+ * e.g. {1, 2, 0, 0, 60, 1, 2, 1} skips while the rain chance is above 60 %
+ * or the rain sensor is wet.
+ */
+
+#include "SkipRules.h"
+
+/**
+ * Replace the rules.
+ *
+ * @param data encoded rules, see the top of this file
+ * @param length number of bytes in data
+ * @return false if the rules are malformed; the previous ones are kept
+ */
+bool SkipRules::load(const uint8_t *data, size_t length) {
+    Rule rules[SKIP_RULES_MAX];
+    uint8_t count;
+    if (!parse(data, length, rules, count)) {
+        return false;
+    }
+    memcpy(_rules, rules, count * sizeof(Rule));
+    _ruleCount = count;
+    evaluate();
+    return true;
+}
+
+/**
+ * Encode the current rules.
+ *
+ * @param data where to write them, SKIP_RULES_MAX_BYTES is always enough
+ * @param size capacity of data
+ * @return number of bytes written, 0 if they do not fit
+ */
+size_t SkipRules::encode(uint8_t *data, size_t size) {
+    size_t length = SKIP_RULES_HEADER_BYTES + _ruleCount * SKIP_RULES_RULE_BYTES;
+    if (length > size) {
+        return 0;
+    }
+    data[0] = SKIP_RULES_VERSION;
+    data[1] = _ruleCount;
+    for (uint8_t i = 0; i < _ruleCount; i++) {
+        uint8_t *rule = data + SKIP_RULES_HEADER_BYTES + i * SKIP_RULES_RULE_BYTES;
+        rule[0] = _rules[i].input;
+        rule[1] = _rules[i].comparison;
+        rule[2] = _rules[i].threshold;
+    }
+    return length;
+}
+
+/**
+ * Store the rules in NVS so they survive a reset. Input values are not stored.
+ *
+ * @return true if they were written
+ */
+bool SkipRules::save() {
+    uint8_t data[SKIP_RULES_MAX_BYTES];
+    size_t length = encode(data, sizeof(data));
+    Preferences prefs;
+    if (!prefs.begin(SKIP_RULES_NAMESPACE, false)) {
+        return false;
+    }
+    bool ok = prefs.putBytes("rules", data, length) == length;
+    prefs.end();
+    return ok;
+}
+
+/**
+ * Load the rules stored by save().
+ *
+ * @return false if there are none (or they are unreadable), the rules are then unchanged
+ */
+bool SkipRules::restore() {
+    uint8_t data[SKIP_RULES_MAX_BYTES];
+    Preferences prefs;
+    if (!prefs.begin(SKIP_RULES_NAMESPACE, true)) {
+        return false;
+    }
+    size_t length = prefs.getBytes("rules", data, sizeof(data));
+    prefs.end();
+    return length > 0 && load(data, length);
+}
+
+/**
+ * Update an input.
+ *
+ * @param input which one
+ * @param value its new value
+ * @param nowUs esp_timer_get_time()
+ * @param validMs how long the value holds before it is unknown again, 0 until replaced
+ * @return true if this changed whether (or by which rule) steps are skipped
+ */
+bool SkipRules::set(SkipInput input, uint8_t value, int64_t nowUs, uint32_t validMs) {
+    if (input >= SKIP_INPUTS) {
+        return false;
+    }
+    int8_t match = _match;
+    _values[input] = value;
+    _known[input] = true;
+    _expiresUs[input] = validMs == 0 ? 0 : nowUs + validMs * 1000LL;
+    evaluate();
+    return _match != match;
+}
+
+/**
+ * Forget an input, e.g. the sensor that reported it is gone.
+ *
+ * @return true if this changed whether (or by which rule) steps are skipped
+ */
+bool SkipRules::clear(SkipInput input) {
+    if (input >= SKIP_INPUTS) {
+        return false;
+    }
+    int8_t match = _match;
+    _known[input] = false;
+    evaluate();
+    return _match != match;
+}
+
+/**
+ * @param value set to the input's value
+ * @return false if the input is unknown (at the last check)
+ */
+bool SkipRules::value(SkipInput input, uint8_t &value) {
+    if (input >= SKIP_INPUTS || !_known[input]) {
+        return false;
+    }
+    value = _values[input];
+    return true;
+}
+
+/**
+ * Whether the next step is to be skipped, checked right before it starts.
+ *
+ * @param nowUs esp_timer_get_time(), to let expired values go
+ * @return true if a rule holds
+ */
+bool SkipRules::skipping(int64_t nowUs) {
+    expire(nowUs);
+    return _match != SKIP_NO_RULE;
+}
+
+/**
+ * @return index of the first rule that held at the last check, or SKIP_NO_RULE
+ */
+int8_t SkipRules::matchingRule() {
+    return _match;
+}
+
+uint8_t SkipRules::ruleCount() {
+    return _ruleCount;
+}
+
+/**
+ * @return milliseconds until the next input value expires, or SKIP_RULES_NO_EXPIRY
+ */
+uint32_t SkipRules::msUntilExpiry(int64_t nowUs) {
+    int64_t nextUs = 0;
+    for (uint8_t i = 0; i < SKIP_INPUTS; i++) {
+        if (_known[i] && _expiresUs[i] != 0 && (nextUs == 0 || _expiresUs[i] < nextUs)) {
+            nextUs = _expiresUs[i];
+        }
+    }
+    if (nextUs == 0) {
+        return SKIP_RULES_NO_EXPIRY;
+    }
+    return nextUs <= nowUs ? 0 : (nextUs - nowUs + 999) / 1000;
+}
+
+/**
+ * Drop the values that have run out, with one comparison per input.
+ */
+void SkipRules::expire(int64_t nowUs) {
+    bool expired = false;
+    for (uint8_t i = 0; i < SKIP_INPUTS; i++) {
+        if (_known[i] && _expiresUs[i] != 0 && nowUs >= _expiresUs[i]) {
+            _known[i] = false;
+            expired = true;
+        }
+    }
+    if (expired) {
+        evaluate();
+    }
+}
+
+/**
+ * Find the first rule that holds for the known inputs.
+ */
+void SkipRules::evaluate() {
+    _match = SKIP_NO_RULE;
+    for (uint8_t i = 0; i < _ruleCount; i++) {
+        const Rule &rule = _rules[i];
+        if (!_known[rule.input]) {
+            continue;
+        }
+        uint8_t value = _values[rule.input];
+        bool holds = rule.comparison == SKIP_ABOVE ? value > rule.threshold
+                   : rule.comparison == SKIP_BELOW ? value < rule.threshold
+                   : value == rule.threshold;
+        if (holds) {
+            _match = i;
+            return;
+        }
+    }
+}
+
+/**
+ * Validate encoded rules and decode them.
+ */
+bool SkipRules::parse(const uint8_t *data, size_t length, Rule *rules, uint8_t &count) {
+    if (length < SKIP_RULES_HEADER_BYTES || data[0] != SKIP_RULES_VERSION) {
+        return false;
+    }
+    count = data[1];
+    if (count > SKIP_RULES_MAX || length != (size_t)(SKIP_RULES_HEADER_BYTES + count * SKIP_RULES_RULE_BYTES)) {
+        return false;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        const uint8_t *rule = data + SKIP_RULES_HEADER_BYTES + i * SKIP_RULES_RULE_BYTES;
+        if (rule[0] >= SKIP_INPUTS || rule[1] >= SKIP_COMPARISONS) {
+            return false;
+        }
+        rules[i].input = (SkipInput)rule[0];
+        rules[i].comparison = (SkipComparison)rule[1];
+        rules[i].threshold = rule[2];
+    }
+    return true;
+}
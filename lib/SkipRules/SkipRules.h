@@ -0,0 +1,78 @@
+#pragma once
+
+#ifndef SkipRules_h
+#define SkipRules_h
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#define SKIP_RULES_MAX 8
+#define SKIP_RULES_VERSION 1
+// Encoded rules: version, rule count, then input, comparison and threshold for every rule
+#define SKIP_RULES_HEADER_BYTES 2
+#define SKIP_RULES_RULE_BYTES 3
+#define SKIP_RULES_MAX_BYTES (SKIP_RULES_HEADER_BYTES + SKIP_RULES_MAX * SKIP_RULES_RULE_BYTES)
+#define SKIP_RULES_NAMESPACE "skiprules"
+
+#define SKIP_NO_RULE -1
+#define SKIP_RULES_NO_EXPIRY UINT32_MAX
+
+// What a rule looks at
+enum SkipInput : uint8_t {
+    SKIP_INPUT_RAIN_CHANCE, // percent, pushed by the coordinator
+    SKIP_INPUT_RAIN_SENSOR, // 1 while the local rain sensor is wet
+    SKIP_INPUTS
+};
+
+// How a rule compares its input with the threshold
+enum SkipComparison : uint8_t {
+    SKIP_ABOVE, // input > threshold
+    SKIP_BELOW, // input < threshold
+    SKIP_EQUAL,
+    SKIP_COMPARISONS
+};
+
+/**
+ * Conditions under which the on-device schedule leaves a watering step out,
+ * e.g. "rain chance above 60" or "rain sensor equal to 1". A step is skipped if
+ * any rule holds.
+ *
+ * Rules are only evaluated when an input or the rules change, so skipping() is
+ * a constant-time check right before each start. An input nobody has set (or
+ * whose value has expired) is unknown and matches no rule: without data the
+ * schedule waters. Not thread-safe, use it from one task.
+ */
+class SkipRules {
+    public:
+        bool load(const uint8_t *data, size_t length);
+        size_t encode(uint8_t *data, size_t size);
+        bool save();
+        bool restore();
+        bool set(SkipInput input, uint8_t value, int64_t nowUs, uint32_t validMs = 0);
+        bool clear(SkipInput input);
+        bool value(SkipInput input, uint8_t &value);
+        bool skipping(int64_t nowUs);
+        int8_t matchingRule();
+        uint8_t ruleCount();
+        uint32_t msUntilExpiry(int64_t nowUs);
+
+    private:
+        struct Rule {
+            SkipInput input;
+            SkipComparison comparison;
+            uint8_t threshold;
+        };
+
+        Rule _rules[SKIP_RULES_MAX];
+        uint8_t _ruleCount = 0;
+        uint8_t _values[SKIP_INPUTS] = {};
+        bool _known[SKIP_INPUTS] = {};
+        int64_t _expiresUs[SKIP_INPUTS] = {}; // 0 = valid until replaced
+        int8_t _match = SKIP_NO_RULE;         // first rule that holds
+
+        void expire(int64_t nowUs);
+        void evaluate();
+        bool parse(const uint8_t *data, size_t length, Rule *rules, uint8_t &count);
+};
+
+#endif
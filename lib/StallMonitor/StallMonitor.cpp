@@ -0,0 +1,171 @@
+/**
+ * Stall detector, see StallMonitor.h.
+ *
+ * Checks run on the esp_timer task, which stays responsive while any
+ * application task is stuck. It only reads the watches, under a spinlock
+ * that busy() and idle() hold for a few instructions.
+ */
+
+#include "StallMonitor.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+
+// Not cleared by a software reset or a panic, only by a power cycle (then the
+// magic is garbage). One record for the application, whichever instance stalls.
+RTC_NOINIT_ATTR static StallRecord stallRecord;
+
+/**
+ * Register a watch. Only before begin().
+ *
+ * @param name short name for the logs and the abort message
+ * @param limitMs longest it may stay busy
+ * @param probe if set, polled instead of using busy()/idle()
+ * @param arg passed unchanged to the probe
+ * @return the watch to pass to busy()/idle(), or -1 if there is no room
+ */
+int StallMonitor::add(const char *name, uint32_t limitMs, StallProbe probe, void *arg) {
+    if (_count >= STALL_MONITOR_MAX_WATCHES || _timer != nullptr) {
+        return -1;
+    }
+    Watch &watch = _watches[_count];
+    strlcpy(watch.name, name, sizeof(watch.name));
+    watch.limitMs = limitMs;
+    watch.probe = probe;
+    watch.arg = arg;
+    watch.busySinceUs = 0;
+    watch.context = 0;
+    return _count++;
+}
+
+/**
+ * Take over the record of a stall before this reset and start checking.
+ *
+ * @return true if the checks are running
+ */
+bool StallMonitor::begin() {
+    if (_timer != nullptr) {
+        return true;
+    }
+
+    if (stallRecord.magic == MAGIC) {
+        _last = stallRecord;
+        _last.name[sizeof(_last.name) - 1] = '\0';
+        _haveLast = true;
+    }
+    stallRecord.magic = 0;
+
+    esp_timer_create_args_t args = {};
+    args.callback = timerEntry;
+    args.arg = this;
+    args.name = "stall_check";
+    // A late check after light sleep is fine, but one is enough
+    args.skip_unhandled_events = true;
+    if (esp_timer_create(&args, &_timer) != ESP_OK) {
+        _timer = nullptr;
+        return false;
+    }
+    if (esp_timer_start_periodic(_timer, STALL_MONITOR_CHECK_MS * 1000ULL) != ESP_OK) {
+        esp_timer_delete(_timer);
+        _timer = nullptr;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Mark a watch busy from now on. Any task.
+ *
+ * @param watch as returned by add(), ignored if negative
+ * @param context what it is working on, kept if it stalls
+ */
+void StallMonitor::busy(int watch, uint32_t context) {
+    if (watch < 0 || watch >= _count) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&_lock);
+    _watches[watch].busySinceUs = now;
+    _watches[watch].context = context;
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * Mark a watch as done with its work. Any task.
+ */
+void StallMonitor::idle(int watch) {
+    if (watch < 0 || watch >= _count) {
+        return;
+    }
+    portENTER_CRITICAL(&_lock);
+    _watches[watch].busySinceUs = 0;
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * @return the name given to add(), or "?" for an unknown watch
+ */
+const char *StallMonitor::name(int watch) {
+    return watch >= 0 && watch < _count ? _watches[watch].name : "?";
+}
+
+/**
+ * Get the stall that caused the last reset.
+ *
+ * @param record filled in if there was one
+ * @return false if the last reset was not caused by a stall (or begin() has not run)
+ */
+bool StallMonitor::lastStall(StallRecord &record) {
+    if (!_haveLast) {
+        return false;
+    }
+    record = _last;
+    return true;
+}
+
+/**
+ * Look at every watch once, timer task.
+ */
+void StallMonitor::check() {
+    int64_t now = esp_timer_get_time();
+
+    for (uint8_t i = 0; i < _count; i++) {
+        Watch &watch = _watches[i];
+        int64_t sinceUs;
+        uint32_t context = 0;
+
+        if (watch.probe != nullptr) {
+            sinceUs = watch.probe(watch.arg, context);
+        } else {
+            portENTER_CRITICAL(&_lock);
+            sinceUs = watch.busySinceUs;
+            context = watch.context;
+            portEXIT_CRITICAL(&_lock);
+        }
+
+        if (sinceUs != 0 && now - sinceUs > watch.limitMs * 1000LL) {
+            stalled(i, sinceUs, context, now);
+        }
+    }
+}
+
+/**
+ * Keep what stalled for the next boot and reboot through the panic handler,
+ * which writes the core dump.
+ */
+void StallMonitor::stalled(uint8_t watch, int64_t sinceUs, uint32_t context, int64_t now) {
+    stallRecord.watch = watch;
+    strlcpy(stallRecord.name, _watches[watch].name, sizeof(stallRecord.name));
+    stallRecord.stalledMs = (now - sinceUs) / 1000;
+    stallRecord.context = context;
+    stallRecord.uptimeMs = now / 1000;
+    stallRecord.magic = MAGIC;
+
+    static char message[64];
+    snprintf(message, sizeof(message), "stall: %s busy for %lu ms (context 0x%08lx)", stallRecord.name,
+             (unsigned long)stallRecord.stalledMs, (unsigned long)context);
+    esp_system_abort(message);
+}
+
+void StallMonitor::timerEntry(void *arg) {
+    ((StallMonitor *)arg)->check();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#ifndef StallMonitor_h
+#define StallMonitor_h
+
+#include <Arduino.h>
+#include "esp_timer.h"
+
+#define STALL_MONITOR_MAX_WATCHES 8
+// How often the watches are looked at: a stall is caught at most this late
+#define STALL_MONITOR_CHECK_MS 2000
+#define STALL_MONITOR_NAME 12
+
+/**
+ * Polled watch: reports since when the subsystem has been working on something
+ * it should have finished by now (0 while it has nothing to do), and what.
+ * Called from the esp_timer task, keep it short and non-blocking.
+ */
+typedef int64_t (*StallProbe)(void *arg, uint32_t &context);
+
+/**
+ * What stalled, kept in RTC memory across the reboot that follows.
+ */
+struct StallRecord {
+    uint32_t magic;
+    uint8_t watch;                 // index returned by add()
+    char name[STALL_MONITOR_NAME];
+    uint32_t stalledMs;            // how long it had been stuck
+    uint32_t context;              // what it was doing, meaning is up to the watch
+    uint32_t uptimeMs;             // when the stall was caught
+};
+
+/**
+ * Liveness per task or subsystem, next to the task watchdog (which only sees
+ * tasks that feed it, and not a task blocked forever on a queue).
+ *
+ * A watch is busy from busy() until idle(), or as long as its probe says so.
+ * One busy for longer than its limit is a stall: the monitor writes which one,
+ * for how long and its context to RTC memory, then aborts. The abort message
+ * names the watch too, and the panic handler saves a core dump of every task to
+ * the coredump partition, so the stuck task's backtrace is kept as well.
+ * lastStall() hands the record to the next boot.
+ */
+class StallMonitor {
+    public:
+        int add(const char *name, uint32_t limitMs, StallProbe probe = nullptr, void *arg = nullptr);
+        bool begin();
+        void busy(int watch, uint32_t context = 0);
+        void idle(int watch);
+        const char *name(int watch);
+        bool lastStall(StallRecord &record);
+
+    private:
+        struct Watch {
+            char name[STALL_MONITOR_NAME];
+            uint32_t limitMs;
+            StallProbe probe;
+            void *arg;
+            int64_t busySinceUs; // 0 while idle, busy()/idle() watches only
+            uint32_t context;
+        };
+
+        static const uint32_t MAGIC = 0x5374616c; // "Stal"
+
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+        Watch _watches[STALL_MONITOR_MAX_WATCHES];
+        uint8_t _count = 0;
+        esp_timer_handle_t _timer = nullptr;
+        bool _haveLast = false;
+        StallRecord _last = {};
+
+        void check();
+        [[noreturn]] void stalled(uint8_t watch, int64_t sinceUs, uint32_t context, int64_t now);
+        static void timerEntry(void *arg);
+};
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ * Bus timing kept across resets, see TimingStore.h.
+ */
+
+#include "TimingStore.h"
+
+/**
+ * Open the NVS namespace and read the saved profile and calibrations.
+ * A record that does not make sense is ignored, the standard timing is used.
+ *
+ * @return false if NVS cannot be used, changes are then lost at the next reset
+ */
+bool TimingStore::begin() {
+    if (_open) {
+        return true;
+    }
+    if (!_prefs.begin(TIMING_STORE_NAMESPACE, false)) {
+        return false;
+    }
+    _open = true;
+
+    Record record = {};
+    if (_prefs.getBytesLength("record") == sizeof(record)
+            && _prefs.getBytes("record", &record, sizeof(record)) == sizeof(record)
+            && record.version == VERSION && record.profile < TIMING_PROFILES) {
+        _record = record;
+        for (uint8_t bus = 0; bus < TIMING_STORE_MAX_BUSES; bus++) {
+            if (!HunterRoam::validTiming(_record.timings[bus])) {
+                _record.calibrated &= ~(1 << bus);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @return the profile in use
+ */
+TimingProfile TimingStore::profile() {
+    return (TimingProfile)_record.profile;
+}
+
+/**
+ * Select the profile for every bus and save it.
+ *
+ * @return false if the profile is out of range or could not be saved
+ */
+bool TimingStore::setProfile(TimingProfile profile) {
+    if (profile >= TIMING_PROFILES) {
+        return false;
+    }
+    if (_record.profile == profile) {
+        return true;
+    }
+    _record.profile = profile;
+    return save();
+}
+
+/**
+ * @param bus bus index (0 to TIMING_STORE_MAX_BUSES - 1)
+ * @return the timing the selected profile gives that bus
+ */
+HunterTiming TimingStore::timing(uint8_t bus) {
+    if (_record.profile == TIMING_CALIBRATED) {
+        return calibrated(bus) ? _record.timings[bus] : HUNTER_STANDARD_TIMING;
+    }
+    return preset((TimingProfile)_record.profile);
+}
+
+/**
+ * @return true if the bus has been calibrated
+ */
+bool TimingStore::calibrated(uint8_t bus) {
+    return bus < TIMING_STORE_MAX_BUSES && (_record.calibrated >> bus & 1);
+}
+
+/**
+ * Save a bus's calibrated timing. It is only used once TIMING_CALIBRATED is selected.
+ *
+ * @param bus bus index (0 to TIMING_STORE_MAX_BUSES - 1)
+ * @param timing see HunterRoam::validTiming()
+ * @return false if the arguments are out of range or it could not be saved
+ */
+bool TimingStore::saveCalibration(uint8_t bus, const HunterTiming &timing) {
+    if (bus >= TIMING_STORE_MAX_BUSES || !HunterRoam::validTiming(timing)) {
+        return false;
+    }
+    _record.timings[bus] = timing;
+    _record.calibrated |= 1 << bus;
+    return save();
+}
+
+/**
+ * @return the timing of a preset, the standard one for TIMING_CALIBRATED
+ */
+HunterTiming TimingStore::preset(TimingProfile profile) {
+    switch (profile) {
+        case TIMING_SHORT:
+            return {200000, 40000};
+        case TIMING_SHORTEST:
+            return {HUNTER_MIN_RESET_HIGH_US, HUNTER_MIN_RESET_LOW_US};
+        default:
+            return HUNTER_STANDARD_TIMING;
+    }
+}
+
+/**
+ * Write the record as one NVS entry.
+ */
+bool TimingStore::save() {
+    _record.version = VERSION;
+    return _open && _prefs.putBytes("record", &_record, sizeof(_record)) == sizeof(_record);
+}
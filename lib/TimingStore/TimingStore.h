@@ -0,0 +1,58 @@
+#pragma once
+
+#ifndef TimingStore_h
+#define TimingStore_h
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "HunterRoam.h"
+
+#define TIMING_STORE_MAX_BUSES 4
+#define TIMING_STORE_NAMESPACE "timing"
+
+/**
+ * Reset impulse and gap every frame starts with. The presets are the same
+ * for every bus, a calibration is per bus.
+ */
+enum TimingProfile : uint8_t {
+    TIMING_STANDARD,   // 325 ms + 65 ms, what every SmartPort controller takes
+    TIMING_SHORT,      // 200 ms + 40 ms
+    TIMING_SHORTEST,   // HUNTER_MIN_RESET_HIGH_US + HUNTER_MIN_RESET_LOW_US
+    TIMING_CALIBRATED, // the result of the last calibration, standard for a bus that has none; only selected on request
+    TIMING_PROFILES
+};
+
+/**
+ * Keeps the selected timing profile and each bus's calibrated timing in the
+ * nvs partition. Both change only on request, so every change is written at
+ * once. Loop task only.
+ */
+class TimingStore {
+    public:
+        bool begin();
+        TimingProfile profile();
+        bool setProfile(TimingProfile profile);
+        HunterTiming timing(uint8_t bus);
+        bool calibrated(uint8_t bus);
+        bool saveCalibration(uint8_t bus, const HunterTiming &timing);
+        static HunterTiming preset(TimingProfile profile);
+
+    private:
+        struct Record {
+            uint8_t version;
+            uint8_t profile;
+            uint8_t calibrated; // bit b = bus b has a calibrated timing
+            uint8_t reserved[5];
+            HunterTiming timings[TIMING_STORE_MAX_BUSES];
+        };
+
+        static const uint8_t VERSION = 1;
+
+        Preferences _prefs;
+        bool _open = false;
+        Record _record = {}; // TIMING_STANDARD, nothing calibrated
+
+        bool save();
+};
+
+#endif
@@ -0,0 +1,232 @@
+/**
+ * Diagnostics endpoint.
+ *
+ * Attribute values live in the Zigbee stack; publish*() copies the current
+ * figures into it, so reads are answered by the stack without calling back
+ * into the application.
+ */
+
+#include "ZigbeeDiagnostics.h"
+
+// Octet strings are stored as a length byte followed by the data
+#define HISTOGRAM_BYTES (LATENCY_BUCKETS * 4)
+static_assert(HISTOGRAM_BYTES < 0xff, "histogram does not fit an octet string");
+#define STATUS_BYTES sizeof(DiagnosticsStatus)
+static_assert(STATUS_BYTES < 0xff, "status does not fit an octet string");
+
+/**
+ * Constructor for the object ZigbeeDiagnostics.
+ *
+ * @param endpoint Zigbee endpoint number (1-240), not shared with any other endpoint
+ */
+ZigbeeDiagnostics::ZigbeeDiagnostics(uint8_t endpoint) : ZigbeeEP(endpoint) {
+    _device_id = ESP_ZB_HA_SIMPLE_SENSOR_DEVICE_ID;
+
+    esp_zb_basic_cluster_cfg_t basicConfig = {};
+    basicConfig.zcl_version = ESP_ZB_ZCL_BASIC_ZCL_VERSION_DEFAULT_VALUE;
+    basicConfig.power_source = ESP_ZB_ZCL_BASIC_POWER_SOURCE_DEFAULT_VALUE;
+    esp_zb_identify_cluster_cfg_t identifyConfig = {};
+    identifyConfig.identify_time = ESP_ZB_ZCL_IDENTIFY_IDENTIFY_TIME_DEFAULT_VALUE;
+
+    esp_zb_attribute_list_t *diagnostics = esp_zb_zcl_attr_list_create(DIAGNOSTICS_CLUSTER_ID);
+    // The stack copies the initial values and sizes string attributes from them
+    uint32_t zero = 0;
+    uint64_t noZones = 0;
+    uint8_t standardProfile = 0;
+    uint8_t histogram[HISTOGRAM_BYTES + 1] = {HISTOGRAM_BYTES};
+    uint8_t status[STATUS_BYTES + 1] = {STATUS_BYTES};
+    for (uint8_t stage = 0; stage < LATENCY_STAGES; stage++) {
+        LatencyStage s = (LatencyStage)stage;
+        esp_zb_custom_cluster_add_custom_attr(diagnostics, latencyAttribute(s, DIAGNOSTICS_LATENCY_P50), ESP_ZB_ZCL_ATTR_TYPE_U32,
+            ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &zero);
+        esp_zb_custom_cluster_add_custom_attr(diagnostics, latencyAttribute(s, DIAGNOSTICS_LATENCY_P99), ESP_ZB_ZCL_ATTR_TYPE_U32,
+            ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &zero);
+        esp_zb_custom_cluster_add_custom_attr(diagnostics, latencyAttribute(s, DIAGNOSTICS_LATENCY_MAX), ESP_ZB_ZCL_ATTR_TYPE_U32,
+            ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+        esp_zb_custom_cluster_add_custom_attr(diagnostics, latencyAttribute(s, DIAGNOSTICS_LATENCY_COUNT), ESP_ZB_ZCL_ATTR_TYPE_U32,
+            ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+        esp_zb_custom_cluster_add_custom_attr(diagnostics, latencyAttribute(s, DIAGNOSTICS_LATENCY_HISTOGRAM), ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING,
+            ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, histogram);
+    }
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_RUNNING_ZONES, ESP_ZB_ZCL_ATTR_TYPE_64BITMAP,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &noZones);
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_BOOT_BUS_READY, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_BOOT_FIRST_COMMAND, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_BOOT_JOINED, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_TIMING_PROFILE, ESP_ZB_ZCL_ATTR_TYPE_U8,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE, &standardProfile);
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_TIMING_RESET_HIGH, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_TIMING_RESET_LOW, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_OPERATING_SECONDS, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero);
+    esp_zb_custom_cluster_add_custom_attr(diagnostics, DIAGNOSTICS_STATUS, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, status);
+
+    _cluster_list = esp_zb_zcl_cluster_list_create();
+    esp_zb_cluster_list_add_basic_cluster(_cluster_list, esp_zb_basic_cluster_create(&basicConfig), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_identify_cluster(_cluster_list, esp_zb_identify_cluster_create(&identifyConfig), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_custom_cluster(_cluster_list, diagnostics, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+
+    _ep_config = {
+        .endpoint = _endpoint,
+        .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
+        .app_device_id = ESP_ZB_HA_SIMPLE_SENSOR_DEVICE_ID,
+        .app_device_version = 0
+    };
+}
+
+/**
+ * Copy the latency histograms into the diagnostics cluster.
+ * Call it from a normal task (not from a Zigbee callback), it takes the Zigbee lock.
+ *
+ * @param stats histograms to publish
+ * @return true if every attribute was updated
+ */
+bool ZigbeeDiagnostics::publishLatency(LatencyStats &stats) {
+    bool ok = true;
+
+    for (uint8_t stage = 0; stage < LATENCY_STAGES; stage++) {
+        LatencyStage s = (LatencyStage)stage;
+        LatencyHistogram histogram;
+        stats.snapshot(s, histogram);
+
+        uint32_t p50 = histogram.percentileUs(50);
+        uint32_t p99 = histogram.percentileUs(99);
+        uint8_t buckets[HISTOGRAM_BYTES + 1] = {HISTOGRAM_BYTES};
+        for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+            // ZCL is little-endian, independent of the CPU
+            for (uint8_t b = 0; b < 4; b++) {
+                buckets[1 + i * 4 + b] = (histogram.buckets[i] >> (8 * b)) & 0xff;
+            }
+        }
+
+        ok &= setAttribute(latencyAttribute(s, DIAGNOSTICS_LATENCY_P50), &p50);
+        ok &= setAttribute(latencyAttribute(s, DIAGNOSTICS_LATENCY_P99), &p99);
+        ok &= setAttribute(latencyAttribute(s, DIAGNOSTICS_LATENCY_MAX), &histogram.maxUs);
+        ok &= setAttribute(latencyAttribute(s, DIAGNOSTICS_LATENCY_COUNT), &histogram.count);
+        ok &= setAttribute(latencyAttribute(s, DIAGNOSTICS_LATENCY_HISTOGRAM), buckets);
+    }
+    return ok;
+}
+
+/**
+ * Update the bitmap of running zones.
+ * Call it from a normal task (not from a Zigbee callback), it takes the Zigbee lock.
+ *
+ * @param running bit i set when zone i + 1 is running
+ * @return true if the attribute was updated
+ */
+bool ZigbeeDiagnostics::publishRunningZones(uint64_t running) {
+    return setAttribute(DIAGNOSTICS_RUNNING_ZONES, &running);
+}
+
+/**
+ * Update the startup milestones of this boot.
+ * Call it from a normal task (not from a Zigbee callback), it takes the Zigbee lock.
+ *
+ * @param busReadyMs milliseconds from reset until the bus tasks ran
+ * @param firstCommandMs until the first frame was sent, 0 if none yet
+ * @param joinedMs until the device joined the network
+ * @return true if every attribute was updated
+ */
+bool ZigbeeDiagnostics::publishBootTimes(uint32_t busReadyMs, uint32_t firstCommandMs, uint32_t joinedMs) {
+    bool ok = setAttribute(DIAGNOSTICS_BOOT_BUS_READY, &busReadyMs);
+    ok &= setAttribute(DIAGNOSTICS_BOOT_FIRST_COMMAND, &firstCommandMs);
+    ok &= setAttribute(DIAGNOSTICS_BOOT_JOINED, &joinedMs);
+    return ok;
+}
+
+/**
+ * Update the timing attributes, also to undo a write that was not taken.
+ * Call it from a normal task (not from a Zigbee callback), it takes the Zigbee lock.
+ *
+ * @param profile TimingProfile in use
+ * @param resetHighUs reset impulse the frames are sent with
+ * @param resetLowUs and the gap after it
+ * @return true if every attribute was updated
+ */
+bool ZigbeeDiagnostics::publishTiming(uint8_t profile, uint32_t resetHighUs, uint32_t resetLowUs) {
+    bool ok = setAttribute(DIAGNOSTICS_TIMING_PROFILE, &profile);
+    ok &= setAttribute(DIAGNOSTICS_TIMING_RESET_HIGH, &resetHighUs);
+    ok &= setAttribute(DIAGNOSTICS_TIMING_RESET_LOW, &resetLowUs);
+    return ok;
+}
+
+/**
+ * Update the clock the zone accounting times refer to.
+ * Call it from a normal task (not from a Zigbee callback), it takes the Zigbee lock.
+ *
+ * @param seconds ZoneMeter::now()
+ * @return true if the attribute was updated
+ */
+bool ZigbeeDiagnostics::publishOperatingSeconds(uint32_t seconds) {
+    return setAttribute(DIAGNOSTICS_OPERATING_SECONDS, &seconds);
+}
+
+/**
+ * Replace the status struct, a single attribute write however many fields changed.
+ * Call it from a normal task (not from a Zigbee callback), it takes the Zigbee lock.
+ *
+ * @return true if the attribute was updated
+ */
+bool ZigbeeDiagnostics::publishStatus(const DiagnosticsStatus &status) {
+    uint8_t value[STATUS_BYTES + 1] = {STATUS_BYTES};
+    memcpy(value + 1, &status, STATUS_BYTES);
+    return setAttribute(DIAGNOSTICS_STATUS, value);
+}
+
+/**
+ * Link quality to the parent, from the stack's neighbour table. Takes the Zigbee lock.
+ *
+ * @param rssi set to the parent's RSSI in dBm
+ * @param lqi set to its LQI
+ * @return false if there is no parent (not joined, or the device routes itself)
+ */
+bool ZigbeeDiagnostics::parentLink(int8_t &rssi, uint8_t &lqi) {
+    esp_zb_nwk_info_iterator_t iterator = ESP_ZB_NWK_INFO_ITERATOR_INIT;
+    esp_zb_nwk_neighbor_info_t neighbor;
+    bool found = false;
+
+    esp_zb_lock_acquire(portMAX_DELAY);
+    while (!found && esp_zb_nwk_get_next_neighbor(&iterator, &neighbor) == ESP_OK) {
+        if (neighbor.relationship == ESP_ZB_NWK_RELATIONSHIP_PARENT) {
+            rssi = neighbor.rssi;
+            lqi = neighbor.lqi;
+            found = true;
+        }
+    }
+    esp_zb_lock_release();
+    return found;
+}
+
+/**
+ * @param callback called with the value the coordinator wrote to DIAGNOSTICS_TIMING_PROFILE
+ */
+void ZigbeeDiagnostics::onTimingWrite(void (*callback)(uint8_t value)) {
+    _onTimingWrite = callback;
+}
+
+void ZigbeeDiagnostics::zbAttributeSet(const esp_zb_zcl_set_attr_value_message_t *message) {
+    if (message->info.cluster != DIAGNOSTICS_CLUSTER_ID || message->attribute.data.value == nullptr) {
+        return;
+    }
+    if (message->attribute.id == DIAGNOSTICS_TIMING_PROFILE && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_U8
+            && _onTimingWrite != nullptr) {
+        _onTimingWrite(*(const uint8_t *)message->attribute.data.value);
+    }
+}
+
+/**
+ * Set one attribute of the diagnostics cluster.
+ */
+bool ZigbeeDiagnostics::setAttribute(uint16_t id, void *value) {
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_zb_zcl_status_t status = esp_zb_zcl_set_attribute_val(_endpoint, DIAGNOSTICS_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, id, value, false);
+    esp_zb_lock_release();
+    return status == ESP_ZB_ZCL_STATUS_SUCCESS;
+}
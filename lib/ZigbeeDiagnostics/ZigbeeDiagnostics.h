@@ -0,0 +1,105 @@
+#pragma once
+
+#ifndef ZigbeeDiagnostics_h
+#define ZigbeeDiagnostics_h
+
+#include <Arduino.h>
+#include "Zigbee.h"
+#include "LatencyStats.h"
+
+// Manufacturer-specific cluster holding the controller's own telemetry
+#define DIAGNOSTICS_CLUSTER_ID 0xFC00
+
+// Latency attributes, one block of DIAGNOSTICS_LATENCY_STRIDE ids per LatencyStage:
+// stage * stride + offset. Times are in microseconds.
+#define DIAGNOSTICS_LATENCY_STRIDE    0x10
+#define DIAGNOSTICS_LATENCY_P50       0x00 // uint32, reportable
+#define DIAGNOSTICS_LATENCY_P99       0x01 // uint32, reportable
+#define DIAGNOSTICS_LATENCY_MAX       0x02 // uint32
+#define DIAGNOSTICS_LATENCY_COUNT     0x03 // uint32, samples in the histogram
+#define DIAGNOSTICS_LATENCY_HISTOGRAM 0x04 // octet string, LATENCY_BUCKETS little-endian uint32 counts
+
+// State of every zone in one attribute, so a change to many zones is one report
+#define DIAGNOSTICS_RUNNING_ZONES     0x0100 // bitmap64, reportable: bit i = zone i + 1 is running
+
+// Startup milestones of the current boot, milliseconds since reset, 0 = not reached yet
+#define DIAGNOSTICS_BOOT_BUS_READY     0x0110 // uint32, bus tasks accept commands
+#define DIAGNOSTICS_BOOT_FIRST_COMMAND 0x0111 // uint32, first frame has left the bus
+#define DIAGNOSTICS_BOOT_JOINED        0x0112 // uint32, joined the Zigbee network
+
+// Reset impulse and gap of the SmartPort frames (first bus), in microseconds
+#define DIAGNOSTICS_TIMING_PROFILE     0x0120 // uint8, read/write: TimingProfile, or write DIAGNOSTICS_TIMING_CALIBRATE
+#define DIAGNOSTICS_TIMING_RESET_HIGH  0x0121 // uint32
+#define DIAGNOSTICS_TIMING_RESET_LOW   0x0122 // uint32
+
+#define DIAGNOSTICS_TIMING_CALIBRATE 0xff
+
+// Clock of the zone run accounting (times on the zone endpoints' metering clusters)
+#define DIAGNOSTICS_OPERATING_SECONDS  0x0130 // uint32, device run time over all boots
+
+// Operating status in one read, see DiagnosticsStatus
+#define DIAGNOSTICS_STATUS             0x0140 // octet string, a DiagnosticsStatus
+#define DIAGNOSTICS_STATUS_VERSION 1
+
+/**
+ * Counters and gauges of the running firmware, sent as they are laid out here:
+ * packed, little-endian (like ZCL and the CPU). New fields only go on the end,
+ * with a new version.
+ */
+struct __attribute__((packed)) DiagnosticsStatus {
+    uint8_t version;          // DIAGNOSTICS_STATUS_VERSION
+    uint8_t ledState;         // what the status LED shows, see LedState in main.cpp
+    uint8_t resetReason;      // esp_reset_reason() of this boot
+    uint8_t lastError;        // HunterError of the last failed command, 0 if none failed
+    uint32_t uptimeS;
+    uint32_t framesSent;      // every bus, resends included
+    uint32_t bytesSent;       // payload bytes of those frames
+    uint32_t framesResent;    // after a failed readback
+    uint32_t commandsFailed;
+    uint32_t heapFree;
+    uint32_t heapMinFree;     // lowest since boot
+    uint16_t loopWakesPerMin; // main loop passes, over the last refresh period
+    uint16_t safetyTrips;     // since boot
+    uint16_t networkLosses;   // times the network was lost since boot
+    uint8_t queueHighWater;   // most bus commands waiting at once, on any bus
+    uint8_t zonesWaiting;     // starts waiting for a free controller
+    int8_t parentRssi;        // dBm of the last frame from the parent, 0 if unknown
+    uint8_t parentLqi;        // 0 if unknown
+    uint8_t reserved[2];
+};
+
+static_assert(sizeof(DiagnosticsStatus) == 44, "DiagnosticsStatus is a wire format");
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "DiagnosticsStatus is sent as it is in memory");
+
+/**
+ * Extra endpoint exposing the controller's telemetry as attributes of a
+ * custom cluster, next to the Basic and Identify clusters, so a coordinator
+ * (e.g. a Z2M external converter) can read or bind to it.
+ *
+ * The timing profile is the one attribute the coordinator writes; the
+ * callback runs on the Zigbee task and should only hand the request over.
+ */
+class ZigbeeDiagnostics : public ZigbeeEP {
+    public:
+        ZigbeeDiagnostics(uint8_t endpoint);
+        bool publishLatency(LatencyStats &stats);
+        bool publishRunningZones(uint64_t running);
+        bool publishBootTimes(uint32_t busReadyMs, uint32_t firstCommandMs, uint32_t joinedMs);
+        bool publishTiming(uint8_t profile, uint32_t resetHighUs, uint32_t resetLowUs);
+        bool publishOperatingSeconds(uint32_t seconds);
+        bool publishStatus(const DiagnosticsStatus &status);
+        static bool parentLink(int8_t &rssi, uint8_t &lqi);
+        void onTimingWrite(void (*callback)(uint8_t value));
+
+        static constexpr uint16_t latencyAttribute(LatencyStage stage, uint8_t offset) {
+            return stage * DIAGNOSTICS_LATENCY_STRIDE + offset;
+        }
+
+    private:
+        void (*_onTimingWrite)(uint8_t value) = nullptr;
+
+        void zbAttributeSet(const esp_zb_zcl_set_attr_value_message_t *message) override;
+        bool setAttribute(uint16_t id, void *value);
+};
+
+#endif
@@ -0,0 +1,179 @@
+/**
+ * Sequencer endpoint, see ZigbeeSequencer.h.
+ */
+
+#include "ZigbeeSequencer.h"
+
+/**
+ * Constructor for the object ZigbeeSequencer.
+ *
+ * @param endpoint Zigbee endpoint number (1-240), not shared with any other endpoint
+ */
+ZigbeeSequencer::ZigbeeSequencer(uint8_t endpoint) : ZigbeeEP(endpoint) {
+    _device_id = ESP_ZB_HA_SIMPLE_SENSOR_DEVICE_ID;
+
+    esp_zb_basic_cluster_cfg_t basicConfig = {};
+    basicConfig.zcl_version = ESP_ZB_ZCL_BASIC_ZCL_VERSION_DEFAULT_VALUE;
+    basicConfig.power_source = ESP_ZB_ZCL_BASIC_POWER_SOURCE_DEFAULT_VALUE;
+    esp_zb_identify_cluster_cfg_t identifyConfig = {};
+    identifyConfig.identify_time = ESP_ZB_ZCL_IDENTIFY_IDENTIFY_TIME_DEFAULT_VALUE;
+
+    esp_zb_attribute_list_t *sequencer = esp_zb_zcl_attr_list_create(SEQUENCER_CLUSTER_ID);
+    // The stack sizes string attributes from their initial value, so start with a full-length one
+    uint8_t program[SEQUENCE_MAX_BYTES + 1] = {SEQUENCE_MAX_BYTES};
+    uint8_t rules[SKIP_RULES_MAX_BYTES + 1] = {SKIP_RULES_MAX_BYTES};
+    uint8_t zero = 0;
+    uint8_t unknown = SEQUENCER_INPUT_UNKNOWN;
+    esp_zb_custom_cluster_add_custom_attr(sequencer, SEQUENCER_ATTR_PROGRAM, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE, program);
+    esp_zb_custom_cluster_add_custom_attr(sequencer, SEQUENCER_ATTR_CONTROL, ESP_ZB_ZCL_ATTR_TYPE_U8,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE, &zero);
+    esp_zb_custom_cluster_add_custom_attr(sequencer, SEQUENCER_ATTR_STATE, ESP_ZB_ZCL_ATTR_TYPE_U8,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &zero);
+    esp_zb_custom_cluster_add_custom_attr(sequencer, SEQUENCER_ATTR_STEP, ESP_ZB_ZCL_ATTR_TYPE_U8,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &zero);
+    esp_zb_custom_cluster_add_custom_attr(sequencer, SEQUENCER_ATTR_SKIP_RULES, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE, rules);
+    esp_zb_custom_cluster_add_custom_attr(sequencer, SEQUENCER_ATTR_RAIN_CHANCE, ESP_ZB_ZCL_ATTR_TYPE_U8,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE, &unknown);
+    esp_zb_custom_cluster_add_custom_attr(sequencer, SEQUENCER_ATTR_RAIN_SENSOR, ESP_ZB_ZCL_ATTR_TYPE_U8,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &unknown);
+    esp_zb_custom_cluster_add_custom_attr(sequencer, SEQUENCER_ATTR_SKIP_RULE, ESP_ZB_ZCL_ATTR_TYPE_U8,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &zero);
+
+    _cluster_list = esp_zb_zcl_cluster_list_create();
+    esp_zb_cluster_list_add_basic_cluster(_cluster_list, esp_zb_basic_cluster_create(&basicConfig), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_identify_cluster(_cluster_list, esp_zb_identify_cluster_create(&identifyConfig), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    esp_zb_cluster_list_add_custom_cluster(_cluster_list, sequencer, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+
+    _ep_config = {
+        .endpoint = _endpoint,
+        .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
+        .app_device_id = ESP_ZB_HA_SIMPLE_SENSOR_DEVICE_ID,
+        .app_device_version = 0
+    };
+}
+
+/**
+ * @param callback called with the encoded program written by the coordinator
+ */
+void ZigbeeSequencer::onProgramWrite(void (*callback)(const uint8_t *data, size_t length)) {
+    _onProgramWrite = callback;
+}
+
+/**
+ * @param callback called with SEQUENCER_CONTROL_START or SEQUENCER_CONTROL_STOP
+ */
+void ZigbeeSequencer::onControl(void (*callback)(uint8_t command)) {
+    _onControl = callback;
+}
+
+/**
+ * @param callback called with the encoded skip rules written by the coordinator
+ */
+void ZigbeeSequencer::onSkipRulesWrite(void (*callback)(const uint8_t *data, size_t length)) {
+    _onSkipRulesWrite = callback;
+}
+
+/**
+ * @param callback called with an input value written by the coordinator,
+ * 		SEQUENCER_INPUT_UNKNOWN to forget it
+ */
+void ZigbeeSequencer::onInputWrite(void (*callback)(SkipInput input, uint8_t value)) {
+    _onInputWrite = callback;
+}
+
+/**
+ * Publish the program in use, e.g. the one restored at boot or the previous
+ * one after a rejected write. Takes the Zigbee lock.
+ */
+bool ZigbeeSequencer::setProgram(const uint8_t *data, size_t length) {
+    uint8_t program[SEQUENCE_MAX_BYTES + 1];
+    if (length > SEQUENCE_MAX_BYTES) {
+        return false;
+    }
+    program[0] = length;
+    memcpy(program + 1, data, length);
+    return setAttribute(SEQUENCER_ATTR_PROGRAM, program);
+}
+
+/**
+ * Publish the state of the run. Takes the Zigbee lock.
+ *
+ * @param state current SequenceEngine state
+ * @param step running step (1-based), 0 when not running
+ * @return true if both attributes were updated
+ */
+bool ZigbeeSequencer::setProgress(SequenceState state, uint8_t step) {
+    uint8_t value = state;
+    bool ok = setAttribute(SEQUENCER_ATTR_STATE, &value);
+    ok &= setAttribute(SEQUENCER_ATTR_STEP, &step);
+    return ok;
+}
+
+/**
+ * Publish the skip rules in use. Takes the Zigbee lock.
+ */
+bool ZigbeeSequencer::setSkipRules(const uint8_t *data, size_t length) {
+    uint8_t rules[SKIP_RULES_MAX_BYTES + 1];
+    if (length > SKIP_RULES_MAX_BYTES) {
+        return false;
+    }
+    rules[0] = length;
+    memcpy(rules + 1, data, length);
+    return setAttribute(SEQUENCER_ATTR_SKIP_RULES, rules);
+}
+
+/**
+ * Publish the inputs as last evaluated and the rule that holds. Takes the Zigbee lock.
+ *
+ * @param rainChance percent, or SEQUENCER_INPUT_UNKNOWN
+ * @param rainSensor 1 while wet, or SEQUENCER_INPUT_UNKNOWN
+ * @param rule rule that skips steps (1-based), 0 for none
+ * @return true if all three attributes were updated
+ */
+bool ZigbeeSequencer::setSkipState(uint8_t rainChance, uint8_t rainSensor, uint8_t rule) {
+    bool ok = setAttribute(SEQUENCER_ATTR_RAIN_CHANCE, &rainChance);
+    ok &= setAttribute(SEQUENCER_ATTR_RAIN_SENSOR, &rainSensor);
+    ok &= setAttribute(SEQUENCER_ATTR_SKIP_RULE, &rule);
+    return ok;
+}
+
+/**
+ * Attribute writes from the coordinator, runs on the Zigbee task.
+ */
+void ZigbeeSequencer::zbAttributeSet(const esp_zb_zcl_set_attr_value_message_t *message) {
+    if (message->info.cluster != SEQUENCER_CLUSTER_ID || message->attribute.data.value == nullptr) {
+        return;
+    }
+    const uint8_t *value = (const uint8_t *)message->attribute.data.value;
+
+    if (message->attribute.id == SEQUENCER_ATTR_PROGRAM && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING) {
+        if (_onProgramWrite != nullptr) {
+            // Octet strings start with their length
+            _onProgramWrite(value + 1, value[0]);
+        }
+    } else if (message->attribute.id == SEQUENCER_ATTR_CONTROL && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_U8) {
+        if (_onControl != nullptr) {
+            _onControl(value[0]);
+        }
+    } else if (message->attribute.id == SEQUENCER_ATTR_SKIP_RULES && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING) {
+        if (_onSkipRulesWrite != nullptr) {
+            _onSkipRulesWrite(value + 1, value[0]);
+        }
+    } else if (message->attribute.id == SEQUENCER_ATTR_RAIN_CHANCE && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_U8) {
+        if (_onInputWrite != nullptr) {
+            _onInputWrite(SKIP_INPUT_RAIN_CHANCE, value[0]);
+        }
+    }
+}
+
+/**
+ * Set one attribute of the sequencer cluster.
+ */
+bool ZigbeeSequencer::setAttribute(uint16_t id, void *value) {
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_zb_zcl_status_t status = esp_zb_zcl_set_attribute_val(_endpoint, SEQUENCER_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, id, value, false);
+    esp_zb_lock_release();
+    return status == ESP_ZB_ZCL_STATUS_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef ZigbeeSequencer_h
+#define ZigbeeSequencer_h
+
+#include <Arduino.h>
+#include "Zigbee.h"
+#include "SequenceEngine.h"
+#include "SkipRules.h"
+
+// Manufacturer-specific cluster to load and run an on-device watering sequence
+#define SEQUENCER_CLUSTER_ID 0xFC01
+
+#define SEQUENCER_ATTR_PROGRAM 0x0000 // octet string, read/write, format in SequenceEngine.cpp
+#define SEQUENCER_ATTR_CONTROL 0x0001 // uint8, write SEQUENCER_CONTROL_*
+#define SEQUENCER_ATTR_STATE   0x0002 // uint8 SequenceState, reportable
+#define SEQUENCER_ATTR_STEP    0x0003 // uint8, running step (1-based) or 0, reportable
+#define SEQUENCER_ATTR_SKIP_RULES  0x0004 // octet string, read/write, format in SkipRules.cpp
+#define SEQUENCER_ATTR_RAIN_CHANCE 0x0005 // uint8 percent, read/write, SEQUENCER_INPUT_UNKNOWN once expired
+#define SEQUENCER_ATTR_RAIN_SENSOR 0x0006 // uint8, 1 while wet, reportable; SEQUENCER_INPUT_UNKNOWN without a sensor
+#define SEQUENCER_ATTR_SKIP_RULE   0x0007 // uint8, rule that currently skips steps (1-based) or 0, reportable
+
+#define SEQUENCER_INPUT_UNKNOWN 0xff
+
+#define SEQUENCER_CONTROL_STOP  0
+#define SEQUENCER_CONTROL_START 1
+
+/**
+ * Endpoint through which the coordinator writes a SequenceEngine program once
+ * and then starts runs with a single attribute write, instead of switching
+ * the zones one by one. Progress is published as attribute changes.
+ *
+ * Skip rules and the values they look at are written the same way; a step the
+ * rules leave out ends the run with SEQUENCE_SKIPPED.
+ *
+ * The callbacks run on the Zigbee task, they should only hand the request over.
+ */
+class ZigbeeSequencer : public ZigbeeEP {
+    public:
+        ZigbeeSequencer(uint8_t endpoint);
+        void onProgramWrite(void (*callback)(const uint8_t *data, size_t length));
+        void onControl(void (*callback)(uint8_t command));
+        void onSkipRulesWrite(void (*callback)(const uint8_t *data, size_t length));
+        void onInputWrite(void (*callback)(SkipInput input, uint8_t value));
+        bool setProgram(const uint8_t *data, size_t length);
+        bool setProgress(SequenceState state, uint8_t step);
+        bool setSkipRules(const uint8_t *data, size_t length);
+        bool setSkipState(uint8_t rainChance, uint8_t rainSensor, uint8_t rule);
+
+    private:
+        void (*_onProgramWrite)(const uint8_t *data, size_t length) = nullptr;
+        void (*_onControl)(uint8_t command) = nullptr;
+        void (*_onSkipRulesWrite)(const uint8_t *data, size_t length) = nullptr;
+        void (*_onInputWrite)(SkipInput input, uint8_t value) = nullptr;
+
+        void zbAttributeSet(const esp_zb_zcl_set_attr_value_message_t *message) override;
+        bool setAttribute(uint16_t id, void *value);
+};
+
+#endif
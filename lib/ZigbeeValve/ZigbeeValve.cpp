@@ -0,0 +1,166 @@
+/**
+ * Zone endpoint with timed runs, see ZigbeeValve.h.
+ */
+
+#include "ZigbeeValve.h"
+
+/**
+ * Constructor for the object ZigbeeValve.
+ *
+ * @param endpoint Zigbee endpoint number (1-240)
+ * @param litresPerMinute nominal flow of the zone, for the metered volume
+ */
+ZigbeeValve::ZigbeeValve(uint8_t endpoint, uint8_t litresPerMinute) : ZigbeeLight(endpoint) {
+    esp_zb_attribute_list_t *onOff = esp_zb_cluster_list_get_cluster(_cluster_list, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    if (onOff == nullptr) {
+        return;
+    }
+    bool sceneControl = true;
+    uint16_t zero = 0;
+    uint8_t position = 0;
+    esp_zb_on_off_cluster_add_attr(onOff, ESP_ZB_ZCL_ATTR_ON_OFF_GLOBAL_SCENE_CONTROL, &sceneControl);
+    esp_zb_on_off_cluster_add_attr(onOff, ESP_ZB_ZCL_ATTR_ON_OFF_ON_TIME, &zero);
+    esp_zb_on_off_cluster_add_attr(onOff, ESP_ZB_ZCL_ATTR_ON_OFF_OFF_WAIT_TIME, &zero);
+    esp_zb_custom_cluster_add_custom_attr(onOff, VALVE_ATTR_QUEUE_POSITION, ESP_ZB_ZCL_ATTR_TYPE_U8,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &position);
+
+    esp_zb_metering_cluster_cfg_t meteringConfig = {};
+    meteringConfig.uint_of_measure = VALVE_METERING_UNIT_LITRES;
+    meteringConfig.metering_device_type = VALVE_METERING_WATER;
+    esp_zb_attribute_list_t *metering = esp_zb_metering_cluster_create(&meteringConfig);
+    esp_zb_uint24_t multiplier = {litresPerMinute, 0};
+    esp_zb_uint24_t divisor = {60, 0};
+    uint32_t none = 0;
+    esp_zb_metering_cluster_add_attr(metering, ESP_ZB_ZCL_ATTR_METERING_MULTIPLIER_ID, &multiplier);
+    esp_zb_metering_cluster_add_attr(metering, ESP_ZB_ZCL_ATTR_METERING_DIVISOR_ID, &divisor);
+    esp_zb_custom_cluster_add_custom_attr(metering, VALVE_ATTR_RUNS, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &none);
+    esp_zb_custom_cluster_add_custom_attr(metering, VALVE_ATTR_SAFETY_TRIPS, ESP_ZB_ZCL_ATTR_TYPE_U16,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &zero);
+    esp_zb_custom_cluster_add_custom_attr(metering, VALVE_ATTR_LAST_START, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &none);
+    esp_zb_custom_cluster_add_custom_attr(metering, VALVE_ATTR_LAST_STOP, ESP_ZB_ZCL_ATTR_TYPE_U32,
+        ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &none);
+    esp_zb_cluster_list_add_metering_cluster(_cluster_list, metering, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+}
+
+/**
+ * Read the run time requested with the last ON and clear it, so a later
+ * plain ON is not mistaken for a timed one. Call it from the change callback.
+ *
+ * @return run time in minutes, rounded up (at most 240), or 0 for an untimed ON
+ */
+uint8_t ZigbeeValve::takeRunMinutes() {
+    uint16_t onTime = 0;
+
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_zb_zcl_attr_t *attribute = esp_zb_zcl_get_attribute(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF,
+        ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, ESP_ZB_ZCL_ATTR_ON_OFF_ON_TIME);
+    if (attribute != nullptr && attribute->data_p != nullptr) {
+        onTime = *(uint16_t *)attribute->data_p;
+    }
+    esp_zb_lock_release();
+
+    // 0 means untimed, 0xffff "on until switched off"
+    if (onTime == 0 || onTime == 0xffff) {
+        return 0;
+    }
+    setOnTime(0);
+    uint32_t minutes = (onTime + VALVE_ON_TIME_PER_MINUTE - 1) / VALVE_ON_TIME_PER_MINUTE;
+    return minutes > 240 ? 240 : minutes;
+}
+
+/**
+ * Ask for the next ON to be a timed run, e.g. before switching the zone on
+ * from the device itself with setLight(true).
+ *
+ * @param minutes run time, 0 for an untimed ON
+ * @return true if the attribute was updated
+ */
+bool ZigbeeValve::setRunMinutes(uint8_t minutes) {
+    // OnTime tops out just under 110 minutes
+    uint32_t onTime = (uint32_t)minutes * VALVE_ON_TIME_PER_MINUTE;
+    return setOnTime(onTime > 0xfffe ? 0xfffe : onTime);
+}
+
+/**
+ * Show where a waiting start is in line. Takes the Zigbee lock.
+ *
+ * @param position 1 = next, 0 when not waiting
+ * @return true if the attribute was updated
+ */
+bool ZigbeeValve::setQueuePosition(uint8_t position) {
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_zb_zcl_status_t status = esp_zb_zcl_set_attribute_val(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF,
+        ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, VALVE_ATTR_QUEUE_POSITION, &position, false);
+    esp_zb_lock_release();
+    return status == ESP_ZB_ZCL_STATUS_SUCCESS;
+}
+
+bool ZigbeeValve::setOnTime(uint16_t onTime) {
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_zb_zcl_status_t status = esp_zb_zcl_set_attribute_val(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF,
+        ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, ESP_ZB_ZCL_ATTR_ON_OFF_ON_TIME, &onTime, false);
+    esp_zb_lock_release();
+    return status == ESP_ZB_ZCL_STATUS_SUCCESS;
+}
+
+/**
+ * Copy a zone's accounting into the metering cluster.
+ * Call it from a normal task (not from a Zigbee callback), it takes the Zigbee lock.
+ *
+ * @return true if every attribute was updated
+ */
+bool ZigbeeValve::publishUsage(const ZoneUsage &usage) {
+    esp_zb_uint48_t summation = {usage.seconds, 0};
+    uint32_t runs = usage.runs;
+    uint16_t trips = usage.safetyTrips;
+    uint32_t lastStart = usage.lastStartS;
+    uint32_t lastStop = usage.lastStopS;
+
+    bool ok = setMeteringAttribute(ESP_ZB_ZCL_ATTR_METERING_CURRENT_SUMMATION_DELIVERED_ID, &summation);
+    ok &= setMeteringAttribute(VALVE_ATTR_RUNS, &runs);
+    ok &= setMeteringAttribute(VALVE_ATTR_SAFETY_TRIPS, &trips);
+    ok &= setMeteringAttribute(VALVE_ATTR_LAST_START, &lastStart);
+    ok &= setMeteringAttribute(VALVE_ATTR_LAST_STOP, &lastStop);
+    return ok;
+}
+
+/**
+ * Default reporting of the run time, until the coordinator configures its own:
+ * a running zone is reported every deltaSeconds of run time at most, instead of
+ * on every update. Call once the stack is running.
+ *
+ * @param minIntervalS shortest time between two reports
+ * @param maxIntervalS longest time without one
+ * @param deltaSeconds run time that has to add up before a report
+ * @return true if the stack took the settings
+ */
+bool ZigbeeValve::setUsageReporting(uint16_t minIntervalS, uint16_t maxIntervalS, uint32_t deltaSeconds) {
+    esp_zb_zcl_reporting_info_t reporting = {};
+    reporting.direction = ESP_ZB_ZCL_CMD_DIRECTION_TO_SRV;
+    reporting.ep = _endpoint;
+    reporting.cluster_id = ESP_ZB_ZCL_CLUSTER_ID_METERING;
+    reporting.cluster_role = ESP_ZB_ZCL_CLUSTER_SERVER_ROLE;
+    reporting.attr_id = ESP_ZB_ZCL_ATTR_METERING_CURRENT_SUMMATION_DELIVERED_ID;
+    reporting.u.send_info.min_interval = minIntervalS;
+    reporting.u.send_info.max_interval = maxIntervalS;
+    reporting.u.send_info.def_min_interval = minIntervalS;
+    reporting.u.send_info.def_max_interval = maxIntervalS;
+    reporting.u.send_info.delta.u48.low = deltaSeconds;
+    reporting.dst.profile_id = ESP_ZB_AF_HA_PROFILE_ID;
+    reporting.manuf_code = ESP_ZB_ZCL_ATTR_NON_MANUFACTURER_SPECIFIC;
+
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_err_t err = esp_zb_zcl_update_reporting_info(&reporting);
+    esp_zb_lock_release();
+    return err == ESP_OK;
+}
+
+bool ZigbeeValve::setMeteringAttribute(uint16_t id, void *value) {
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_zb_zcl_status_t status = esp_zb_zcl_set_attribute_val(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_METERING,
+        ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, id, value, false);
+    esp_zb_lock_release();
+    return status == ESP_ZB_ZCL_STATUS_SUCCESS;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#ifndef ZigbeeValve_h
+#define ZigbeeValve_h
+
+#include <Arduino.h>
+#include "Zigbee.h"
+#include "ZoneMeter.h"
+
+// OnTime is in tenths of a second
+#define VALVE_ON_TIME_PER_MINUTE 600
+
+// Metering cluster: CurrentSummationDelivered counts run seconds; with the
+// zone's flow as Multiplier and 60 as Divisor it reads as litres delivered.
+#define VALVE_METERING_UNIT_LITRES 0x07
+#define VALVE_METERING_WATER       0x02
+// The rest of ZoneUsage, in the metering cluster's manufacturer range.
+// Times are the device's operating seconds, the current one is on the diagnostics endpoint.
+#define VALVE_ATTR_RUNS         0xF000 // uint32, reportable
+#define VALVE_ATTR_SAFETY_TRIPS 0xF001 // uint16, reportable
+#define VALVE_ATTR_LAST_START   0xF002 // uint32
+#define VALVE_ATTR_LAST_STOP    0xF003 // uint32
+// On/Off cluster, manufacturer range: place of a start waiting for a free controller
+#define VALVE_ATTR_QUEUE_POSITION 0xF000 // uint8, 1 = next, 0 when not waiting, reportable
+
+/**
+ * Zone endpoint: an on/off light whose On/Off cluster also has the OnTime,
+ * OffWaitTime and GlobalSceneControl attributes, so the coordinator can ask
+ * for a timed run (write OnTime, or send On With Timed Off) instead of
+ * sending an explicit OFF later. A start that has to wait for another zone
+ * keeps the endpoint ON and shows its place in line.
+ *
+ * A Metering cluster carries the zone's run accounting, see ZoneMeter.
+ */
+class ZigbeeValve : public ZigbeeLight {
+    public:
+        ZigbeeValve(uint8_t endpoint, uint8_t litresPerMinute = 1);
+        uint8_t takeRunMinutes();
+        bool setRunMinutes(uint8_t minutes);
+        bool setQueuePosition(uint8_t position);
+        bool publishUsage(const ZoneUsage &usage);
+        bool setUsageReporting(uint16_t minIntervalS, uint16_t maxIntervalS, uint32_t deltaSeconds);
+
+    private:
+        bool setOnTime(uint16_t onTime);
+        bool setMeteringAttribute(uint16_t id, void *value);
+};
+
+#endif
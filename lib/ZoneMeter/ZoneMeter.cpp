@@ -0,0 +1,223 @@
+/**
+ * Zone run accounting kept across resets, see ZoneMeter.h.
+ */
+
+#include "ZoneMeter.h"
+#include "esp_timer.h"
+
+/**
+ * Open the NVS namespace and read the counters saved before the reset.
+ *
+ * @param zones number of zones to account for (1 to ZONE_METER_MAX_ZONES)
+ * @return false if NVS cannot be used, the counters then start from zero at every boot
+ */
+bool ZoneMeter::begin(uint8_t zones) {
+    if (_open) {
+        return true;
+    }
+    _zones = zones > ZONE_METER_MAX_ZONES ? ZONE_METER_MAX_ZONES : zones;
+    if (!_prefs.begin(ZONE_METER_NAMESPACE, false)) {
+        return false;
+    }
+    _open = true;
+
+    if (_prefs.getBytesLength("usage") == sizeof(_record)
+            && _prefs.getBytes("usage", &_record, sizeof(_record)) == sizeof(_record)
+            && _record.version == VERSION) {
+        _bootSeconds = _record.operatingSeconds;
+    } else {
+        _record = {};
+    }
+    return true;
+}
+
+/**
+ * Record a start that has reached the controller. Any task.
+ *
+ * @param index zone index (0 to the number of zones - 1)
+ * @param timed false if the run only ends with an OFF or the safety timer
+ */
+void ZoneMeter::started(uint8_t index, bool timed) {
+    if (index >= _zones) {
+        return;
+    }
+    int64_t nowUs = esp_timer_get_time();
+    uint64_t bit = 1ULL << index;
+
+    portENTER_CRITICAL(&_lock);
+    if (_runStartUs[index] == 0) {
+        _runStartUs[index] = nowUs;
+        _record.usage[index].runs++;
+        _record.usage[index].lastStartS = now();
+    }
+    // A new start replaces the run time, and the safety timer with it
+    _untimed = timed ? (_untimed & ~bit) : (_untimed | bit);
+    _tripped &= ~bit;
+    changed(index, nowUs);
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * Record a stop that has reached the controller, or a run the controller
+ * has ended by itself. Any task.
+ *
+ * @param index zone index (0 to the number of zones - 1)
+ */
+void ZoneMeter::stopped(uint8_t index) {
+    if (index >= _zones) {
+        return;
+    }
+    int64_t nowUs = esp_timer_get_time();
+
+    portENTER_CRITICAL(&_lock);
+    if (_runStartUs[index] != 0) {
+        _record.usage[index].seconds += runSeconds(index, nowUs);
+        _record.usage[index].lastStopS = now();
+        _runStartUs[index] = 0;
+        changed(index, nowUs);
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * Record that the safety timer of a running zone has expired. Only counted
+ * for an untimed run or an overrun, and once per run. Any task.
+ *
+ * @param index zone index (0 to the number of zones - 1)
+ * @param overrun true if a timed run is still on well past its run time
+ * @return true if the trip was counted
+ */
+bool ZoneMeter::tripped(uint8_t index, bool overrun) {
+    if (index >= _zones) {
+        return false;
+    }
+    uint64_t bit = 1ULL << index;
+    bool counted = false;
+
+    portENTER_CRITICAL(&_lock);
+    if (_runStartUs[index] != 0 && ((_untimed & bit) || overrun) && !(_tripped & bit)) {
+        _record.usage[index].safetyTrips++;
+        _tripped |= bit;
+        changed(index, esp_timer_get_time());
+        counted = true;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return counted;
+}
+
+/**
+ * @param index zone index (0 to the number of zones - 1)
+ * @param usage filled in with the zone's counters, the current run included
+ * @return false if the zone index is out of range
+ */
+bool ZoneMeter::usage(uint8_t index, ZoneUsage &usage) {
+    if (index >= _zones) {
+        return false;
+    }
+    int64_t nowUs = esp_timer_get_time();
+
+    portENTER_CRITICAL(&_lock);
+    usage = _record.usage[index];
+    usage.seconds += runSeconds(index, nowUs);
+    portEXIT_CRITICAL(&_lock);
+    return true;
+}
+
+/**
+ * @return the zones whose counters changed since the last call, bit = zone index
+ */
+uint64_t ZoneMeter::takeChanged() {
+    portENTER_CRITICAL(&_lock);
+    uint64_t changed = _changed;
+    _changed = 0;
+    portEXIT_CRITICAL(&_lock);
+    return changed;
+}
+
+/**
+ * @return the zones with a run in progress, bit = zone index
+ */
+uint64_t ZoneMeter::running() {
+    uint64_t running = 0;
+
+    portENTER_CRITICAL(&_lock);
+    for (uint8_t i = 0; i < _zones; i++) {
+        if (_runStartUs[i] != 0) {
+            running |= 1ULL << i;
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+    return running;
+}
+
+/**
+ * @return operating seconds: the device's run time over every boot, up to
+ * 		the last write before each reset
+ */
+uint32_t ZoneMeter::now() {
+    return _bootSeconds + (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+/**
+ * Write the counters to NVS if they changed and the batching delay has passed.
+ * Call it regularly from a normal task.
+ *
+ * @param force write now, regardless of the delay
+ * @return milliseconds until the next write is due, or ZONE_METER_NO_COMMIT
+ */
+uint32_t ZoneMeter::commit(bool force) {
+    portENTER_CRITICAL(&_lock);
+    int64_t due = _commitDueUs;
+    portEXIT_CRITICAL(&_lock);
+
+    if (due == 0 || !_open) {
+        return ZONE_METER_NO_COMMIT;
+    }
+    int64_t nowUs = esp_timer_get_time();
+    if (!force && nowUs < due) {
+        return (uint32_t)((due - nowUs + 999) / 1000);
+    }
+
+    // Copied out so the bus tasks are not held up by the flash write
+    static Record record;
+    portENTER_CRITICAL(&_lock);
+    record = _record;
+    _commitDueUs = 0;
+    portEXIT_CRITICAL(&_lock);
+    record.version = VERSION;
+    record.zones = _zones;
+    record.operatingSeconds = now();
+
+    if (_prefs.putBytes("usage", &record, sizeof(record)) != sizeof(record)) {
+        portENTER_CRITICAL(&_lock);
+        if (_commitDueUs == 0) {
+            _commitDueUs = nowUs + ZONE_METER_COMMIT_MS * 1000LL;
+        }
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    portENTER_CRITICAL(&_lock);
+    due = _commitDueUs;
+    portEXIT_CRITICAL(&_lock);
+    return due == 0 ? ZONE_METER_NO_COMMIT : (uint32_t)((due - nowUs + 999) / 1000);
+}
+
+/**
+ * Seconds of the zone's current run so far, rounded. Call with _lock held.
+ */
+uint32_t ZoneMeter::runSeconds(uint8_t index, int64_t nowUs) {
+    if (_runStartUs[index] == 0) {
+        return 0;
+    }
+    return (uint32_t)((nowUs - _runStartUs[index] + 500000) / 1000000);
+}
+
+/**
+ * Mark a zone for publishing and schedule a write. Call with _lock held.
+ */
+void ZoneMeter::changed(uint8_t index, int64_t nowUs) {
+    _changed |= 1ULL << index;
+    if (_commitDueUs == 0) {
+        _commitDueUs = nowUs + ZONE_METER_COMMIT_MS * 1000LL;
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#ifndef ZoneMeter_h
+#define ZoneMeter_h
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#define ZONE_METER_MAX_ZONES 48
+#define ZONE_METER_NAMESPACE "meter"
+// Counters are written once this long after the first change, so a cycle of
+// runs costs one flash write. A reset loses at most this much accounting.
+#define ZONE_METER_COMMIT_MS 300000
+
+#define ZONE_METER_NO_COMMIT UINT32_MAX
+
+/**
+ * Accounting of one zone. Times are operating seconds, see ZoneMeter::now().
+ */
+struct ZoneUsage {
+    uint32_t seconds;      // total run time, the current run included
+    uint32_t runs;         // runs started (a start while running extends the run)
+    uint32_t lastStartS;   // when the last run started, 0 = never
+    uint32_t lastStopS;    // when the last run ended, 0 = never
+    uint16_t safetyTrips;  // untimed runs ended by the safety timer
+    uint16_t reserved;
+};
+
+/**
+ * Per-zone run time, run count, last start and stop and safety trips, kept in
+ * the nvs partition so the coordinator does not have to rebuild them from
+ * state history.
+ *
+ * The device has no wall clock, so times are operating seconds: how long the
+ * device has been running over all its boots, as far as the last write saved.
+ * Compare them with now(). A run in progress at a reset is not counted.
+ *
+ * Results come from the bus tasks and the loop, all updates only touch RAM;
+ * commit() writes every zone as one NVS entry once the batching delay is over.
+ */
+class ZoneMeter {
+    public:
+        bool begin(uint8_t zones);
+        void started(uint8_t index, bool timed);
+        void stopped(uint8_t index);
+        bool tripped(uint8_t index, bool overrun = false);
+        bool usage(uint8_t index, ZoneUsage &usage);
+        uint64_t takeChanged();
+        uint64_t running();
+        uint32_t now();
+        uint32_t commit(bool force = false);
+
+    private:
+        struct Record {
+            uint8_t version;
+            uint8_t zones;
+            uint8_t reserved[2];
+            uint32_t operatingSeconds; // now() when it was written
+            ZoneUsage usage[ZONE_METER_MAX_ZONES];
+        };
+
+        static const uint8_t VERSION = 1;
+
+        Preferences _prefs;
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+        bool _open = false;
+        uint8_t _zones = 0;
+        Record _record = {};
+        uint32_t _bootSeconds = 0;                        // operating seconds at boot
+        int64_t _runStartUs[ZONE_METER_MAX_ZONES] = {};   // 0 while the zone is off
+        uint64_t _untimed = 0;  // bit = zone index, the current run has no run time of its own
+        uint64_t _tripped = 0;  // bit = zone index, its safety trip is counted
+        uint64_t _changed = 0;  // bit = zone index, not published since the last takeChanged()
+        int64_t _commitDueUs = 0; // 0 while nothing is waiting
+
+        uint32_t runSeconds(uint8_t index, int64_t nowUs);
+        void changed(uint8_t index, int64_t nowUs);
+};
+
+#endif
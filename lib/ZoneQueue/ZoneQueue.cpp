@@ -0,0 +1,295 @@
+/**
+ * Zone start admission, see ZoneQueue.h.
+ */
+
+#include "ZoneQueue.h"
+
+/**
+ * Set the limits, with every zone in group 0 and a flow of 1 until setZone().
+ *
+ * @param zones number of zones (up to ZONE_QUEUE_MAX_ZONES)
+ * @param maxPerGroup zones that may run at once on one controller, at least 1
+ * @param maxFlow largest summed flow of the running zones, ZONE_QUEUE_NO_FLOW_LIMIT for none
+ * @return false if the arguments are out of range
+ */
+bool ZoneQueue::begin(uint8_t zones, uint8_t maxPerGroup, uint16_t maxFlow) {
+    if (zones > ZONE_QUEUE_MAX_ZONES || maxPerGroup == 0) {
+        return false;
+    }
+    portENTER_CRITICAL(&_lock);
+    _zoneCount = zones;
+    _maxPerGroup = maxPerGroup;
+    _maxFlow = maxFlow;
+    for (uint8_t i = 0; i < zones; i++) {
+        _zones[i] = {0, 1, 0};
+    }
+    portEXIT_CRITICAL(&_lock);
+    return true;
+}
+
+/**
+ * Describe a zone. Only before its first request().
+ *
+ * @param index zone index
+ * @param group controller it is on (below ZONE_QUEUE_MAX_GROUPS)
+ * @param flow its flow, in the unit of maxFlow
+ */
+void ZoneQueue::setZone(uint8_t index, uint8_t group, uint16_t flow) {
+    if (index >= _zoneCount || group >= ZONE_QUEUE_MAX_GROUPS) {
+        return;
+    }
+    portENTER_CRITICAL(&_lock);
+    _zones[index].group = group;
+    _zones[index].flow = flow;
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * A start has been asked for.
+ *
+ * @param index zone index
+ * @param minutes run time, handed back by next() if the start has to wait
+ * @param position set to its place in line on its controller (1 = next), 0 if admitted
+ * @return true if the zone may start now (or is already running), false if it waits
+ */
+bool ZoneQueue::request(uint8_t index, uint8_t minutes, uint8_t &position) {
+    position = 0;
+    if (index >= _zoneCount) {
+        return false;
+    }
+    portENTER_CRITICAL(&_lock);
+    bool admitted = true;
+    if ((_running >> index & 1) == 0) {
+        uint8_t slot = 0;
+        bool ahead = false; // a start on the same controller is already waiting
+        while (slot < _waitingCount && _waiting[slot] != index) {
+            ahead |= _zones[_waiting[slot]].group == _zones[index].group;
+            slot++;
+        }
+        if (slot < _waitingCount) {
+            // Asked again while waiting: keeps its place, with the latest run time
+            _zones[index].minutes = minutes;
+            position = positionOf(slot);
+            admitted = false;
+        } else if (!ahead && fits(index)) {
+            admit(index);
+        } else {
+            _zones[index].minutes = minutes;
+            _waiting[_waitingCount] = index;
+            position = positionOf(_waitingCount++);
+            _moved |= 1ULL << index;
+            admitted = false;
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+    return admitted;
+}
+
+/**
+ * Take a waiting start out of line, e.g. the zone was switched off again.
+ *
+ * @return true if it was waiting
+ */
+bool ZoneQueue::cancel(uint8_t index) {
+    bool found = false;
+    portENTER_CRITICAL(&_lock);
+    for (uint8_t slot = 0; slot < _waitingCount; slot++) {
+        if (_waiting[slot] == index) {
+            removeWaiting(slot);
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+    return found;
+}
+
+/**
+ * Drop every waiting start.
+ *
+ * @return bitmap of the zones that were waiting
+ */
+uint64_t ZoneQueue::cancelAll() {
+    uint64_t cancelled = 0;
+    portENTER_CRITICAL(&_lock);
+    for (uint8_t slot = 0; slot < _waitingCount; slot++) {
+        cancelled |= 1ULL << _waiting[slot];
+    }
+    _waitingCount = 0;
+    _moved |= cancelled;
+    portEXIT_CRITICAL(&_lock);
+    return cancelled;
+}
+
+/**
+ * A zone has stopped (or its start failed) and no longer counts as running.
+ * Does nothing for a zone that was not admitted.
+ */
+void ZoneQueue::release(uint8_t index) {
+    if (index >= _zoneCount) {
+        return;
+    }
+    portENTER_CRITICAL(&_lock);
+    if (_running >> index & 1) {
+        _running &= ~(1ULL << index);
+        _groupRunning[_zones[index].group]--;
+        _flowRunning -= _zones[index].flow;
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * @return true if a waiting start would be admitted by next() now
+ */
+bool ZoneQueue::ready() {
+    bool ready = false;
+    uint8_t blocked = 0; // bit = group whose first waiting start does not fit
+    portENTER_CRITICAL(&_lock);
+    for (uint8_t slot = 0; slot < _waitingCount && !ready; slot++) {
+        ready = admissible(_waiting[slot], blocked);
+    }
+    portEXIT_CRITICAL(&_lock);
+    return ready;
+}
+
+/**
+ * Admit the first waiting start that fits now. Only the first one waiting on
+ * each controller is considered, the ones behind it keep their order.
+ *
+ * @param index set to its zone
+ * @param minutes set to its run time
+ * @return false if none fits (or none is waiting)
+ */
+bool ZoneQueue::next(uint8_t &index, uint8_t &minutes) {
+    bool found = false;
+    uint8_t blocked = 0; // bit = group whose first waiting start does not fit
+    portENTER_CRITICAL(&_lock);
+    for (uint8_t slot = 0; slot < _waitingCount; slot++) {
+        uint8_t zone = _waiting[slot];
+        if (admissible(zone, blocked)) {
+            index = zone;
+            minutes = _zones[zone].minutes;
+            removeWaiting(slot);
+            admit(zone);
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+    return found;
+}
+
+/**
+ * @return the zone's place in line on its controller (1 = next), 0 if it is not waiting
+ */
+uint8_t ZoneQueue::position(uint8_t index) {
+    uint8_t position = 0;
+    portENTER_CRITICAL(&_lock);
+    for (uint8_t slot = 0; slot < _waitingCount; slot++) {
+        if (_waiting[slot] == index) {
+            position = positionOf(slot);
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+    return position;
+}
+
+/**
+ * @return true if the zone's start was admitted and it has not been released
+ */
+bool ZoneQueue::running(uint8_t index) {
+    if (index >= ZONE_QUEUE_MAX_ZONES) {
+        return false;
+    }
+    portENTER_CRITICAL(&_lock);
+    bool running = _running >> index & 1;
+    portEXIT_CRITICAL(&_lock);
+    return running;
+}
+
+bool ZoneQueue::waiting(uint8_t index) {
+    return position(index) != 0;
+}
+
+uint8_t ZoneQueue::waitingCount() {
+    portENTER_CRITICAL(&_lock);
+    uint8_t count = _waitingCount;
+    portEXIT_CRITICAL(&_lock);
+    return count;
+}
+
+/**
+ * @return bitmap of the zones whose position changed since the last call
+ */
+uint64_t ZoneQueue::takeMoved() {
+    portENTER_CRITICAL(&_lock);
+    uint64_t moved = _moved;
+    _moved = 0;
+    portEXIT_CRITICAL(&_lock);
+    return moved;
+}
+
+/**
+ * Whether the zone could start without going over a limit. Under the lock.
+ */
+bool ZoneQueue::fits(uint8_t index) {
+    const Zone &zone = _zones[index];
+    if (_groupRunning[zone.group] >= _maxPerGroup) {
+        return false;
+    }
+    // A single zone over the limit still runs, alone
+    return _maxFlow == ZONE_QUEUE_NO_FLOW_LIMIT || _flowRunning == 0 || _flowRunning + zone.flow <= _maxFlow;
+}
+
+/**
+ * Whether a waiting start may go now, visiting the line from the front. Under the lock.
+ *
+ * @param blocked bit = group whose first waiting start does not fit; updated
+ */
+bool ZoneQueue::admissible(uint8_t index, uint8_t &blocked) {
+    uint8_t group = 1 << _zones[index].group;
+    if (blocked & group) {
+        return false;
+    }
+    if (!fits(index)) {
+        blocked |= group;
+        return false;
+    }
+    return true;
+}
+
+void ZoneQueue::admit(uint8_t index) {
+    _running |= 1ULL << index;
+    _groupRunning[_zones[index].group]++;
+    _flowRunning += _zones[index].flow;
+}
+
+/**
+ * Close the gap left by a waiting start; the ones behind it on its controller move up.
+ */
+void ZoneQueue::removeWaiting(uint8_t slot) {
+    uint8_t group = _zones[_waiting[slot]].group;
+    _moved |= 1ULL << _waiting[slot];
+    for (uint8_t i = slot + 1; i < _waitingCount; i++) {
+        if (_zones[_waiting[i]].group == group) {
+            _moved |= 1ULL << _waiting[i];
+        }
+        _waiting[i - 1] = _waiting[i];
+    }
+    _waitingCount--;
+}
+
+/**
+ * 1-based place of the start in a slot among those on the same controller.
+ */
+uint8_t ZoneQueue::positionOf(uint8_t slot) {
+    uint8_t group = _zones[_waiting[slot]].group;
+    uint8_t position = 1;
+    for (uint8_t i = 0; i < slot; i++) {
+        if (_zones[_waiting[i]].group == group) {
+            position++;
+        }
+    }
+    return position;
+}
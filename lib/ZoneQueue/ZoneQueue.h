@@ -0,0 +1,66 @@
+#pragma once
+
+#ifndef ZoneQueue_h
+#define ZoneQueue_h
+
+#include <Arduino.h>
+
+#define ZONE_QUEUE_MAX_ZONES 64
+#define ZONE_QUEUE_MAX_GROUPS 4
+#define ZONE_QUEUE_NO_FLOW_LIMIT 0
+
+/**
+ * Admission control for zone starts: at most a given number of zones running
+ * per group (a controller, which only runs one station at a time) and, if set,
+ * a limit on their summed flow. A start that does not fit waits in line and is
+ * handed out by next() once enough running zones have stopped, in the order
+ * the starts came in (a start that does not fit yet does not hold up one on
+ * another controller).
+ *
+ * A zone counts as running from the moment its start is admitted until
+ * release(), so two starts in quick succession cannot both get through.
+ * Safe to call from any task.
+ */
+class ZoneQueue {
+    public:
+        bool begin(uint8_t zones, uint8_t maxPerGroup, uint16_t maxFlow = ZONE_QUEUE_NO_FLOW_LIMIT);
+        void setZone(uint8_t index, uint8_t group, uint16_t flow);
+        bool request(uint8_t index, uint8_t minutes, uint8_t &position);
+        bool cancel(uint8_t index);
+        uint64_t cancelAll();
+        void release(uint8_t index);
+        bool ready();
+        bool next(uint8_t &index, uint8_t &minutes);
+        uint8_t position(uint8_t index);
+        bool running(uint8_t index);
+        bool waiting(uint8_t index);
+        uint8_t waitingCount();
+        uint64_t takeMoved();
+
+    private:
+        struct Zone {
+            uint8_t group;
+            uint16_t flow;
+            uint8_t minutes; // of the waiting start
+        };
+
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+        Zone _zones[ZONE_QUEUE_MAX_ZONES] = {};
+        uint8_t _zoneCount = 0;
+        uint8_t _maxPerGroup = 1;
+        uint16_t _maxFlow = ZONE_QUEUE_NO_FLOW_LIMIT;
+        uint64_t _running = 0;                         // bit = zone index, admitted and not released
+        uint8_t _groupRunning[ZONE_QUEUE_MAX_GROUPS] = {};
+        uint32_t _flowRunning = 0;
+        uint8_t _waiting[ZONE_QUEUE_MAX_ZONES];        // zone indexes, first come first
+        uint8_t _waitingCount = 0;
+        uint64_t _moved = 0;                           // bit = zone index, position changed
+
+        bool fits(uint8_t index);
+        bool admissible(uint8_t index, uint8_t &blocked);
+        void admit(uint8_t index);
+        void removeWaiting(uint8_t slot);
+        uint8_t positionOf(uint8_t slot);
+};
+
+#endif
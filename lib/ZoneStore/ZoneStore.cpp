@@ -0,0 +1,122 @@
+/**
+ * Zone state kept across resets, see ZoneStore.h.
+ */
+
+#include "ZoneStore.h"
+#include "esp_timer.h"
+
+/**
+ * Open the NVS namespace and read the state saved before the reset.
+ *
+ * @return false if NVS cannot be used, nothing is persisted then
+ */
+bool ZoneStore::begin() {
+    if (_open) {
+        return true;
+    }
+    if (!_prefs.begin(ZONE_STORE_NAMESPACE, false)) {
+        return false;
+    }
+    _open = true;
+
+    Record record = {};
+    if (_prefs.getBytesLength("state") == sizeof(record)
+            && _prefs.getBytes("state", &record, sizeof(record)) == sizeof(record)
+            && record.version == VERSION) {
+        _bootRunning = record.running;
+        _restored = true;
+    }
+    // Until the reset has been dealt with, those zones still count as running
+    _running = _bootRunning;
+    _committed = _bootRunning;
+    return true;
+}
+
+/**
+ * @return true if a saved state was found, i.e. wasRunning() can be trusted.
+ * 		Otherwise every zone has to be treated as possibly running.
+ */
+bool ZoneStore::restored() {
+    return _restored;
+}
+
+/**
+ * @param index zone index (0 to ZONE_STORE_MAX_ZONES - 1)
+ * @return true if the zone was running (or in an unknown state) when the
+ * 		state was last saved before the reset
+ */
+bool ZoneStore::wasRunning(uint8_t index) {
+    if (!_restored || index >= ZONE_STORE_MAX_ZONES) {
+        return true;
+    }
+    return (_bootRunning >> index) & 1;
+}
+
+/**
+ * Record a zone's state. Only updates RAM, safe to call from any task.
+ *
+ * @param index zone index (0 to ZONE_STORE_MAX_ZONES - 1)
+ * @param running true if the zone is (or may be) running
+ */
+void ZoneStore::setRunning(uint8_t index, bool running) {
+    if (index >= ZONE_STORE_MAX_ZONES) {
+        return;
+    }
+    uint64_t bit = 1ULL << index;
+
+    portENTER_CRITICAL(&_lock);
+    _running = running ? (_running | bit) : (_running & ~bit);
+    if (_running != _committed) {
+        // A newly running zone shortens the wait, a stop never extends it
+        bool started = (_running & ~_committed) != 0;
+        int64_t due = esp_timer_get_time() + (started ? ZONE_STORE_START_COMMIT_MS : ZONE_STORE_STOP_COMMIT_MS) * 1000LL;
+        if (_commitDueUs == 0 || due < _commitDueUs) {
+            _commitDueUs = due;
+        }
+    } else {
+        _commitDueUs = 0;
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * Write the state to NVS if it changed and its batching delay has passed.
+ * Call it regularly from a normal task.
+ *
+ * @param force write now, regardless of the delay
+ * @return milliseconds until the next write is due, or ZONE_STORE_NO_COMMIT
+ */
+uint32_t ZoneStore::commit(bool force) {
+    portENTER_CRITICAL(&_lock);
+    int64_t due = _commitDueUs;
+    uint64_t running = _running;
+    portEXIT_CRITICAL(&_lock);
+
+    if (due == 0 || !_open) {
+        return ZONE_STORE_NO_COMMIT;
+    }
+    int64_t now = esp_timer_get_time();
+    if (!force && now < due) {
+        return (uint32_t)((due - now + 999) / 1000);
+    }
+
+    Record record = {};
+    record.version = VERSION;
+    record.running = running;
+    bool written = _prefs.putBytes("state", &record, sizeof(record)) == sizeof(record);
+
+    portENTER_CRITICAL(&_lock);
+    if (written) {
+        _committed = running;
+    }
+    if (_running == _committed) {
+        _commitDueUs = 0;
+    } else if (!written || _commitDueUs == due) {
+        // Failed, or nothing changed since: try again after the short delay
+        _commitDueUs = now + ZONE_STORE_START_COMMIT_MS * 1000LL;
+    }
+    due = _commitDueUs;
+    portEXIT_CRITICAL(&_lock);
+
+    return due == 0 ? ZONE_STORE_NO_COMMIT : (uint32_t)((due - now + 999) / 1000);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#ifndef ZoneStore_h
+#define ZoneStore_h
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#define ZONE_STORE_MAX_ZONES 64
+#define ZONE_STORE_NAMESPACE "zones"
+// A zone that starts running is written soon, so a reset right after does not
+// leave it running unnoticed. Stops only cost a redundant stop frame at boot
+// if they are lost, so they are batched for longer.
+#define ZONE_STORE_START_COMMIT_MS 500
+#define ZONE_STORE_STOP_COMMIT_MS 30000
+
+#define ZONE_STORE_NO_COMMIT UINT32_MAX
+
+/**
+ * Keeps the set of zones that may be running in the nvs partition, so the
+ * firmware knows after a reset which valves need a stop frame.
+ *
+ * Changes are only recorded in RAM; commit() writes the whole set as one NVS
+ * entry once the batching delay has passed, so a burst of changes costs a
+ * single flash write. NVS itself spreads the writes over its pages.
+ */
+class ZoneStore {
+    public:
+        bool begin();
+        bool restored();
+        bool wasRunning(uint8_t index);
+        void setRunning(uint8_t index, bool running);
+        uint32_t commit(bool force = false);
+
+    private:
+        struct Record {
+            uint8_t version;
+            uint8_t reserved[7];
+            uint64_t running; // bit i = zone index i may be running
+        };
+
+        static const uint8_t VERSION = 1;
+
+        Preferences _prefs;
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+        bool _open = false;
+        bool _restored = false;
+        uint64_t _bootRunning = 0; // as found at boot
+        uint64_t _running = 0;
+        uint64_t _committed = 0;
+        int64_t _commitDueUs = 0; // 0 while nothing is waiting
+};
+
+#endif
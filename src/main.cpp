@@ -1,115 +1,1498 @@
+#include <array>
+#include <utility>
 #include "Zigbee.h"
 #include "HunterRoam.h"
+#include "BusScheduler.h"
+#include "DeadlineTimer.h"
+#include "LatencyStats.h"
+#include "ZigbeeDiagnostics.h"
+#include "EventLog.h"
+#include "ZoneStore.h"
+#include "ZoneMeter.h"
+#include "ZoneQueue.h"
+#include "SequenceEngine.h"
+#include "ZigbeeSequencer.h"
+#include "SkipRules.h"
+#include "ZigbeeValve.h"
+#include "StallMonitor.h"
+#include "TimingStore.h"
 #include "esp_task_wdt.h" // Include for the Watchdog Timer
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "soc/soc_caps.h"
+#if POWER_SAVE
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#endif
 
 /********************* Configuration **************************/
-#define SMARTPORT_PIN D5
+#define SMARTPORT_PIN D5       // REM line of the first (or only) Hunter controller
 #define BUTTON_PIN    BOOT_PIN // Using the default BOOT button for factory reset
 #define LED_PIN       LED_BUILTIN
 #define LED_ON        LOW      // For many boards, the built-in LED is active-low (LOW turns it on)
 #define LED_OFF       HIGH
-#define NUM_ZONES     4
-#define SAFETY_TIMEOUT_MINUTES 60 // Safety shut-off time in minutes
+#define NUM_ZONES     4        // 1-48 (SmartPort limit); everything below is sized from this
+#define FIRST_ZONE_ENDPOINT 10 // Zone N is exposed on endpoint FIRST_ZONE_ENDPOINT + N - 1
+#define NUM_BUSES     1        // Hunter controllers driven by this board, each on its own REM line
+#define NUM_PROGRAMS  4        // Controller programs exposed per bus as switches (0-4), see handleProgramChange
+#define FIRST_PROGRAM_ENDPOINT 100 // Program P of bus B is on endpoint FIRST_PROGRAM_ENDPOINT + B * NUM_PROGRAMS + P - 1
+#define SAFETY_TIMEOUT_MINUTES 60 // Safety shut-off time in minutes, also the longest timed run
+#define SAFETY_RETRY_MS 5000      // Re-send the safety stop this often until it goes through
+#define SAFETY_OVERRUN_MS 10000   // A timed run not reported stopped this long after its run time is stopped as an overrun
+#define MAX_CONCURRENT_ZONES 1    // Zones running at once per controller; further starts wait in line (see handleZoneQueue)
+#define MAX_TOTAL_FLOW_LPM 0      // Summed flow of all running zones (ZONE_FLOW_LPM each), 0 for no limit
+#define ZONE_QUEUE_GAP_MS 1000    // Pause between a zone stopping and the next waiting one starting
 #define WDT_TIMEOUT_SECONDS 30    // Watchdog Timer: reboot if the main loop freezes for this long. Increased for stability.
+#define STALL_LOOP_MS (WDT_TIMEOUT_SECONDS * 1000 / 2) // Stall monitor: a loop pass, caught before the watchdog fires
+#define STALL_BUS_MS 10000        // One bus command (frame and result), or a command left waiting that long
+#define STALL_REPORT_MS 10000     // Writing attributes to the Zigbee stack from the loop
+#define LED_BLINK_MS 500          // Blink period while searching for the network
+#define FACTORY_RESET_HOLD_MS 5000
+#define ZIGBEE_CHECK_MS 2000      // How often the loop looks at the connection state while nothing else is due
+#define ZIGBEE_RETRY_MIN_MS 1000  // First retry of a failed Zigbee start, doubled on every further failure
+#define ZIGBEE_RETRY_MAX_MS 60000
+#define DIAGNOSTICS_ENDPOINT 1    // Latency telemetry cluster (see lib/ZigbeeDiagnostics)
+#define SEQUENCER_ENDPOINT 2      // On-device watering sequence (see lib/ZigbeeSequencer)
+#define RAIN_SENSOR_PIN -1        // Rain sensor switch between this GPIO and GND (pull-up enabled), -1 for none
+#define RAIN_SENSOR_WET HIGH      // Level while wet; HIGH suits the usual sensor that opens when wet
+#define RAIN_CHANCE_VALID_MS (36 * 3600000UL) // A rain chance pushed by the coordinator counts this long, then it is unknown
+#define ALL_OFF_ENDPOINT 3        // Momentary switch: ON stops every zone, see handleAllOffChange
+#define DIAGNOSTICS_PUBLISH_MS 60000 // Refresh the telemetry attributes at most this often, only when new commands came in
+#define DIAGNOSTICS_STATUS_MS 30000  // Refresh the status struct this often; reads are answered from the last copy
+#define ZONE_REPORT_WINDOW_MS 200 // Zone state changes within this window go out together, see flushZoneReports
+#define ZONE_FLOW_LPM 10          // Nominal flow of a zone in litres per minute, only scales the metered volume
+#define ZONE_METER_PUBLISH_MS 60000 // Run time of running zones is refreshed in the metering clusters this often
+#define ZONE_METER_REPORT_S 300   // Default reporting: a run time change this large (or an hour) is reported
+#define FIRMWARE_VERSION 0x00010000 // OTA file version of this build; an image is only taken if its version is higher
+#define OTA_MANUFACTURER 0x1001   // OTA image header fields the server matches images on
+#define OTA_IMAGE_TYPE   0x1011
+#define OTA_HW_VERSION   1
+#define OTA_BLOCK_SIZE   128      // Image bytes per block request (up to 223); smaller blocks hold the radio for less time
+#define OTA_BLOCK_PERIOD_MS 100   // Pause between block requests, leaves airtime for zone commands during a download
+#define OTA_VERIFY_TIMEOUT_MS 600000 // A new image that has not joined the network by then is rolled back
+#define LOG_PERSIST 1             // Keep the latest log records on the spiffs partition, printed at boot
+
+// Optional power saving (see the seeed_xiao_esp32c6_lowpower environment):
+// scale the CPU down and light-sleep whenever no frame is being sent and no zone is running.
+#ifndef POWER_SAVE
+#define POWER_SAVE 0
+#endif
+#define PM_MAX_FREQ_MHZ 160
+#define PM_MIN_FREQ_MHZ 40
+
+// Build with -DENCODER_BENCHMARK=1 to time the SmartPort encoder at boot
+#ifndef ENCODER_BENCHMARK
+#define ENCODER_BENCHMARK 0
+#endif
+
+// Build with -DSOAK_TEST=1 (see the seeed_xiao_esp32c6_soak environment) to drive random
+// bursts of zone, program and all-off commands through the callbacks until reset, see soakTask.
+// It switches real zones: run it on a bench controller.
+#ifndef SOAK_TEST
+#define SOAK_TEST 0
+#endif
+#define SOAK_BURST_MAX 8          // Commands per burst, 1 to this many
+#define SOAK_PAUSE_MIN_MS 200     // Pause between bursts, random in this range
+#define SOAK_PAUSE_MAX_MS 5000
+#define SOAK_RUN_MAX_MINUTES 3    // Starts are timed runs of 1 to this many minutes
+#define SOAK_PROGRAM_PERCENT 5    // Share of the commands that start a program
+#define SOAK_ALL_OFF_PERCENT 2    // Share of the commands that press the all-off switch
+#define SOAK_REPORT_MS 60000      // Log throughput, latency, heap and watchdog margin this often
+#define SOAK_TASK_PRIORITY 5      // Same as the Zigbee task, whose callbacks it stands in for
+
+#if POWER_SAVE && !CONFIG_PM_ENABLE
+#error "POWER_SAVE requires CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE in sdkconfig"
+#endif
+
+static_assert(NUM_ZONES >= 1 && NUM_ZONES <= HUNTER_MAX_ZONES, "NUM_ZONES must be 1-48");
+static_assert(FIRST_ZONE_ENDPOINT + NUM_ZONES - 1 <= 240, "Zigbee application endpoints end at 240");
+static_assert(DIAGNOSTICS_ENDPOINT >= 1 && DIAGNOSTICS_ENDPOINT < FIRST_ZONE_ENDPOINT, "the diagnostics endpoint must not overlap the zones");
+static_assert(SEQUENCER_ENDPOINT >= 1 && SEQUENCER_ENDPOINT < FIRST_ZONE_ENDPOINT && SEQUENCER_ENDPOINT != DIAGNOSTICS_ENDPOINT,
+              "the sequencer endpoint must not overlap the others");
+static_assert(ALL_OFF_ENDPOINT >= 1 && ALL_OFF_ENDPOINT < FIRST_ZONE_ENDPOINT
+              && ALL_OFF_ENDPOINT != DIAGNOSTICS_ENDPOINT && ALL_OFF_ENDPOINT != SEQUENCER_ENDPOINT,
+              "the all-off endpoint must not overlap the others");
+static_assert(NUM_PROGRAMS >= 0 && NUM_PROGRAMS <= HUNTER_MAX_PROGRAMS, "NUM_PROGRAMS must be 0-4");
+static_assert(FIRST_PROGRAM_ENDPOINT > FIRST_ZONE_ENDPOINT + NUM_ZONES - 1
+              && FIRST_PROGRAM_ENDPOINT + NUM_BUSES * NUM_PROGRAMS - 1 <= 240, "program endpoints must follow the zones");
+
+// One entry per controller: its REM pin and how many of the NUM_ZONES zones it runs.
+// Zones are assigned in order, e.g. {6, 8} makes zones 1-6 controller 1's stations 1-6
+// and zones 7-14 controller 2's stations 1-8. Each controller has its own bus task
+// (and RMT channel, the C6 has two), so frames to different controllers go out in parallel.
+constexpr uint8_t busPins[NUM_BUSES] = {SMARTPORT_PIN};
+constexpr uint8_t busZoneCounts[NUM_BUSES] = {NUM_ZONES};
+// Optional readback per controller: a GPIO wired to its REM line through a divider
+// (keep it below 3.3 V), -1 for none. Every frame is then compared with what the pin
+// saw and sent again at once if it was corrupted. The C6 has two RMT receive channels.
+constexpr int8_t busReadbackPins[NUM_BUSES] = {-1};
 
 // The ZoneConfig is simplified. Home Assistant will manage names and all timing.
-// We only need to define the Zigbee endpoint and a model name for identification.
+// We only need the Zigbee endpoint, the (bus, station) it drives and the callback
+// that routes its changes to the zone. The table is generated from the settings above.
 struct ZoneConfig {
-    const char* modelName;
     uint8_t endpoint;
+    uint8_t bus;     // index into busPins
+    uint8_t busZone; // station number on that controller (1-48)
+    void (*onChange)(bool state);
 };
 
-ZoneConfig zones[NUM_ZONES] = {
-    {"Zone 1", 10},
-    {"Zone 2", 11},
-    {"Zone 3", 12},
-    {"Zone 4", 13}
-};
+/********************* Zone Table *****************************/
+void handleZoneChange(uint8_t index, bool requestedState);
+
+constexpr size_t totalBusZones(size_t bus = 0) {
+    return bus >= NUM_BUSES ? 0 : busZoneCounts[bus] + totalBusZones(bus + 1);
+}
+
+constexpr uint8_t busForZone(size_t index, uint8_t bus = 0) {
+    return (bus + 1 >= NUM_BUSES || index < busZoneCounts[bus]) ? bus : busForZone(index - busZoneCounts[bus], bus + 1);
+}
+
+constexpr uint8_t busZoneForZone(size_t index, uint8_t bus = 0) {
+    return (bus + 1 >= NUM_BUSES || index < busZoneCounts[bus]) ? index + 1 : busZoneForZone(index - busZoneCounts[bus], bus + 1);
+}
+
+constexpr bool busZoneCountsValid(size_t bus = 0) {
+    return bus >= NUM_BUSES || (busZoneCounts[bus] <= HUNTER_MAX_ZONES && busZoneCountsValid(bus + 1));
+}
+
+static_assert(totalBusZones() == NUM_ZONES, "busZoneCounts must add up to NUM_ZONES");
+static_assert(busZoneCountsValid(), "a controller has at most 48 stations");
+// A bus without its own RMT channel is bit-banged, which holds the CPU for each whole frame
+static_assert(NUM_BUSES <= SOC_RMT_TX_CANDIDATES_PER_GROUP, "every controller needs an RMT transmit channel (the C6 has two)");
+
+// The Zigbee library callbacks carry no context, so each zone gets its own
+// trampoline with the zone index baked in as a template argument.
+template <uint8_t Index>
+void onZoneChange(bool state) {
+    handleZoneChange(Index, state);
+}
+
+template <size_t... I>
+constexpr std::array<ZoneConfig, sizeof...(I)> makeZoneTable(std::index_sequence<I...>) {
+    return {{ {FIRST_ZONE_ENDPOINT + I, busForZone(I), busZoneForZone(I), onZoneChange<I>}... }};
+}
+
+// Generate the endpoint table and the callbacks for zones 1..NUM_ZONES
+constexpr std::array<ZoneConfig, NUM_ZONES> zones = makeZoneTable(std::make_index_sequence<NUM_ZONES>());
+
+/********************* Program Table **************************/
+#define NUM_PROGRAM_SWITCHES (NUM_BUSES * NUM_PROGRAMS)
+constexpr uint8_t programsPerBus = NUM_PROGRAMS > 0 ? NUM_PROGRAMS : 1; // for index maths only
+
+void handleProgramChange(uint8_t index, bool requestedState);
+
+template <uint8_t Index>
+void onProgramChange(bool state) {
+    handleProgramChange(Index, state);
+}
+
+template <size_t... I>
+constexpr std::array<void (*)(bool), sizeof...(I)> makeProgramCallbacks(std::index_sequence<I...>) {
+    return {{ onProgramChange<I>... }};
+}
+
+// Program switch index = bus * NUM_PROGRAMS + program - 1
+constexpr std::array<void (*)(bool), NUM_PROGRAM_SWITCHES> programCallbacks =
+    makeProgramCallbacks(std::make_index_sequence<NUM_PROGRAM_SWITCHES>());
+
+/**
+ * @brief Maps a station on a controller back to its zone index.
+ * @return the zone index, or NUM_ZONES if the station is not mapped.
+ */
+uint8_t zoneIndexFor(uint8_t bus, uint8_t busZone) {
+    for (uint8_t i = 0; i < NUM_ZONES; i++) {
+        if (zones[i].bus == bus && zones[i].busZone == busZone) {
+            return i;
+        }
+    }
+    return NUM_ZONES;
+}
 
 /********************* Hardware Instances *********************/
-HunterRoam hunter(SMARTPORT_PIN);
-ZigbeeLight* valves[NUM_ZONES];
+HunterRoam* hunters[NUM_BUSES];
+BusScheduler* buses[NUM_BUSES]; // Each owns its HunterRoam once started; all frames go through its task
+ZigbeeValve* valves[NUM_ZONES];
+ZigbeeLight* programs[NUM_PROGRAM_SWITCHES]; // Momentary: ON starts the program, then reports OFF again
+ZigbeeDiagnostics* diagnostics;
+ZigbeeSequencer* sequencer;
+ZigbeeLight* allOff; // Momentary: ON stops every zone, reports OFF again once all stops are through
+
+// Where each command's time went, from the Zigbee callback to the end of its frame.
+static LatencyStats latencyStats;
 
-// Array to track the software safety timer for each zone.
+// Software safety timer for each zone, timer id = zone index. An armed timer means the zone is running.
 // Its only purpose is to sync the Zigbee state if the hardware timer shuts a valve off.
-static unsigned long zoneSafetyOffTime[NUM_ZONES] = {0};
+static DeadlineTimer safetyTimers;
+static_assert(NUM_ZONES <= DEADLINE_TIMER_CAPACITY, "not enough safety timer slots");
+// Timed runs are ended by the controller; when their timer expires they only get a
+// normal stop, see handleSafetyTimeout. Bit = zone index, written by the bus tasks and the loop.
+static portMUX_TYPE safetyLock = portMUX_INITIALIZER_UNLOCKED;
+static uint64_t timedRuns = 0;    // running with a run time of their own
+static uint64_t endingRuns = 0;   // run time over, the stop is on its way
+static uint64_t timedWaiting = 0; // in the zone queue with a run time of their own
+
+// Which zones may be running, kept in NVS so a reset only has to stop those.
+static ZoneStore zoneStore;
+static_assert(NUM_ZONES <= ZONE_STORE_MAX_ZONES, "not enough zone store slots");
+
+// Run time, run count, last start/stop and safety trips per zone, batched to NVS.
+static ZoneMeter zoneMeter;
+static_assert(NUM_ZONES <= ZONE_METER_MAX_ZONES, "not enough zone meter slots");
+
+// Starts beyond MAX_CONCURRENT_ZONES wait here; the controller would cut the running zone short.
+static ZoneQueue zoneQueue;
+static_assert(NUM_ZONES <= ZONE_QUEUE_MAX_ZONES && NUM_BUSES <= ZONE_QUEUE_MAX_GROUPS, "not enough zone queue slots");
+static_assert(MAX_CONCURRENT_ZONES >= 1, "MAX_CONCURRENT_ZONES must be at least 1");
+
+// Watering sequence run on the device, steps are timed by scheduleTimers.
+// A step can last as long as the safety timer, which is also the controller's own run time.
+static SequenceEngine sequence(NUM_ZONES, SAFETY_TIMEOUT_MINUTES);
+static DeadlineTimer scheduleTimers;
+#define SCHEDULE_SEQUENCE_STEP 0 // scheduleTimers id: end of the running sequence step
+#define SCHEDULE_QUEUE_NEXT 1    // scheduleTimers id: the next waiting zone start is due
 
 // States for the LED indicator
 enum LedState { UNKNOWN, BLINKING, ZONE_ACTIVE, CONNECTED_IDLE };
 
+// Counters for the status struct on the diagnostics endpoint, see handleDiagnosticsStatus.
+// The buses keep their own, see BusScheduler::stats().
+static LedState ledState = UNKNOWN;           // loop task only
+static uint16_t networkLosses = 0;            // loop task only
+static uint16_t safetyTripsSinceBoot = 0;     // loop task only
+static uint32_t loopWakes = 0;                // loop task only
+static volatile uint8_t lastBusError = 0;     // HunterError, written by the bus tasks
+
+// Which task or subsystem is stuck, recorded across the reboot it causes.
+static StallMonitor stallMonitor;
+static int loopWatch = -1;
+static int reportWatch = -1;
+static_assert(NUM_BUSES + 2 <= STALL_MONITOR_MAX_WATCHES, "not enough stall monitor watches");
+
+// Stall monitor context of reportWatch: what was being written
+enum ReportContext : uint32_t { REPORT_ZONES = 1, REPORT_LATENCY, REPORT_BOOT_TIMES, REPORT_TIMING, REPORT_USAGE, REPORT_QUEUE, REPORT_STATUS };
+
+/********************* Event Log ******************************/
+// Runtime messages are logged as binary records and printed by a low-priority
+// task, so a full USB-CDC buffer never stalls a Zigbee callback or a bus task.
+enum LogEvent : uint16_t {
+    LOG_ZONE_ON_REQUEST = 1, // arg0 zone, arg1 endpoint, arg2 safety minutes
+    LOG_ZONE_OFF_REQUEST,    // arg0 zone, arg1 endpoint
+    LOG_QUEUE_FAILED,        // arg0 zone
+    LOG_ZONE_STARTED,        // arg0 zone
+    LOG_ZONE_STOPPED,        // arg0 zone
+    LOG_ZONE_START_FAILED,   // arg0 zone, arg1 HunterError
+    LOG_ZONE_STOP_FAILED,    // arg0 zone, arg1 HunterError
+    LOG_INITIAL_SHUTDOWN,
+    LOG_BUTTON_PRESSED,
+    LOG_BUTTON_RELEASED,
+    LOG_FACTORY_RESET,
+    LOG_SAFETY_EXPIRED,      // arg0 zone
+    LOG_RESTORE_STOP,        // arg0 zone
+    LOG_RESTORE_NONE,        // no saved zone state, every zone gets a stop
+    LOG_SEQUENCE_LOADED,     // arg0 steps
+    LOG_SEQUENCE_REJECTED,   // arg0 bytes
+    LOG_SEQUENCE_STEP,       // arg0 step, arg1 zone, arg2 minutes
+    LOG_SEQUENCE_DONE,
+    LOG_SEQUENCE_ABORTED,    // arg0 step
+    LOG_PROGRAM_REQUEST,     // arg0 program, arg1 bus
+    LOG_PROGRAM_STARTED,     // arg0 program, arg1 bus
+    LOG_PROGRAM_FAILED,      // arg0 program, arg1 bus, arg2 HunterError
+    LOG_ALL_OFF_REQUEST,
+    LOG_ALL_OFF_DONE,        // arg0 milliseconds since the request
+    LOG_BUS_READY,           // arg1 milliseconds since reset
+    LOG_FIRST_COMMAND,       // arg1 milliseconds since reset
+    LOG_ZIGBEE_JOINED,       // arg1 milliseconds since reset
+    LOG_ZIGBEE_RETRY,        // arg1 milliseconds until the next attempt
+    LOG_STALL_RESET,         // arg0 stall monitor watch, arg1 milliseconds stuck, arg2 context
+    LOG_FRAME_RESENT,        // arg0 station or program, arg1 bus, arg2 retries
+    LOG_TIMING_PROFILE,      // arg0 TimingProfile
+    LOG_TIMING_REJECTED,     // arg0 value written
+    LOG_CALIBRATION_STARTED, // arg0 station, arg1 bus
+    LOG_CALIBRATED,          // arg0 reset milliseconds, arg1 bus, arg2 gap milliseconds
+    LOG_CALIBRATION_FAILED,  // arg1 bus, arg2 HunterError
+    LOG_OTA_TRIAL,           // arg1 FIRMWARE_VERSION
+    LOG_OTA_CONFIRMED,       // arg1 FIRMWARE_VERSION
+    LOG_OTA_ROLLBACK,        // arg1 FIRMWARE_VERSION
+    LOG_SEQUENCE_SKIPPED,    // arg0 step, arg1 skip rule (1-based)
+    LOG_SKIP_RULES_LOADED,   // arg0 rules
+    LOG_SKIP_RULES_REJECTED, // arg0 bytes
+    LOG_RAIN_CHANCE,         // arg0 percent, SEQUENCER_INPUT_UNKNOWN if cleared
+    LOG_RAIN_SENSOR,         // arg0 1 if wet
+    LOG_ZONE_QUEUED,         // arg0 zone, arg1 position
+    LOG_ZONE_DEQUEUED,       // arg0 zone, arg1 minutes
+    LOG_ZONE_QUEUE_CANCELLED, // arg0 zone
+    LOG_SOAK_THROUGHPUT,     // arg0 seconds, arg1 commands issued, arg2 commands handled by the buses
+    LOG_SOAK_LATENCY,        // arg0 worst total milliseconds, arg1 worst callback microseconds, arg2 p99 total microseconds
+    LOG_SOAK_MARGIN,         // arg1 lowest free heap bytes, arg2 longest milliseconds between watchdog feeds
+    LOG_BUS_BITBANGED        // arg1 bus
+};
+
+/**
+ * @brief Formats a LogEvent record, runs on the log task.
+ */
+int formatLogRecord(const LogRecord &record, char *buffer, size_t size) {
+    unsigned zone = record.arg0;
+
+    switch (record.event) {
+        case LOG_ZONE_ON_REQUEST:
+            return snprintf(buffer, size, "Received ON request for zone %u (endpoint %lu) for %lu minutes",
+                            zone, (unsigned long)record.arg1, (unsigned long)record.arg2);
+        case LOG_ZONE_OFF_REQUEST:
+            return snprintf(buffer, size, "Received OFF request for zone %u (endpoint %lu)", zone, (unsigned long)record.arg1);
+        case LOG_QUEUE_FAILED:
+            return snprintf(buffer, size, "ERROR: could not queue request for zone %u", zone);
+        case LOG_ZONE_STARTED:
+            return snprintf(buffer, size, "Successfully started zone %u", zone);
+        case LOG_ZONE_STOPPED:
+            return snprintf(buffer, size, "Successfully stopped zone %u", zone);
+        case LOG_ZONE_START_FAILED:
+        case LOG_ZONE_STOP_FAILED:
+            return snprintf(buffer, size, "ERROR %s zone %u: %s", record.event == LOG_ZONE_START_FAILED ? "starting" : "stopping",
+                            zone, HunterRoam::errorHint((HunterError)record.arg1));
+        case LOG_INITIAL_SHUTDOWN:
+            return snprintf(buffer, size, "First connect: Setting all zones to OFF as a safety measure.");
+        case LOG_BUTTON_PRESSED:
+            return snprintf(buffer, size, "Button pressed. Hold for %u seconds for factory reset.", FACTORY_RESET_HOLD_MS / 1000);
+        case LOG_BUTTON_RELEASED:
+            return snprintf(buffer, size, "Button released.");
+        case LOG_FACTORY_RESET:
+            return snprintf(buffer, size, "Factory reset triggered. Rebooting...");
+        case LOG_SAFETY_EXPIRED:
+            return snprintf(buffer, size, "Safety timer expired for zone %u. Updating Zigbee state to OFF.", zone);
+        case LOG_RESTORE_STOP:
+            return snprintf(buffer, size, "Zone %u was running before the reset, stopping it.", zone);
+        case LOG_RESTORE_NONE:
+            return snprintf(buffer, size, "No saved zone state, stopping every zone.");
+        case LOG_SEQUENCE_LOADED:
+            return snprintf(buffer, size, "Sequence program with %u steps saved.", record.arg0);
+        case LOG_SEQUENCE_REJECTED:
+            return snprintf(buffer, size, "ERROR: invalid sequence program (%u bytes), keeping the previous one.", record.arg0);
+        case LOG_SEQUENCE_STEP:
+            return snprintf(buffer, size, "Sequence step %u: zone %lu for %lu minutes", record.arg0,
+                            (unsigned long)record.arg1, (unsigned long)record.arg2);
+        case LOG_SEQUENCE_DONE:
+            return snprintf(buffer, size, "Sequence complete.");
+        case LOG_SEQUENCE_ABORTED:
+            return snprintf(buffer, size, "Sequence stopped during step %u.", record.arg0);
+        case LOG_PROGRAM_REQUEST:
+            return snprintf(buffer, size, "Received start request for program %u on bus %lu", record.arg0, (unsigned long)record.arg1 + 1);
+        case LOG_PROGRAM_STARTED:
+            return snprintf(buffer, size, "Successfully started program %u on bus %lu", record.arg0, (unsigned long)record.arg1 + 1);
+        case LOG_PROGRAM_FAILED:
+            return snprintf(buffer, size, "ERROR starting program %u on bus %lu: %s", record.arg0, (unsigned long)record.arg1 + 1,
+                            HunterRoam::errorHint((HunterError)record.arg2));
+        case LOG_ALL_OFF_REQUEST:
+            return snprintf(buffer, size, "Received all-off request, stopping every zone.");
+        case LOG_ALL_OFF_DONE:
+            return snprintf(buffer, size, "All zones off after %u ms.", record.arg0);
+        case LOG_BUS_READY:
+            return snprintf(buffer, size, "Bus ready %lu ms after reset.", (unsigned long)record.arg1);
+        case LOG_FIRST_COMMAND:
+            return snprintf(buffer, size, "First frame sent %lu ms after reset.", (unsigned long)record.arg1);
+        case LOG_ZIGBEE_JOINED:
+            return snprintf(buffer, size, "Zigbee connected %lu ms after reset.", (unsigned long)record.arg1);
+        case LOG_ZIGBEE_RETRY:
+            return snprintf(buffer, size, "ERROR: Zigbee failed to start, retrying in %lu ms.", (unsigned long)record.arg1);
+        case LOG_STALL_RESET:
+            return snprintf(buffer, size, "ERROR: last reset caused by a stall: %s busy for %lu ms (context 0x%08lx)",
+                            stallMonitor.name(record.arg0), (unsigned long)record.arg1, (unsigned long)record.arg2);
+        case LOG_FRAME_RESENT:
+            return snprintf(buffer, size, "Frame for station/program %u on bus %lu sent again %lu times after a failed readback",
+                            record.arg0, (unsigned long)record.arg1 + 1, (unsigned long)record.arg2);
+        case LOG_TIMING_PROFILE:
+            return snprintf(buffer, size, "Bus timing profile %u selected.", record.arg0);
+        case LOG_TIMING_REJECTED:
+            return snprintf(buffer, size, "ERROR: timing request %u not taken (unknown profile, calibration or zone running, no readback, "
+                            "or calibrating while profile 3 is in use).", record.arg0);
+        case LOG_CALIBRATION_STARTED:
+            return snprintf(buffer, size, "Calibrating bus %lu with stop frames for station %u.", (unsigned long)record.arg1 + 1, record.arg0);
+        case LOG_CALIBRATED:
+            return snprintf(buffer, size, "Bus %lu calibration candidate saved: reset %u ms, gap %lu ms. Select profile 3 once "
+                            "the zones are seen to switch with it.", (unsigned long)record.arg1 + 1, record.arg0, (unsigned long)record.arg2);
+        case LOG_CALIBRATION_FAILED:
+            return snprintf(buffer, size, "ERROR calibrating bus %lu: %s", (unsigned long)record.arg1 + 1,
+                            HunterRoam::errorHint((HunterError)record.arg2));
+        case LOG_OTA_TRIAL:
+            return snprintf(buffer, size, "Running new firmware 0x%08lx, rolled back unless it joins within %u s.",
+                            (unsigned long)record.arg1, OTA_VERIFY_TIMEOUT_MS / 1000);
+        case LOG_OTA_CONFIRMED:
+            return snprintf(buffer, size, "Firmware 0x%08lx joined the network, keeping it.", (unsigned long)record.arg1);
+        case LOG_OTA_ROLLBACK:
+            return snprintf(buffer, size, "ERROR: firmware 0x%08lx never joined the network, rolling back.", (unsigned long)record.arg1);
+        case LOG_SEQUENCE_SKIPPED:
+            return snprintf(buffer, size, "Sequence skipped from step %u on, skip rule %lu holds.", record.arg0,
+                            (unsigned long)record.arg1);
+        case LOG_SKIP_RULES_LOADED:
+            return snprintf(buffer, size, "Skip rules saved (%u rules).", record.arg0);
+        case LOG_SKIP_RULES_REJECTED:
+            return snprintf(buffer, size, "ERROR: invalid skip rules (%u bytes), keeping the previous ones.", record.arg0);
+        case LOG_RAIN_CHANCE:
+            if (record.arg0 == SEQUENCER_INPUT_UNKNOWN) {
+                return snprintf(buffer, size, "Rain chance cleared.");
+            }
+            return snprintf(buffer, size, "Rain chance set to %u %%.", record.arg0);
+        case LOG_RAIN_SENSOR:
+            return snprintf(buffer, size, "Rain sensor %s.", record.arg0 ? "wet" : "dry");
+        case LOG_ZONE_QUEUED:
+            return snprintf(buffer, size, "Zone %u waits for a free controller, position %lu.", zone, (unsigned long)record.arg1);
+        case LOG_ZONE_DEQUEUED:
+            return snprintf(buffer, size, "Starting waiting zone %u for %lu minutes.", zone, (unsigned long)record.arg1);
+        case LOG_ZONE_QUEUE_CANCELLED:
+            return snprintf(buffer, size, "Waiting start of zone %u cancelled.", zone);
+        case LOG_BUS_BITBANGED:
+            return snprintf(buffer, size, "ERROR: no RMT channel for bus %lu; bit-banging it holds the CPU for every frame and delays the other buses.",
+                            (unsigned long)record.arg1 + 1);
+        case LOG_SOAK_THROUGHPUT: {
+            unsigned long perHundredS = record.arg0 ? (uint64_t)record.arg1 * 100 / record.arg0 : 0;
+            return snprintf(buffer, size, "Soak: %lu commands in %u s (%lu.%02lu/s), %lu handled by the buses.",
+                            (unsigned long)record.arg1, record.arg0, perHundredS / 100, perHundredS % 100,
+                            (unsigned long)record.arg2);
+        }
+        case LOG_SOAK_LATENCY:
+            return snprintf(buffer, size, "Soak: worst callback %lu us, total p99 %lu us, worst total %u ms.",
+                            (unsigned long)record.arg1, (unsigned long)record.arg2, record.arg0);
+        case LOG_SOAK_MARGIN:
+            return snprintf(buffer, size, "Soak: heap low-water %lu bytes, longest watchdog feed gap %lu ms (%ld ms margin).",
+                            (unsigned long)record.arg1, (unsigned long)record.arg2,
+                            (long)(WDT_TIMEOUT_SECONDS * 1000L) - (long)record.arg2);
+        default:
+            return snprintf(buffer, size, "Unknown event %u", record.event);
+    }
+}
+
+static EventLog eventLog(formatLogRecord);
+
+/********************* Event Scheduling ***********************/
+// The main loop sleeps until one of these is notified, instead of polling.
+#define EVENT_BUTTON (1 << 0) // BUTTON_PIN changed level
+#define EVENT_TIMER  (1 << 1) // The next deadline armed on wakeTimer is due
+#define EVENT_ZONES  (1 << 2) // A bus command completed, zone states changed
+#define EVENT_SEQUENCE (1 << 3) // The coordinator wrote the sequencer cluster
+#define EVENT_ALL_OFF (1 << 4)  // The all-off switch was turned on
+#define EVENT_TIMING (1 << 5)   // Timing profile written or a calibration ended
+#define EVENT_SKIP_INPUT (1 << 6) // Skip rules or the rain chance written, or the rain sensor changed
+
+#define NO_DEADLINE UINT32_MAX
+
+static TaskHandle_t loopTaskHandle = nullptr;
+static esp_timer_handle_t wakeTimer = nullptr;
+
+/**
+ * @brief Wakes the main loop with the given event bits. Safe to call from any task.
+ */
+void notifyLoop(uint32_t events) {
+    if (loopTaskHandle != nullptr) {
+        xTaskNotify(loopTaskHandle, events, eSetBits);
+    }
+}
+
+void IRAM_ATTR onButtonInterrupt() {
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(loopTaskHandle, EVENT_BUTTON, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+void onWakeTimer(void *arg) {
+    notifyLoop(EVENT_TIMER);
+}
+
+/**
+ * @brief Re-arms the one-shot wake timer to fire after the given delay.
+ */
+void armWakeTimer(uint32_t delayMs) {
+    esp_timer_stop(wakeTimer);
+    esp_timer_start_once(wakeTimer, (uint64_t)delayMs * 1000ULL);
+}
+
+/********************* Startup ********************************/
+// Milestones of this boot, esp_timer_get_time() (0 = not reached yet). The timer
+// starts early in the boot, so the few hundred ms in the bootloader are not included.
+static int64_t busReadyUs = 0;
+static int64_t joinedUs = 0;
+static portMUX_TYPE firstCommandLock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t firstCommandUs = 0; // set from whichever bus task completes a frame first
+
+#define ZIGBEE_TASK_NAME "Zigbee_main" // created by Zigbee.begin() once the stack is set up
+
+void updateRadioLock(bool listening);
+
+/**
+ * @brief Records when the first frame of this boot left a bus. Any task.
+ */
+void recordFirstCommand(int64_t doneUs) {
+    if (doneUs == 0) {
+        return; // nothing was sent, e.g. a skipped stop
+    }
+    portENTER_CRITICAL(&firstCommandLock);
+    bool first = firstCommandUs == 0;
+    if (first) {
+        firstCommandUs = doneUs;
+    }
+    portEXIT_CRITICAL(&firstCommandLock);
+    if (first) {
+        eventLog.log(LOG_FIRST_COMMAND, 0, doneUs / 1000);
+    }
+}
+
+/**
+ * @brief Starts the Zigbee stack off the main loop, which keeps running the
+ * buses and safety timers meanwhile. Zigbee.begin() waits for the stack to come
+ * up; if it gives up while the stack runs, it keeps joining by itself. Only a
+ * stack that did not even start is retried, with exponential backoff instead
+ * of a reboot, which would also cut running stops short.
+ */
+void zigbeeStartTask(void *arg) {
+    uint32_t backoffMs = ZIGBEE_RETRY_MIN_MS;
+
+    // From here on the radio listens, for as long as the stack runs
+    updateRadioLock(true);
+    while (!Zigbee.begin() && xTaskGetHandle(ZIGBEE_TASK_NAME) == nullptr) {
+        updateRadioLock(false);
+        eventLog.log(LOG_ZIGBEE_RETRY, 0, backoffMs);
+        vTaskDelay(pdMS_TO_TICKS(backoffMs));
+        backoffMs = min(backoffMs * 2, (uint32_t)ZIGBEE_RETRY_MAX_MS);
+        updateRadioLock(true);
+    }
+    vTaskDelete(nullptr);
+}
+
+/********************* Power Management ***********************/
+#if POWER_SAVE
+static esp_pm_lock_handle_t zoneActivePmLock = nullptr;
+static esp_pm_lock_handle_t radioPmLock = nullptr;
+#endif
+
+/**
+ * @brief Enables frequency scaling, and automatic light sleep while nothing holds a lock:
+ * the bus task while a frame is on the bus, the loop while a zone runs and the Zigbee
+ * start task while the stack runs (see updateRadioLock). esp_timer deadlines and the
+ * button wake the chip.
+ */
+void setupPowerManagement() {
+#if POWER_SAVE
+    esp_pm_config_t pmConfig = {};
+    pmConfig.max_freq_mhz = PM_MAX_FREQ_MHZ;
+    pmConfig.min_freq_mhz = PM_MIN_FREQ_MHZ;
+    pmConfig.light_sleep_enable = true;
+    esp_err_t err = esp_pm_configure(&pmConfig);
+    if (err != ESP_OK) {
+        Serial.printf("Power management unavailable: %s\n", esp_err_to_name(err));
+        return;
+    }
+    esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "zone_active", &zoneActivePmLock);
+    esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "zigbee_rx", &radioPmLock);
+
+    // The BOOT button is active-low and must be able to wake the chip.
+    gpio_wakeup_enable((gpio_num_t)BUTTON_PIN, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    Serial.println("Power management enabled (frequency scaling, light sleep while Zigbee is down).");
+#endif
+}
+
+/**
+ * @brief Keeps the chip out of light sleep while the Zigbee radio has to listen.
+ * The device is an end device with rx on when idle: its parent sends commands
+ * at any time instead of holding them for the next poll, and a light-sleeping
+ * chip has its radio off, so it would miss them. A sleepy end device would
+ * delay every zone command to its next poll. So the chip only light-sleeps
+ * while the stack is not running: before it starts and between start retries.
+ */
+void updateRadioLock(bool listening) {
+#if POWER_SAVE
+    static bool held = false;
+    if (radioPmLock == nullptr || listening == held) {
+        return;
+    }
+    if (listening) {
+        esp_pm_lock_acquire(radioPmLock);
+    } else {
+        esp_pm_lock_release(radioPmLock);
+    }
+    held = listening;
+#endif
+}
+
+/**
+ * @brief Keeps the chip out of light sleep while at least one zone is running.
+ */
+void updatePowerLock(bool zoneActive) {
+#if POWER_SAVE
+    static bool held = false;
+    if (zoneActivePmLock == nullptr || zoneActive == held) {
+        return;
+    }
+    if (zoneActive) {
+        esp_pm_lock_acquire(zoneActivePmLock);
+    } else {
+        esp_pm_lock_release(zoneActivePmLock);
+    }
+    held = zoneActive;
+#endif
+}
+
+/********************* Zone Reports ***************************/
+// Zone endpoints are not updated as each result comes in but once per window,
+// together with the bitmap of running zones, so a burst of changes costs one
+// report per zone that actually changed plus one snapshot of all of them.
+static portMUX_TYPE zoneReportLock = portMUX_INITIALIZER_UNLOCKED;
+static uint64_t zoneReportsDirty = 0;  // bit = zone index, endpoint may be out of date
+static uint64_t zoneReportsForced = 0; // bit = zone index, report even if unchanged
+static int64_t zoneReportsDueUs = 0;   // 0 while nothing is waiting
+static bool reportingZones = false;    // flushZoneReports is updating endpoints, loop task only
+
+void flushZoneReports();
+
+/**
+ * @brief Marks a zone's endpoint for the next report. Any task.
+ * @param force also report a state the endpoint already has, e.g. to overwrite
+ * a stale value on the coordinator.
+ */
+void reportZone(uint8_t index, bool force = false) {
+    portENTER_CRITICAL(&zoneReportLock);
+    zoneReportsDirty |= 1ULL << index;
+    if (force) {
+        zoneReportsForced |= 1ULL << index;
+    }
+    if (zoneReportsDueUs == 0) {
+        // Not pushed back by later changes, so a report is never late by more than one window
+        zoneReportsDueUs = esp_timer_get_time() + ZONE_REPORT_WINDOW_MS * 1000LL;
+    }
+    portEXIT_CRITICAL(&zoneReportLock);
+}
+
+/**
+ * @return true while flushZoneReports is updating endpoints from this task.
+ */
+bool isReportingZones() {
+    return reportingZones && xTaskGetCurrentTaskHandle() == loopTaskHandle;
+}
+
 /********************* Core Logic *****************************/
 
 /**
- * @brief Handles a state change request
+ * @brief Handles a state change request by queueing the matching bus command.
+ * Returns immediately; the result is handled in onBusResult once the frame is sent.
+ * A timed ON (OnTime set) sends its run time to the controller, which then ends
+ * the run by itself; a plain ON runs for the safety timeout unless switched off.
+ * An ON beyond MAX_CONCURRENT_ZONES waits in zoneQueue instead.
  */
 void handleZoneChange(uint8_t index, bool requestedState) {
-    uint8_t zoneNumber = index + 1; // The HunterRoam library is 1-based
+    int64_t requestedUs = esp_timer_get_time();
+
+    // State reports pushed from a bus task or by flushZoneReports re-enter here; they are not requests.
+    if (isReportingZones()) {
+        return;
+    }
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        if (buses[b]->inBusTask()) {
+            return;
+        }
+    }
+
+    uint8_t zoneNumber = index + 1;
+    BusScheduler *bus = buses[zones[index].bus];
+    bool queued;
 
     if (requestedState) {
-        Serial.printf("Received ON request for zone %d (%s) with %d-minute safety timer\n", zoneNumber, zones[index].modelName, SAFETY_TIMEOUT_MINUTES);
-        byte err = hunter.startZone(zoneNumber, SAFETY_TIMEOUT_MINUTES);
+        uint8_t minutes = valves[index]->takeRunMinutes();
+        // A plain ON runs for the safety timeout; a run time asked for is capped by it
+        bool timed = minutes != 0;
+        if (minutes == 0 || minutes > SAFETY_TIMEOUT_MINUTES) {
+            minutes = SAFETY_TIMEOUT_MINUTES;
+        }
+        eventLog.log(LOG_ZONE_ON_REQUEST, zoneNumber, zones[index].endpoint, minutes);
+        uint8_t position;
+        if (!zoneQueue.request(index, minutes, position)) {
+            // The endpoint stays ON and shows its place in line
+            portENTER_CRITICAL(&safetyLock);
+            timedWaiting = timed ? (timedWaiting | 1ULL << index) : (timedWaiting & ~(1ULL << index));
+            portEXIT_CRITICAL(&safetyLock);
+            eventLog.log(LOG_ZONE_QUEUED, zoneNumber, position);
+            notifyLoop(EVENT_ZONES);
+            return;
+        }
+        queued = bus->startZone(zones[index].busZone, minutes, requestedUs, timed);
+    } else {
+        eventLog.log(LOG_ZONE_OFF_REQUEST, zoneNumber, zones[index].endpoint);
+        if (zoneQueue.cancel(index)) {
+            eventLog.log(LOG_ZONE_QUEUE_CANCELLED, zoneNumber);
+            notifyLoop(EVENT_ZONES);
+        }
+        // Sent anyway: the bus skips it for a zone it knows is off, and its result reports the endpoint
+        queued = bus->stopZone(zones[index].busZone, requestedUs);
+    }
+
+    if (!queued) {
+        eventLog.log(LOG_QUEUE_FAILED, zoneNumber);
+        if (requestedState) {
+            zoneQueue.release(index);
+        }
+    }
+}
+
+/**
+ * @brief Handles a program switch: ON starts the controller's program, which then
+ * runs its zones with the controller's own timing (one short frame for a whole cycle).
+ * There is no frame to stop a program, so OFF does nothing; the switch turns
+ * itself off again once the start has been sent.
+ */
+void handleProgramChange(uint8_t index, bool requestedState) {
+    int64_t requestedUs = esp_timer_get_time();
+
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        if (buses[b]->inBusTask()) {
+            return;
+        }
+    }
+    if (!requestedState) {
+        return;
+    }
+
+    uint8_t bus = index / programsPerBus;
+    uint8_t program = index % programsPerBus + 1;
+    eventLog.log(LOG_PROGRAM_REQUEST, program, bus);
+    if (!buses[bus]->startProgram(program, requestedUs)) {
+        eventLog.log(LOG_PROGRAM_FAILED, program, bus, (uint32_t)HunterError::InvalidProgram);
+    }
+}
+
+/**
+ * @brief Results of program starts: logs them and turns the momentary switch off.
+ * The zones the program runs are not known here, they are not tracked as running.
+ */
+void onProgramResult(const BusCommand &command, HunterError err, uint8_t bus) {
+    if (err != HunterError::None) {
+        eventLog.log(LOG_PROGRAM_FAILED, command.target, bus, (uint32_t)err);
+    } else {
+        eventLog.log(LOG_PROGRAM_STARTED, command.target, bus);
+        // The program may run any zone; make sure a reset stops them.
+        for (uint8_t i = 0; i < NUM_ZONES; i++) {
+            if (zones[i].bus == bus) {
+                zoneStore.setRunning(i, true);
+            }
+        }
+        notifyLoop(EVENT_ZONES);
+    }
+
+    uint8_t index = bus * programsPerBus + command.target - 1;
+    if (command.target >= 1 && command.target <= NUM_PROGRAMS && programs[index]->getLightState()) {
+        programs[index]->setLight(false);
+    }
+}
+
+/********************* Zone Queue *****************************/
+/**
+ * @brief Starts the waiting zones once running ones have stopped, a short pause
+ * after the stop, and shows every changed place in line on its endpoint.
+ * @return NO_DEADLINE, the pause is on scheduleTimers and zone results wake the loop.
+ */
+uint32_t handleZoneQueue() {
+    int64_t now = esp_timer_get_time();
+
+    if (scheduleTimers.takeExpired(SCHEDULE_QUEUE_NEXT, now)) {
+        uint8_t index;
+        uint8_t minutes;
+        while (zoneQueue.next(index, minutes)) {
+            eventLog.log(LOG_ZONE_DEQUEUED, index + 1, minutes);
+            portENTER_CRITICAL(&safetyLock);
+            bool timed = timedWaiting >> index & 1;
+            portEXIT_CRITICAL(&safetyLock);
+            // Its latency is counted from here, not from the ON it waited on
+            if (!buses[zones[index].bus]->startZone(zones[index].busZone, minutes, now, timed)) {
+                eventLog.log(LOG_QUEUE_FAILED, index + 1);
+                zoneQueue.release(index);
+                reportZone(index);
+            }
+        }
+    } else if (!scheduleTimers.isArmed(SCHEDULE_QUEUE_NEXT) && zoneQueue.ready()) {
+        scheduleTimers.arm(SCHEDULE_QUEUE_NEXT, now + ZONE_QUEUE_GAP_MS * 1000LL);
+    }
+
+    uint64_t moved = zoneQueue.takeMoved();
+    if (moved != 0) {
+        stallMonitor.busy(reportWatch, REPORT_QUEUE);
+        for (uint8_t i = 0; i < NUM_ZONES; i++) {
+            if (moved >> i & 1) {
+                valves[i]->setQueuePosition(zoneQueue.position(i));
+            }
+        }
+        stallMonitor.idle(reportWatch);
+    }
+    return NO_DEADLINE;
+}
+
+/********************* All Off ********************************/
+// Zones whose command since the last all-off request has not been handled yet, bit = zone index.
+static portMUX_TYPE allOffLock = portMUX_INITIALIZER_UNLOCKED;
+static uint64_t allOffPending = 0;
+static int64_t allOffRequestUs = 0;
+static bool allOffRequested = false;
+
+void onSequenceControl(uint8_t command);
+
+/**
+ * @brief Handles the all-off switch: ON queues a stop for every station of every
+ * controller in one pass, ahead of anything else waiting for the bus. Stations
+ * already known to be off cost no frame, the others are stopped back to back,
+ * each with the bus's selected timing. The switch turns itself off again once every zone is through.
+ */
+void handleAllOffChange(bool requestedState) {
+    int64_t requestedUs = esp_timer_get_time();
+
+    if (!requestedState) {
+        return;
+    }
+    portENTER_CRITICAL(&allOffLock);
+    allOffPending = (1ULL << NUM_ZONES) - 1;
+    allOffRequestUs = requestedUs;
+    allOffRequested = true;
+    portEXIT_CRITICAL(&allOffLock);
+
+    eventLog.log(LOG_ALL_OFF_REQUEST);
+    zoneQueue.cancelAll();
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        buses[b]->stopAll(busZoneCounts[b], requestedUs);
+    }
+    notifyLoop(EVENT_ALL_OFF);
+}
+
+/**
+ * @brief Called from the bus tasks with every zone result. Only commands queued
+ * after the all-off request count; one already on the bus is older.
+ */
+void allOffHandled(uint8_t index, int64_t queuedUs) {
+    portENTER_CRITICAL(&allOffLock);
+    if (queuedUs >= allOffRequestUs) {
+        allOffPending &= ~(1ULL << index);
+    }
+    portEXIT_CRITICAL(&allOffLock);
+}
+
+/**
+ * @return true while results for the last all-off request are still coming in.
+ */
+bool isAllOffPending() {
+    portENTER_CRITICAL(&allOffLock);
+    bool pending = allOffPending != 0;
+    portEXIT_CRITICAL(&allOffLock);
+    return pending;
+}
+
+/**
+ * @brief Stops a running sequence for an all-off request, and once every zone
+ * has been handled sends their reports at once and resets the switch.
+ * @return NO_DEADLINE, zone results wake the loop.
+ */
+uint32_t handleAllOff() {
+    static bool active = false;
 
-        if (err != 0) {
-            Serial.printf("ERROR starting zone %d: %s\n",
-                          zoneNumber, hunter.errorHint(err).c_str());
+    portENTER_CRITICAL(&allOffLock);
+    bool requested = allOffRequested;
+    bool done = allOffPending == 0;
+    int64_t requestUs = allOffRequestUs;
+    allOffRequested = false;
+    portEXIT_CRITICAL(&allOffLock);
+
+    if (requested) {
+        // Otherwise its next step would start a zone again
+        onSequenceControl(SEQUENCER_CONTROL_STOP);
+        active = true;
+    }
+    if (!active || !done) {
+        return NO_DEADLINE;
+    }
+    active = false;
+    eventLog.log(LOG_ALL_OFF_DONE, (esp_timer_get_time() - requestUs) / 1000);
+    // The zone reports held back during the all-off go out with this loop pass
+    flushZoneReports();
+    allOff->setLight(false);
+    return NO_DEADLINE;
+}
+
+/********************* Bus Timing *****************************/
+// Reset impulse and gap of the frames, from the profile selected on endpoint 1 and
+// kept in NVS. Writes and calibration results are handed to the loop, which saves them.
+// A calibration result is only used once the coordinator selects TIMING_CALIBRATED:
+// the readback cannot tell whether the controller took the shorter frames.
+static TimingStore timingStore;
+static_assert(NUM_BUSES <= TIMING_STORE_MAX_BUSES, "not enough timing store slots");
+static portMUX_TYPE timingLock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t timingRequest = 0;
+static bool timingRequested = false;
+static uint8_t calibrationsEnded = 0;     // bit = bus index
+static uint8_t calibrationsSucceeded = 0; // bit = bus index
+static uint8_t calibrationsRunning = 0;   // bit = bus index, loop task only
+static bool timingPublished = false;      // loop task only
+
+bool isAnyZoneActive();
+
+/**
+ * @brief Zigbee task: the coordinator wrote the timing profile attribute.
+ */
+void onTimingWrite(uint8_t value) {
+    portENTER_CRITICAL(&timingLock);
+    timingRequest = value;
+    timingRequested = true;
+    portEXIT_CRITICAL(&timingLock);
+    notifyLoop(EVENT_TIMING);
+}
+
+/**
+ * @brief Hands every bus the timing the selected profile gives it.
+ */
+void applyTimingProfile() {
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        buses[b]->setTiming(timingStore.timing(b));
+    }
+}
+
+/**
+ * @brief Bus task: a calibration has ended. On success its result waits in
+ * BusScheduler::calibrationResult(), the bus keeps its timing.
+ */
+void onCalibrationResult(HunterError err, uint8_t bus) {
+    portENTER_CRITICAL(&timingLock);
+    calibrationsEnded |= 1 << bus;
+    if (err == HunterError::None) {
+        calibrationsSucceeded |= 1 << bus;
+    }
+    portEXIT_CRITICAL(&timingLock);
+
+    if (err != HunterError::None) {
+        eventLog.log(LOG_CALIBRATION_FAILED, 0, bus, (uint32_t)err);
+    }
+    notifyLoop(EVENT_TIMING);
+}
+
+/**
+ * @brief Calibrates every bus that has a readback pin. Its frames are stops for
+ * the bus's last station, so nothing may be running. Not while the calibrated
+ * profile is selected, whose timing the new result would replace unchecked.
+ */
+void startCalibration() {
+    if (calibrationsRunning == 0 && !isAnyZoneActive() && timingStore.profile() != TIMING_CALIBRATED) {
+        for (uint8_t b = 0; b < NUM_BUSES; b++) {
+            if (hunters[b]->readbackEnabled() && buses[b]->calibrate(busZoneCounts[b])) {
+                calibrationsRunning |= 1 << b;
+                eventLog.log(LOG_CALIBRATION_STARTED, busZoneCounts[b], b);
+            }
+        }
+    }
+    if (calibrationsRunning == 0) {
+        eventLog.log(LOG_TIMING_REJECTED, DIAGNOSTICS_TIMING_CALIBRATE);
+    }
+}
+
+/**
+ * @brief Takes timing profile writes, saves calibration results (without
+ * selecting them) and keeps the timing attributes up to date.
+ * @return NO_DEADLINE, writes and results wake the loop.
+ */
+uint32_t handleTiming() {
+    portENTER_CRITICAL(&timingLock);
+    bool requested = timingRequested;
+    uint8_t request = timingRequest;
+    uint8_t ended = calibrationsEnded;
+    uint8_t succeeded = calibrationsSucceeded;
+    timingRequested = false;
+    calibrationsEnded = 0;
+    calibrationsSucceeded = 0;
+    portEXIT_CRITICAL(&timingLock);
+
+    if (requested) {
+        if (request == DIAGNOSTICS_TIMING_CALIBRATE) {
+            startCalibration();
+        } else if (request < TIMING_PROFILES && calibrationsRunning == 0 && timingStore.setProfile((TimingProfile)request)) {
+            applyTimingProfile();
+            eventLog.log(LOG_TIMING_PROFILE, request);
         } else {
-            Serial.printf("Successfully started zone %d\n", zoneNumber);
-            // Start the software safety timer to keep Zigbee state in sync.
-            zoneSafetyOffTime[index] = millis() + (SAFETY_TIMEOUT_MINUTES * 60 * 1000UL);
+            eventLog.log(LOG_TIMING_REJECTED, request);
+        }
+        // The attribute holds whatever was written
+        timingPublished = false;
+    }
+
+    if (ended != 0) {
+        for (uint8_t b = 0; b < NUM_BUSES; b++) {
+            if (succeeded >> b & 1) {
+                HunterTiming timing = buses[b]->calibrationResult();
+                timingStore.saveCalibration(b, timing);
+                eventLog.log(LOG_CALIBRATED, timing.resetHighUs / 1000, b, timing.resetLowUs / 1000);
+            }
         }
+        calibrationsRunning &= ~ended;
+        timingPublished = false;
+    }
+
+    if (!timingPublished && Zigbee.started()) {
+        HunterTiming timing = buses[0]->timing();
+        stallMonitor.busy(reportWatch, REPORT_TIMING);
+        diagnostics->publishTiming(timingStore.profile(), timing.resetHighUs, timing.resetLowUs);
+        stallMonitor.idle(reportWatch);
+        timingPublished = true;
+    }
+    return NO_DEADLINE;
+}
+
+/**
+ * @brief Bus task callback, runs once a command's frame has been sent (or has failed).
+ * Updates the safety timer and pushes the resulting state back to the endpoint.
+ * @param arg index of the bus the command was sent on.
+ */
+void onBusResult(const BusCommand &command, HunterError err, void *arg) {
+    if (command.action == BUS_CALIBRATE) {
+        onCalibrationResult(err, (uint8_t)(uintptr_t)arg);
+        return;
+    }
+    latencyStats.record(command.timing);
+    recordFirstCommand(command.timing.doneUs);
+    if (err != HunterError::None) {
+        lastBusError = (uint8_t)err;
+    }
+    if (command.retries > 0) {
+        eventLog.log(LOG_FRAME_RESENT, command.target, (uint32_t)(uintptr_t)arg, command.retries);
+    }
+
+    if (command.action == BUS_START_PROGRAM) {
+        onProgramResult(command, err, (uint8_t)(uintptr_t)arg);
+        return;
+    }
+    uint8_t index = zoneIndexFor((uint8_t)(uintptr_t)arg, command.target);
+    if (index >= NUM_ZONES) {
+        return;
+    }
+
+    allOffHandled(index, command.timing.queuedUs);
+
+    bool starting = command.action == BUS_START_ZONE;
+    if (err != HunterError::None) {
+        eventLog.log(starting ? LOG_ZONE_START_FAILED : LOG_ZONE_STOP_FAILED, index + 1, (uint32_t)err);
+        // The valve may or may not have switched; a reset must stop it to be sure.
+        zoneStore.setRunning(index, true);
+        // A zone whose stop failed is cut short by the next start anyway
+        zoneQueue.release(index);
+    } else if (starting) {
+        eventLog.log(LOG_ZONE_STARTED, index + 1);
+        zoneStore.setRunning(index, true);
+        zoneMeter.started(index, command.timed);
+        // Start the software safety timer to keep Zigbee state in sync. It runs
+        // as long as the controller was told to, so both end the run together.
+        portENTER_CRITICAL(&safetyLock);
+        timedRuns = command.timed ? (timedRuns | 1ULL << index) : (timedRuns & ~(1ULL << index));
+        endingRuns &= ~(1ULL << index);
+        portEXIT_CRITICAL(&safetyLock);
+        safetyTimers.armIn(index, command.minutes * 60 * 1000000LL);
     } else {
-        Serial.printf("Received OFF request for zone %d (%s)\n", zoneNumber, zones[index].modelName);
-        byte err = hunter.stopZone(zoneNumber);
+        eventLog.log(LOG_ZONE_STOPPED, index + 1);
+        zoneStore.setRunning(index, false);
+        zoneMeter.stopped(index);
+        zoneQueue.release(index);
+        // Clear the software safety timer as HA/coordinator has shut the zone off normally.
+        portENTER_CRITICAL(&safetyLock);
+        timedRuns &= ~(1ULL << index);
+        endingRuns &= ~(1ULL << index);
+        portEXIT_CRITICAL(&safetyLock);
+        safetyTimers.cancel(index);
+    }
+    notifyLoop(EVENT_ZONES);
+
+    // Report the state the valve is actually in; a no-op unless the command failed.
+    reportZone(index);
+}
+
+/********************* Skip Rules *****************************/
+// Conditions under which the sequence leaves out the rest of a run, checked right
+// before each step starts, so a cycle is skipped without a live coordinator.
+static SkipRules skipRules;
+// Until the coordinator writes its own: the Home Assistant automation's rain check, and the sensor
+static const uint8_t defaultSkipRules[] = {
+    SKIP_RULES_VERSION, 2,
+    SKIP_INPUT_RAIN_CHANCE, SKIP_ABOVE, 60,
+    SKIP_INPUT_RAIN_SENSOR, SKIP_EQUAL, 1
+};
+static portMUX_TYPE skipRequestLock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t pendingSkipRules[SKIP_RULES_MAX_BYTES];
+static size_t pendingSkipRulesLength = 0;
+static bool skipRulesPending = false;
+static bool rainChancePending = false;
+static uint8_t pendingRainChance = SEQUENCER_INPUT_UNKNOWN;
+
+void onSkipRulesWrite(const uint8_t *data, size_t length) {
+    portENTER_CRITICAL(&skipRequestLock);
+    // An oversized write keeps its real length, so it is rejected rather than cut short
+    pendingSkipRulesLength = length;
+    memcpy(pendingSkipRules, data, min(length, sizeof(pendingSkipRules)));
+    skipRulesPending = true;
+    portEXIT_CRITICAL(&skipRequestLock);
+    notifyLoop(EVENT_SKIP_INPUT);
+}
+
+void onSkipInputWrite(SkipInput input, uint8_t value) {
+    if (input != SKIP_INPUT_RAIN_CHANCE) {
+        return; // the rain sensor is read locally
+    }
+    portENTER_CRITICAL(&skipRequestLock);
+    pendingRainChance = value;
+    rainChancePending = true;
+    portEXIT_CRITICAL(&skipRequestLock);
+    notifyLoop(EVENT_SKIP_INPUT);
+}
 
-        if (err != 0) {
-            Serial.printf("ERROR stopping zone %d: %s\n",
-                          zoneNumber, hunter.errorHint(err).c_str());
+void IRAM_ATTR onRainSensorInterrupt() {
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(loopTaskHandle, EVENT_SKIP_INPUT, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief Hands a change of the rain sensor to the skip rules. Also called before
+ * each step, an edge during light sleep may have gone unnoticed.
+ */
+void sampleRainSensor() {
+#if RAIN_SENSOR_PIN >= 0
+    static int8_t lastWet = -1;
+    bool wet = digitalRead(RAIN_SENSOR_PIN) == RAIN_SENSOR_WET;
+    if (wet != lastWet) {
+        lastWet = wet;
+        skipRules.set(SKIP_INPUT_RAIN_SENSOR, wet, esp_timer_get_time());
+        eventLog.log(LOG_RAIN_SENSOR, wet);
+    }
+#endif
+}
+
+/**
+ * @brief Restores the skip rules (or the defaults) and starts watching the rain sensor.
+ */
+void setupSkipRules() {
+    if (!skipRules.restore()) {
+        skipRules.load(defaultSkipRules, sizeof(defaultSkipRules));
+    }
+#if RAIN_SENSOR_PIN >= 0
+    pinMode(RAIN_SENSOR_PIN, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(RAIN_SENSOR_PIN), onRainSensorInterrupt, CHANGE);
+    sampleRainSensor();
+#endif
+}
+
+/**
+ * @brief Publishes the skip rules in use on the sequencer endpoint.
+ */
+void publishSkipRules() {
+    uint8_t rules[SKIP_RULES_MAX_BYTES];
+    size_t length = skipRules.encode(rules, sizeof(rules));
+    sequencer->setSkipRules(rules, length);
+}
+
+/**
+ * @brief Applies skip rule and rain chance writes, follows the rain sensor and
+ * keeps the inputs and the rule that holds up to date on the sequencer endpoint.
+ * @return milliseconds until the rain chance expires, or NO_DEADLINE.
+ */
+uint32_t handleSkipRules() {
+    static bool published = false;
+    static uint8_t publishedChance = SEQUENCER_INPUT_UNKNOWN;
+    static uint8_t publishedSensor = SEQUENCER_INPUT_UNKNOWN;
+    static uint8_t publishedRule = 0;
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&skipRequestLock);
+    bool loadRules = skipRulesPending;
+    bool chanceWritten = rainChancePending;
+    uint8_t chance = pendingRainChance;
+    uint8_t rules[SKIP_RULES_MAX_BYTES];
+    size_t length = pendingSkipRulesLength;
+    memcpy(rules, pendingSkipRules, sizeof(rules));
+    skipRulesPending = false;
+    rainChancePending = false;
+    portEXIT_CRITICAL(&skipRequestLock);
+
+    if (loadRules) {
+        if (length <= sizeof(rules) && skipRules.load(rules, length)) {
+            skipRules.save();
+            eventLog.log(LOG_SKIP_RULES_LOADED, skipRules.ruleCount());
         } else {
-            Serial.printf("Successfully stopped zone %d\n", zoneNumber);
-            // Clear the software safety timer as HA/coordinator has shut the zone off normally.
-            zoneSafetyOffTime[index] = 0;
+            eventLog.log(LOG_SKIP_RULES_REJECTED, length);
         }
+        publishSkipRules();
+    }
+    if (chanceWritten) {
+        // Anything above 100 % is as good as no forecast
+        if (chance <= 100) {
+            skipRules.set(SKIP_INPUT_RAIN_CHANCE, chance, now, RAIN_CHANCE_VALID_MS);
+        } else {
+            skipRules.clear(SKIP_INPUT_RAIN_CHANCE);
+            chance = SEQUENCER_INPUT_UNKNOWN;
+        }
+        eventLog.log(LOG_RAIN_CHANCE, chance);
+        // The attribute holds whatever was written
+        published = false;
+    }
+    sampleRainSensor();
+
+    skipRules.skipping(now);
+    uint8_t rainChance = SEQUENCER_INPUT_UNKNOWN;
+    uint8_t rainSensor = SEQUENCER_INPUT_UNKNOWN;
+    skipRules.value(SKIP_INPUT_RAIN_CHANCE, rainChance);
+    skipRules.value(SKIP_INPUT_RAIN_SENSOR, rainSensor);
+    uint8_t rule = skipRules.matchingRule() + 1;
+    if ((!published || rainChance != publishedChance || rainSensor != publishedSensor || rule != publishedRule)
+            && Zigbee.started()) {
+        sequencer->setSkipState(rainChance, rainSensor, rule);
+        publishedChance = rainChance;
+        publishedSensor = rainSensor;
+        publishedRule = rule;
+        published = true;
+    }
+    return skipRules.msUntilExpiry(now);
+}
+
+/********************* Sequencer ******************************/
+// Writes from the coordinator arrive on the Zigbee task and are handed to the main loop.
+static portMUX_TYPE sequenceRequestLock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t pendingProgram[SEQUENCE_MAX_BYTES];
+static size_t pendingProgramLength = 0;
+static bool programPending = false;
+static bool controlPending = false;
+static uint8_t pendingControl = SEQUENCER_CONTROL_STOP;
+
+void onSequenceProgram(const uint8_t *data, size_t length) {
+    portENTER_CRITICAL(&sequenceRequestLock);
+    // An oversized program keeps its real length, so it is rejected rather than cut short
+    pendingProgramLength = length;
+    memcpy(pendingProgram, data, min(length, sizeof(pendingProgram)));
+    programPending = true;
+    portEXIT_CRITICAL(&sequenceRequestLock);
+    notifyLoop(EVENT_SEQUENCE);
+}
+
+void onSequenceControl(uint8_t command) {
+    portENTER_CRITICAL(&sequenceRequestLock);
+    pendingControl = command;
+    controlPending = true;
+    portEXIT_CRITICAL(&sequenceRequestLock);
+    notifyLoop(EVENT_SEQUENCE);
+}
+
+/**
+ * @brief Turns a sequence step's zone on and times the step, unless a skip rule
+ * holds: the run then ends here.
+ * The zone goes through its endpoint, exactly as if the coordinator had switched it.
+ */
+void startSequenceStep(const SequenceStep &step) {
+    // Checked before every step, not only at the start, so rain mid-cycle leaves out the rest
+    sampleRainSensor();
+    if (skipRules.skipping(esp_timer_get_time())) {
+        SequenceStep skipped;
+        eventLog.log(LOG_SEQUENCE_SKIPPED, sequence.stepNumber(), skipRules.matchingRule() + 1);
+        sequence.skip(skipped);
+        return;
+    }
+    eventLog.log(LOG_SEQUENCE_STEP, sequence.stepNumber(), step.zone, step.minutes);
+    // Timed run: the controller ends the step itself, the stop at the end of the
+    // step is then skipped by the bus.
+    valves[step.zone - 1]->setRunMinutes(step.minutes);
+    valves[step.zone - 1]->setLight(true);
+    scheduleTimers.armIn(SCHEDULE_SEQUENCE_STEP, step.minutes * 60 * 1000000LL);
+}
+
+/**
+ * @brief Publishes the program in use on the sequencer endpoint.
+ */
+void publishSequenceProgram() {
+    uint8_t program[SEQUENCE_MAX_BYTES];
+    size_t length = sequence.encode(program, sizeof(program));
+    sequencer->setProgram(program, length);
+}
+
+/**
+ * @brief Applies program/control writes and moves the sequence on when a step is over.
+ * @return milliseconds until the running step ends, or NO_DEADLINE.
+ */
+uint32_t handleSequence() {
+    SequenceState lastState = sequence.state();
+    uint8_t lastStep = sequence.stepNumber();
+    SequenceStep step;
+
+    portENTER_CRITICAL(&sequenceRequestLock);
+    bool loadProgram = programPending;
+    bool control = controlPending;
+    uint8_t command = pendingControl;
+    uint8_t program[SEQUENCE_MAX_BYTES];
+    size_t length = pendingProgramLength;
+    memcpy(program, pendingProgram, sizeof(program));
+    programPending = false;
+    controlPending = false;
+    portEXIT_CRITICAL(&sequenceRequestLock);
+
+    if (loadProgram) {
+        if (length <= sizeof(program) && sequence.load(program, length)) {
+            sequence.save();
+            eventLog.log(LOG_SEQUENCE_LOADED, sequence.stepCount());
+        } else {
+            eventLog.log(LOG_SEQUENCE_REJECTED, length);
+        }
+        publishSequenceProgram();
+    }
+
+    if (control && command == SEQUENCER_CONTROL_START && sequence.start(step)) {
+        startSequenceStep(step);
+    } else if (control && command == SEQUENCER_CONTROL_STOP && sequence.abort(step)) {
+        eventLog.log(LOG_SEQUENCE_ABORTED, lastStep);
+        scheduleTimers.cancel(SCHEDULE_SEQUENCE_STEP);
+        valves[step.zone - 1]->setLight(false);
+    }
+
+    if (scheduleTimers.takeExpired(SCHEDULE_SEQUENCE_STEP, esp_timer_get_time()) && sequence.current(step)) {
+        // Queued before the next start, so on a shared bus the stop frame goes out first.
+        valves[step.zone - 1]->setLight(false);
+        if (sequence.advance(step)) {
+            startSequenceStep(step);
+        } else {
+            eventLog.log(LOG_SEQUENCE_DONE);
+        }
+    }
+
+    if (sequence.state() != lastState || sequence.stepNumber() != lastStep) {
+        sequencer->setProgress(sequence.state(), sequence.stepNumber());
+    }
+    return scheduleTimers.msUntilNext();
+}
+
+/********************* Firmware Update ************************/
+// Images come from the coordinator's OTA server and are written block by block to
+// the inactive ota_0/ota_1 slot by the Zigbee library, which boots into it once complete.
+// The new image runs on trial: unless it joins the network in time the bootloader
+// goes back to the previous one.
+static bool firmwareOnTrial = false;
+
+/**
+ * @brief Arduino hook: the running image is confirmed by handleFirmwareUpdate,
+ * not as soon as it boots.
+ */
+bool verifyRollbackLater() {
+    return true;
+}
+
+/**
+ * @brief Notes whether this boot is the first of a freshly downloaded image.
+ */
+void setupFirmwareUpdate() {
+#if CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK
+            && state == ESP_OTA_IMG_PENDING_VERIFY) {
+        firmwareOnTrial = true;
+        eventLog.log(LOG_OTA_TRIAL, 0, FIRMWARE_VERSION);
     }
+#endif
 }
 
-/********************* Zigbee Callbacks ***********************/
-#define MAKE_ZONE_CALLBACK(N) \
-void onZone##N(bool state){ handleZoneChange(N, state); }
+/**
+ * @brief Confirms an image on trial once the network is joined, rolls it back
+ * if that takes too long, and starts the periodic OTA queries.
+ * @return milliseconds until the trial runs out, or NO_DEADLINE.
+ */
+uint32_t handleFirmwareUpdate() {
+    static bool querying = false;
+
+    if (firmwareOnTrial) {
+        if (Zigbee.connected()) {
+            esp_ota_mark_app_valid_cancel_rollback();
+            firmwareOnTrial = false;
+            eventLog.log(LOG_OTA_CONFIRMED, 0, FIRMWARE_VERSION);
+        } else if (millis() >= OTA_VERIFY_TIMEOUT_MS) {
+            eventLog.log(LOG_OTA_ROLLBACK, 0, FIRMWARE_VERSION);
+            // The previous image stops whatever is running from the saved state
+            zoneStore.commit(true);
+            zoneMeter.commit(true);
+            eventLog.flush(1000);
+            esp_ota_mark_app_invalid_rollback_and_reboot();
+            return NO_DEADLINE;
+        } else {
+            return OTA_VERIFY_TIMEOUT_MS - millis();
+        }
+    }
 
-// Generate onZone0, onZone1, onZone2, onZone3
-MAKE_ZONE_CALLBACK(0)
-MAKE_ZONE_CALLBACK(1)
-MAKE_ZONE_CALLBACK(2)
-MAKE_ZONE_CALLBACK(3)
+    if (!querying && Zigbee.connected()) {
+        uint16_t blockPeriodMs = OTA_BLOCK_PERIOD_MS;
+        esp_zb_lock_acquire(portMAX_DELAY);
+        esp_zb_zcl_set_attribute_val(DIAGNOSTICS_ENDPOINT, ESP_ZB_ZCL_CLUSTER_ID_OTA_UPGRADE, ESP_ZB_ZCL_CLUSTER_CLIENT_ROLE,
+            ESP_ZB_ZCL_ATTR_OTA_UPGRADE_MIN_BLOCK_REQUE_ID, &blockPeriodMs, false);
+        esp_zb_lock_release();
+        // The first query goes out within a minute, then one every hour
+        diagnostics->requestOTAUpdate();
+        querying = true;
+    }
+    return NO_DEADLINE;
+}
 
 /********************* Helper Functions for Main Loop *********/
 
 /**
- * @brief On first connect after boot, turns all valves off as a safety measure.
+ * @brief Marks the zones saved as stopped before the reset as such on their bus,
+ * so the shutdown on first connect only reports them instead of sending frames.
+ * Call after creating the buses and before starting them.
+ */
+void applySavedZoneStates() {
+    for (uint8_t i = 0; i < NUM_ZONES; i++) {
+        if (!zoneStore.wasRunning(i)) {
+            buses[zones[i].bus]->assumeStopped(zones[i].busZone);
+        }
+    }
+}
+
+/**
+ * @brief Stops the zones that were running before the reset, without waiting for Zigbee.
+ * Call as soon as the buses run; the endpoints are updated once the stack is up.
+ */
+void stopZonesRunningBeforeReset() {
+    if (!zoneStore.restored()) {
+        // First boot or unreadable NVS: any valve may be on
+        eventLog.log(LOG_RESTORE_NONE);
+        for (uint8_t b = 0; b < NUM_BUSES; b++) {
+            buses[b]->stopAll(busZoneCounts[b]);
+        }
+        return;
+    }
+    for (uint8_t i = 0; i < NUM_ZONES; i++) {
+        if (zoneStore.wasRunning(i)) {
+            eventLog.log(LOG_RESTORE_STOP, i + 1);
+            buses[zones[i].bus]->stopZone(zones[i].busZone);
+        }
+    }
+}
+
+/**
+ * @brief On first connect after boot, reports every valve as off. The stops went
+ * out at boot, so only a zone whose stop failed still costs a frame here.
  */
 void handleInitialShutdown() {
     static bool initialShutdownComplete = false;
     if (Zigbee.connected() && !initialShutdownComplete) {
-        Serial.println("First connect: Setting all zones to OFF as a safety measure.");
+        eventLog.log(LOG_INITIAL_SHUTDOWN);
+        for (uint8_t b = 0; b < NUM_BUSES; b++) {
+            buses[b]->stopAll(busZoneCounts[b]);
+        }
+        // The coordinator may still show a zone on from before the reset
         for (uint8_t i = 0; i < NUM_ZONES; i++) {
-            valves[i]->setLight(false);
+            reportZone(i, true);
         }
+        publishSequenceProgram();
+        publishSkipRules();
+        sequencer->setProgress(sequence.state(), sequence.stepNumber());
         initialShutdownComplete = true;
     }
 }
 
 /**
- * @brief Checks if any zone is currently running by checking the safety timer array.
+ * @brief Checks if any zone is currently running by checking the safety timers.
  * @return true if at least one zone is active, false otherwise.
  */
 bool isAnyZoneActive() {
-    for (uint8_t i = 0; i < NUM_ZONES; i++) {
-        // A non-zero value means the timer is set, so the zone is running.
-        if (zoneSafetyOffTime[i] != 0) {
-            return true;
-        }
-    }
-    return false;
+    // An armed timer means the zone is running.
+    return safetyTimers.count() > 0;
 }
 
 /**
@@ -117,43 +1500,51 @@ bool isAnyZoneActive() {
  * - Blinking: Disconnected from Zigbee network.
  * - Solid OFF: Connected to Zigbee, but no zones are running.
  * - Solid ON: Connected to Zigbee and at least one zone is running.
+ * @return milliseconds until the LED needs to be updated again, or NO_DEADLINE.
  */
-void handleLedIndicator() {
-    static LedState currentLedState = UNKNOWN;
+uint32_t handleLedIndicator() {
     static unsigned long ledTimer = 0;
 
     if (Zigbee.connected()) {
         if (isAnyZoneActive()) {
             // A zone is active, LED should be solid ON
-            if (currentLedState != ZONE_ACTIVE) {
+            if (ledState != ZONE_ACTIVE) {
                 digitalWrite(LED_PIN, LED_ON);
-                currentLedState = ZONE_ACTIVE;
+                ledState = ZONE_ACTIVE;
             }
         } else {
             // Connected but idle, LED should be OFF
-            if (currentLedState != CONNECTED_IDLE) {
+            if (ledState != CONNECTED_IDLE) {
                 digitalWrite(LED_PIN, LED_OFF);
-                currentLedState = CONNECTED_IDLE;
+                ledState = CONNECTED_IDLE;
             }
         }
-    } else {
-        // Not connected, LED should blink
-        if (currentLedState != BLINKING) {
-            // Transitioning to blinking state, ensures the timer is reset.
-            currentLedState = BLINKING;
-        }
+        return NO_DEADLINE;
+    }
 
-        if (millis() - ledTimer > 500) {
-            digitalWrite(LED_PIN, !digitalRead(LED_PIN));
-            ledTimer = millis();
+    // Not connected, LED should blink
+    if (ledState != BLINKING) {
+        // Transitioning to blinking state, ensures the timer is reset.
+        if (ledState != UNKNOWN) {
+            networkLosses++;
         }
+        ledState = BLINKING;
+    }
+
+    unsigned long elapsed = millis() - ledTimer;
+    if (elapsed >= LED_BLINK_MS) {
+        digitalWrite(LED_PIN, !digitalRead(LED_PIN));
+        ledTimer = millis();
+        return LED_BLINK_MS;
     }
+    return LED_BLINK_MS - elapsed;
 }
 
 /**
  * @brief Handles the non-blocking check for the factory reset button.
+ * @return milliseconds until the hold time is reached while the button is held, or NO_DEADLINE.
  */
-void handleFactoryResetButton() {
+uint32_t handleFactoryResetButton() {
     static unsigned long buttonPressStartTime = 0;
     static bool isButtonBeingHeld = false;
 
@@ -161,44 +1552,554 @@ void handleFactoryResetButton() {
         if (!isButtonBeingHeld) {
             isButtonBeingHeld = true;
             buttonPressStartTime = millis();
-            Serial.println("Button pressed. Hold for 5 seconds for factory reset.");
-        } else if (millis() - buttonPressStartTime > 5000) {
-            Serial.println("Factory reset triggered. Rebooting...");
-            Zigbee.factoryReset();
+            eventLog.log(LOG_BUTTON_PRESSED);
         }
-    } else {
-        if (isButtonBeingHeld) {
-            Serial.println("Button released.");
-            isButtonBeingHeld = false;
+        unsigned long held = millis() - buttonPressStartTime;
+        if (held >= FACTORY_RESET_HOLD_MS && !Zigbee.started()) {
+            // The stack is still starting in the background; reset once it is up
+            return ZIGBEE_CHECK_MS;
+        }
+        if (held >= FACTORY_RESET_HOLD_MS) {
+            eventLog.log(LOG_FACTORY_RESET);
+            eventLog.flush(1000); // Keep the record across the reboot
+            Zigbee.factoryReset();
+            return NO_DEADLINE;
         }
+        return FACTORY_RESET_HOLD_MS - held;
     }
+
+    if (isButtonBeingHeld) {
+        eventLog.log(LOG_BUTTON_RELEASED);
+        isButtonBeingHeld = false;
+    }
+    return NO_DEADLINE;
 }
 
 /**
  * @brief Checks if any zone's safety timer has expired and updates Zigbee state if so.
+ * A timed run at its end gets a normal stop; an untimed run at the safety timeout, or a
+ * timed run still on SAFETY_OVERRUN_MS later, gets an emergency stop and counts as a trip.
+ * @return milliseconds until the next safety timer expires, or NO_DEADLINE.
  */
-void handleSafetyTimeout() {
+uint32_t handleSafetyTimeout() {
+    uint8_t i;
+
+    // Only expired timers are visited; the heap keeps the earliest one on top.
+    while (safetyTimers.popExpired(esp_timer_get_time(), i)) {
+        uint64_t bit = 1ULL << i;
+        portENTER_CRITICAL(&safetyLock);
+        bool ended = timedRuns & bit;
+        bool overrun = endingRuns & bit;
+        timedRuns &= ~bit;
+        if (ended) {
+            endingRuns |= bit;
+        }
+        portEXIT_CRITICAL(&safetyLock);
+
+        if (ended) {
+            // The controller has ended the run by itself. A normal stop brings the
+            // endpoint in line; the bus answers it without a frame while it knows
+            // the run is over. Should it not go through, the timer fires again as an overrun.
+            safetyTimers.armIn(i, SAFETY_OVERRUN_MS * 1000LL);
+            buses[zones[i].bus]->stopZone(zones[i].busZone);
+            continue;
+        }
+
+        // An untimed run at the safety timeout, or a timed run that did not end
+        eventLog.log(LOG_SAFETY_EXPIRED, i + 1);
+        // Counted once per run, as in the zone's metering cluster
+        if (zoneMeter.tripped(i, overrun)) {
+            safetyTripsSinceBoot++;
+        }
+        // Do NOT leave the timer disarmed. If the stop command fails, we want it
+        // to fire again to re-attempt the shutdown. Push it out so the queued
+        // stop has time to go out instead of being re-queued every loop.
+        safetyTimers.armIn(i, SAFETY_RETRY_MS * 1000LL);
+        // Jump the queue, even ahead of a frame already on the bus. The endpoint
+        // is reported off with the result, like any other stop.
+        buses[zones[i].bus]->stopZone(zones[i].busZone, 0, true);
+    }
+    return safetyTimers.msUntilNext();
+}
+
+/**
+ * @brief Brings every marked zone endpoint in line with the valve and publishes
+ * the bitmap of running zones, under one pass of the loop task.
+ */
+void flushZoneReports() {
+    portENTER_CRITICAL(&zoneReportLock);
+    uint64_t dirty = zoneReportsDirty;
+    uint64_t forced = zoneReportsForced;
+    zoneReportsDirty = 0;
+    zoneReportsForced = 0;
+    zoneReportsDueUs = 0;
+    portEXIT_CRITICAL(&zoneReportLock);
+
+    if (dirty == 0) {
+        return;
+    }
+    uint64_t running = 0;
+    stallMonitor.busy(reportWatch, REPORT_ZONES);
+    reportingZones = true;
     for (uint8_t i = 0; i < NUM_ZONES; i++) {
-        // Check if a timer is active for this zone and if its time has come.
-        // millis() >= ... is a rollover-safe way to check.
-        if (zoneSafetyOffTime[i] != 0 && millis() >= zoneSafetyOffTime[i]) {
-            Serial.printf("Safety timer expired for zone %d. Updating Zigbee state to OFF.\n", i + 1);
-            valves[i]->setLight(false); // This will trigger the callback and sync everything.
-            // Do NOT clear the timer here. If the stop command fails,
-            // we want this check to run again on the next loop to re-attempt the shutdown.
+        bool on = safetyTimers.isArmed(i);
+        if (on) {
+            running |= 1ULL << i;
+        }
+        // A waiting start keeps its endpoint ON
+        on |= zoneQueue.waiting(i);
+        if ((dirty >> i & 1) && (valves[i]->getLightState() != on || (forced >> i & 1))) {
+            valves[i]->setLight(on);
+        }
+    }
+    reportingZones = false;
+    diagnostics->publishRunningZones(running);
+    stallMonitor.idle(reportWatch);
+}
+
+/**
+ * @brief Sends the zone reports once their window is over. While an all-off is
+ * in progress they are held until its last stop, so it ends in one snapshot.
+ * @return milliseconds until the reports are due, or NO_DEADLINE.
+ */
+uint32_t handleZoneReports() {
+    portENTER_CRITICAL(&zoneReportLock);
+    int64_t dueUs = zoneReportsDueUs;
+    portEXIT_CRITICAL(&zoneReportLock);
+
+    // Endpoints cannot be written before the stack is up; the periodic Zigbee check retries.
+    if (dueUs == 0 || isAllOffPending() || !Zigbee.started()) {
+        return NO_DEADLINE;
+    }
+    int64_t now = esp_timer_get_time();
+    if (now < dueUs) {
+        return (dueUs - now + 999) / 1000;
+    }
+    flushZoneReports();
+    return NO_DEADLINE;
+}
+
+/**
+ * @brief Notes when the network is first joined and publishes the startup
+ * milestones, again if the first frame goes out only later.
+ * @return NO_DEADLINE, the periodic Zigbee check notices the connection.
+ */
+uint32_t handleStartupMetrics() {
+    static int64_t publishedFirstCommandUs = -1;
+
+    if (!Zigbee.connected()) {
+        return NO_DEADLINE;
+    }
+    if (joinedUs == 0) {
+        joinedUs = esp_timer_get_time();
+        eventLog.log(LOG_ZIGBEE_JOINED, 0, joinedUs / 1000);
+    }
+
+    portENTER_CRITICAL(&firstCommandLock);
+    int64_t firstUs = firstCommandUs;
+    portEXIT_CRITICAL(&firstCommandLock);
+    if (firstUs != publishedFirstCommandUs) {
+        stallMonitor.busy(reportWatch, REPORT_BOOT_TIMES);
+        diagnostics->publishBootTimes(busReadyUs / 1000, firstUs / 1000, joinedUs / 1000);
+        stallMonitor.idle(reportWatch);
+        publishedFirstCommandUs = firstUs;
+    }
+    return NO_DEADLINE;
+}
+
+/**
+ * @brief Writes the zone states to NVS once their batching delay has passed.
+ * @return milliseconds until the next write is due, or NO_DEADLINE.
+ */
+uint32_t handleZoneStore() {
+    return zoneStore.commit();
+}
+
+/**
+ * @brief Writes the zone counters to NVS once their batching delay has passed,
+ * and copies changed ones (and the run time of running zones, every
+ * ZONE_METER_PUBLISH_MS) to the metering clusters. Reporting them is left
+ * to the stack's reporting thresholds.
+ * @return milliseconds until the next write or refresh is due, or NO_DEADLINE.
+ */
+uint32_t handleZoneMeter() {
+    static bool reportingSet = false;
+    static int64_t refreshedUs = 0;
+
+    uint32_t nextWakeMs = zoneMeter.commit();
+    if (!Zigbee.started()) {
+        return nextWakeMs;
+    }
+    if (!reportingSet) {
+        for (uint8_t i = 0; i < NUM_ZONES; i++) {
+            valves[i]->setUsageReporting(10, 3600, ZONE_METER_REPORT_S);
+        }
+        reportingSet = true;
+    }
+
+    uint64_t publish = zoneMeter.takeChanged();
+    uint64_t running = zoneMeter.running();
+    int64_t now = esp_timer_get_time();
+    if (running != 0 && now - refreshedUs >= ZONE_METER_PUBLISH_MS * 1000LL) {
+        publish |= running;
+        refreshedUs = now;
+    }
+    if (publish != 0) {
+        stallMonitor.busy(reportWatch, REPORT_USAGE);
+        for (uint8_t i = 0; i < NUM_ZONES; i++) {
+            ZoneUsage usage;
+            if ((publish >> i & 1) && zoneMeter.usage(i, usage)) {
+                valves[i]->publishUsage(usage);
+            }
+        }
+        diagnostics->publishOperatingSeconds(zoneMeter.now());
+        stallMonitor.idle(reportWatch);
+    }
+    if (running != 0) {
+        nextWakeMs = min(nextWakeMs, (uint32_t)((refreshedUs + ZONE_METER_PUBLISH_MS * 1000LL - now + 999) / 1000));
+    }
+    return nextWakeMs;
+}
+
+/**
+ * @brief Copies the latency histograms to the diagnostics endpoint when commands
+ * have been handled since the last update, at most every DIAGNOSTICS_PUBLISH_MS.
+ * @return milliseconds until the next update is allowed, or NO_DEADLINE while nothing changed.
+ */
+uint32_t handleDiagnostics() {
+    static uint32_t publishedSamples = 0;
+    static unsigned long lastPublish = 0;
+
+    uint32_t samples = latencyStats.samples();
+    if (samples == publishedSamples || !Zigbee.connected()) {
+        return NO_DEADLINE;
+    }
+    unsigned long elapsed = millis() - lastPublish;
+    if (lastPublish != 0 && elapsed < DIAGNOSTICS_PUBLISH_MS) {
+        return DIAGNOSTICS_PUBLISH_MS - elapsed;
+    }
+    stallMonitor.busy(reportWatch, REPORT_LATENCY);
+    diagnostics->publishLatency(latencyStats);
+    stallMonitor.idle(reportWatch);
+    publishedSamples = samples;
+    lastPublish = millis();
+    return NO_DEADLINE;
+}
+
+/**
+ * @brief Refreshes the status struct on the diagnostics endpoint. The stack answers
+ * reads from its own copy without calling back, so an unread struct only costs one
+ * attribute write per DIAGNOSTICS_STATUS_MS; the counters behind it are plain increments.
+ * @return milliseconds until the next refresh, or NO_DEADLINE before the stack runs.
+ */
+uint32_t handleDiagnosticsStatus() {
+    static int64_t lastUs = 0;
+    static uint32_t lastWakes = 0;
+
+    if (!Zigbee.started()) {
+        return NO_DEADLINE;
+    }
+    int64_t now = esp_timer_get_time();
+    int64_t elapsedUs = now - lastUs;
+    if (lastUs != 0 && elapsedUs < DIAGNOSTICS_STATUS_MS * 1000LL) {
+        return (DIAGNOSTICS_STATUS_MS * 1000LL - elapsedUs + 999) / 1000;
+    }
+
+    DiagnosticsStatus status = {};
+    status.version = DIAGNOSTICS_STATUS_VERSION;
+    status.ledState = ledState;
+    status.resetReason = esp_reset_reason();
+    status.lastError = lastBusError;
+    status.uptimeS = now / 1000000;
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        BusStats stats;
+        buses[b]->stats(stats);
+        status.framesSent += stats.frames;
+        status.bytesSent += stats.bytes;
+        status.framesResent += stats.resent;
+        status.commandsFailed += stats.failed;
+        status.queueHighWater = max(status.queueHighWater, stats.pendingHighWater);
+    }
+    status.heapFree = ESP.getFreeHeap();
+    status.heapMinFree = ESP.getMinFreeHeap();
+    if (lastUs != 0) {
+        int64_t perMin = (int64_t)(loopWakes - lastWakes) * 60000000 / elapsedUs;
+        status.loopWakesPerMin = perMin > UINT16_MAX ? UINT16_MAX : perMin;
+    }
+    status.safetyTrips = safetyTripsSinceBoot;
+    status.networkLosses = networkLosses;
+    status.zonesWaiting = zoneQueue.waitingCount();
+    ZigbeeDiagnostics::parentLink(status.parentRssi, status.parentLqi);
+
+    stallMonitor.busy(reportWatch, REPORT_STATUS);
+    diagnostics->publishStatus(status);
+    stallMonitor.idle(reportWatch);
+    lastUs = now;
+    lastWakes = loopWakes;
+    return DIAGNOSTICS_STATUS_MS;
+}
+
+/**
+ * @brief Stall monitor probe for a bus task, see BusScheduler::busySince.
+ */
+int64_t probeBus(void *arg, uint32_t &context) {
+    return ((BusScheduler *)arg)->busySince(context);
+}
+
+/**
+ * @brief Watches the loop, each bus task and the attribute writes, and logs
+ * the stall that caused the last reset, if any.
+ */
+void setupStallMonitor() {
+    loopWatch = stallMonitor.add("loop", STALL_LOOP_MS);
+    reportWatch = stallMonitor.add("zb_report", STALL_REPORT_MS);
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        char name[STALL_MONITOR_NAME];
+        snprintf(name, sizeof(name), "bus%u", b + 1);
+        stallMonitor.add(name, STALL_BUS_MS, probeBus, buses[b]);
+    }
+    stallMonitor.begin();
+
+    StallRecord stall;
+    if (stallMonitor.lastStall(stall)) {
+        eventLog.log(LOG_STALL_RESET, stall.watch, stall.stalledMs, stall.context);
+    }
+}
+
+/********************* Encoder Benchmark **********************/
+/**
+ * @brief Encodes every zone (1-48) with every run time (0-240) and prints the average
+ * cost of building the frame and its RMT symbols. Also checks every symbol train
+ * adds up to the expected frame time, so timing regressions show up as errors.
+ */
+void runEncoderBenchmark() {
+#if ENCODER_BENCHMARK
+    static rmt_symbol_word_t symbols[HUNTER_RMT_MAX_SYMBOLS];
+    uint64_t frameCycles = 0;
+    uint64_t symbolCycles = 0;
+    uint32_t frames = 0;
+    uint32_t timingErrors = 0;
+
+    for (uint8_t zone = 1; zone <= HUNTER_MAX_ZONES; zone++) {
+        for (uint16_t time = 0; time <= 240; time++) {
+            HunterFrames::ZoneFrame frame;
+            uint32_t start = ESP.getCycleCount();
+            HunterRoam::encodeZone(zone, time, frame);
+            uint32_t encoded = ESP.getCycleCount();
+            size_t count = HunterRoam::encodeSymbols(frame.data(), frame.size(), true, symbols, HUNTER_RMT_MAX_SYMBOLS);
+            uint32_t end = ESP.getCycleCount();
+            frameCycles += encoded - start;
+            symbolCycles += end - encoded;
+            frames++;
+
+            uint32_t durationUs = 0;
+            for (size_t i = 0; i < count; i++) {
+                durationUs += symbols[i].duration0 + symbols[i].duration1;
+            }
+            if (count != hunterSymbolCount(frame.size(), true) || durationUs != hunterFrameDurationUs(frame.size(), true)) {
+                timingErrors++;
+            }
+        }
+    }
+
+    Serial.printf("Encoder benchmark: %lu frames, %lu cycles/frame, %lu cycles/symbol train, %lu timing errors\n",
+                  (unsigned long)frames, (unsigned long)(frameCycles / frames),
+                  (unsigned long)(symbolCycles / frames), (unsigned long)timingErrors);
+#endif
+}
+
+/********************* Soak Test ******************************/
+#if SOAK_TEST
+// Longest time between two watchdog feeds in loop(), see recordWatchdogFeed
+static int64_t soakLastFeedUs = 0;            // loop task only
+static volatile uint32_t soakWorstFeedGapUs = 0;
+
+/**
+ * @brief Issues one random command through the callback the Zigbee stack would call.
+ * Timed runs end by themselves, so `on` drifts; an OFF for a zone that is already off
+ * is a valid command too.
+ * @param on zones this test switched on, bit = zone index
+ * @return microseconds spent in the callback
+ */
+uint32_t soakCommand(uint64_t &on) {
+    uint32_t pick = random(100);
+    int64_t start;
+
+    if (NUM_PROGRAM_SWITCHES > 0 && pick < SOAK_PROGRAM_PERCENT) {
+        uint8_t index = random(NUM_PROGRAM_SWITCHES);
+        start = esp_timer_get_time();
+        programCallbacks[index](true);
+    } else if (pick < SOAK_PROGRAM_PERCENT + SOAK_ALL_OFF_PERCENT) {
+        start = esp_timer_get_time();
+        handleAllOffChange(true);
+        on = 0;
+    } else {
+        uint8_t index = random(NUM_ZONES);
+        bool state = (on >> index & 1) == 0;
+        if (state) {
+            // As a coordinator does it: OnTime first, then ON
+            valves[index]->setRunMinutes(random(1, SOAK_RUN_MAX_MINUTES + 1));
+        }
+        start = esp_timer_get_time();
+        zones[index].onChange(state);
+        on ^= 1ULL << index;
+    }
+    return esp_timer_get_time() - start;
+}
+
+/**
+ * @brief Sends bursts of random commands until reset and logs a report every SOAK_REPORT_MS.
+ * Their latency goes into latencyStats (and to the diagnostics endpoint) like any other command's.
+ */
+void soakTask(void *) {
+    while (!Zigbee.started()) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+    vTaskDelay(pdMS_TO_TICKS(SOAK_PAUSE_MAX_MS));
+
+    uint64_t on = 0;
+    uint32_t issued = 0;
+    uint32_t worstCallbackUs = 0;
+    uint32_t reportedSamples = latencyStats.samples();
+    int64_t reportedUs = esp_timer_get_time();
+
+    for (;;) {
+        uint8_t burst = random(1, SOAK_BURST_MAX + 1);
+        for (uint8_t n = 0; n < burst; n++) {
+            uint32_t callbackUs = soakCommand(on);
+            if (callbackUs > worstCallbackUs) {
+                worstCallbackUs = callbackUs;
+            }
+            issued++;
+        }
+
+        int64_t now = esp_timer_get_time();
+        if (now - reportedUs >= SOAK_REPORT_MS * 1000LL) {
+            uint32_t samples = latencyStats.samples();
+            LatencyHistogram total;
+            latencyStats.snapshot(LATENCY_TOTAL, total);
+            eventLog.log(LOG_SOAK_THROUGHPUT, (now - reportedUs) / 1000000, issued, samples - reportedSamples);
+            eventLog.log(LOG_SOAK_LATENCY, total.maxUs / 1000, worstCallbackUs, total.percentileUs(99));
+            eventLog.log(LOG_SOAK_MARGIN, 0, ESP.getMinFreeHeap(), soakWorstFeedGapUs / 1000);
+            issued = 0;
+            reportedSamples = samples;
+            reportedUs = now;
         }
+        vTaskDelay(pdMS_TO_TICKS(random(SOAK_PAUSE_MIN_MS, SOAK_PAUSE_MAX_MS + 1)));
+    }
+}
+#endif
+
+/**
+ * @brief Keeps the longest time between two watchdog feeds, called right after each one.
+ * The soak test reports it against WDT_TIMEOUT_SECONDS.
+ */
+void recordWatchdogFeed() {
+#if SOAK_TEST
+    int64_t now = esp_timer_get_time();
+    if (soakLastFeedUs != 0 && now - soakLastFeedUs > soakWorstFeedGapUs) {
+        soakWorstFeedGapUs = now - soakLastFeedUs;
     }
+    soakLastFeedUs = now;
+#endif
+}
+
+/**
+ * @brief Starts the soak test task in SOAK_TEST builds.
+ */
+void startSoakTest() {
+#if SOAK_TEST
+    Serial.println("Soak test build: random zone commands start once Zigbee is up.");
+    if (xTaskCreate(soakTask, "soak", 4096, nullptr, SOAK_TASK_PRIORITY, nullptr) != pdPASS) {
+        Serial.println("Failed to start the soak test task.");
+    }
+#endif
 }
 
 /********************* Setup **********************************/
 void setup() {
     Serial.begin(115200);
-    delay(1000); // Add a small delay on boot for hardware to stabilize
-    
+
+    // The log task mounts the spiffs partition and prints what happened before
+    // this boot in the background; records logged meanwhile are queued.
+    eventLog.begin(LOG_PERSIST, 1, LOG_PERSIST ? &Serial : nullptr);
+
+    // Buses first: after a power blip a valve may still be on. Hand each SmartPort pin
+    // to the RMT peripheral so frames are sent in the background, and give each
+    // controller its own bus task.
+    bool storeReady = zoneStore.begin();
+    storeReady &= zoneMeter.begin(NUM_ZONES);
+    zoneQueue.begin(NUM_ZONES, MAX_CONCURRENT_ZONES, MAX_TOTAL_FLOW_LPM);
+    for (uint8_t i = 0; i < NUM_ZONES; i++) {
+        zoneQueue.setZone(i, zones[i].bus, ZONE_FLOW_LPM);
+    }
+    bool rmtReady[NUM_BUSES];
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        hunters[b] = new HunterRoam(busPins[b]);
+        rmtReady[b] = hunters[b]->begin();
+        if (!rmtReady[b] && NUM_BUSES > 1) {
+            // Kept in the log: frames to the other controllers no longer go out concurrently
+            eventLog.log(LOG_BUS_BITBANGED, 0, b);
+        }
+        if (busReadbackPins[b] >= 0) {
+            hunters[b]->enableReadback(busReadbackPins[b]);
+        }
+        buses[b] = new BusScheduler(*hunters[b]);
+    }
+    // Even the stops at boot go out with the saved timing
+    bool timingReady = timingStore.begin();
+    applyTimingProfile();
+    applySavedZoneStates();
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        if (!buses[b]->begin(onBusResult, (void *)(uintptr_t)b)) {
+            Serial.println("Failed to start the bus task. Rebooting...");
+            delay(1000);
+            ESP.restart();
+        }
+    }
+    busReadyUs = esp_timer_get_time();
+    eventLog.log(LOG_BUS_READY, 0, busReadyUs / 1000);
+
+    // Valves left running by a brownout are stopped now, not after the network join.
+    stopZonesRunningBeforeReset();
+    setupStallMonitor();
+    setupFirmwareUpdate();
+
+    if (!storeReady) {
+        Serial.println("NVS unavailable, zone states and counters will not survive a reset.");
+    }
+    if (!timingReady) {
+        Serial.println("NVS unavailable, the standard bus timing is used.");
+    }
+    for (uint8_t b = 0; b < NUM_BUSES; b++) {
+        if (rmtReady[b]) {
+            HunterTiming timing = buses[b]->timing();
+            Serial.printf("SmartPort bus %d ready (RMT%s, reset %lu ms + %lu ms).\n", b + 1, hunters[b]->readbackEnabled() ? ", readback" : "",
+                          (unsigned long)(timing.resetHighUs / 1000), (unsigned long)(timing.resetLowUs / 1000));
+            if (busReadbackPins[b] >= 0 && !hunters[b]->readbackEnabled()) {
+                Serial.printf("Readback on GPIO %d unavailable for bus %d.\n", busReadbackPins[b], b + 1);
+            }
+        } else {
+            Serial.printf("RMT unavailable, SmartPort bus %d will be bit-banged.\n", b + 1);
+        }
+    }
+
+    runEncoderBenchmark();
+
     pinMode(BUTTON_PIN, INPUT_PULLUP);
     pinMode(LED_PIN, OUTPUT);
     digitalWrite(LED_PIN, LED_OFF);
 
+    // The main loop sleeps until one of these wakes it.
+    loopTaskHandle = xTaskGetCurrentTaskHandle();
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = onWakeTimer;
+    timerArgs.name = "loop_wake";
+    esp_timer_create(&timerArgs, &wakeTimer);
+    attachInterrupt(digitalPinToInterrupt(BUTTON_PIN), onButtonInterrupt, CHANGE);
+    setupSkipRules();
+    setupPowerManagement();
+
     // Initialize the Watchdog Timer.
     Serial.printf("Initializing Watchdog Timer with %d second timeout.\n", WDT_TIMEOUT_SECONDS);
     esp_task_wdt_config_t wdt_config = {
@@ -208,57 +2109,97 @@ void setup() {
     esp_task_wdt_init(&wdt_config);
     esp_task_wdt_add(NULL); // Add this current task to the watchdog
 
-    // Create and register Zigbee endpoints for each valve
+    // Create and register Zigbee endpoints for each valve, and attach their callbacks
+    uint32_t heapBefore = ESP.getFreeHeap();
     for (uint8_t i = 0; i < NUM_ZONES; i++) {
-        valves[i] = new ZigbeeLight(zones[i].endpoint);
+        valves[i] = new ZigbeeValve(zones[i].endpoint, ZONE_FLOW_LPM);
         valves[i]->setManufacturerAndModel("SkynetIrrigation", "Controller");
+        valves[i]->onLightChange(zones[i].onChange);
         Zigbee.addEndpoint(valves[i]);
     }
+    uint32_t heapUsed = heapBefore - ESP.getFreeHeap();
+    Serial.printf("%d zone endpoints use %lu bytes of heap (%lu per zone, %u of it ZigbeeValve).\n",
+                  NUM_ZONES, (unsigned long)heapUsed, (unsigned long)(heapUsed / NUM_ZONES),
+                  (unsigned)sizeof(ZigbeeValve));
+
+    // Controller programs, as momentary switches
+    for (uint8_t i = 0; i < NUM_PROGRAM_SWITCHES; i++) {
+        programs[i] = new ZigbeeLight(FIRST_PROGRAM_ENDPOINT + i);
+        programs[i]->setManufacturerAndModel("SkynetIrrigation", "Controller");
+        programs[i]->onLightChange(programCallbacks[i]);
+        Zigbee.addEndpoint(programs[i]);
+    }
+
+    // Command latency histograms and the bus timing for the coordinator
+    diagnostics = new ZigbeeDiagnostics(DIAGNOSTICS_ENDPOINT);
+    diagnostics->setManufacturerAndModel("SkynetIrrigation", "Controller");
+    diagnostics->onTimingWrite(onTimingWrite);
+    // The OTA client lives on the same endpoint
+    diagnostics->addOTAClient(FIRMWARE_VERSION, FIRMWARE_VERSION, OTA_HW_VERSION, OTA_MANUFACTURER, OTA_IMAGE_TYPE, OTA_BLOCK_SIZE);
+    Zigbee.addEndpoint(diagnostics);
 
-    // Attach callbacks
-    valves[0]->onLightChange(onZone0);
-    valves[1]->onLightChange(onZone1);
-    valves[2]->onLightChange(onZone2);
-    valves[3]->onLightChange(onZone3);
+    // On-device watering sequence, the program and skip rules written last are kept in NVS
+    sequence.restore();
+    sequencer = new ZigbeeSequencer(SEQUENCER_ENDPOINT);
+    sequencer->setManufacturerAndModel("SkynetIrrigation", "Controller");
+    sequencer->onProgramWrite(onSequenceProgram);
+    sequencer->onControl(onSequenceControl);
+    sequencer->onSkipRulesWrite(onSkipRulesWrite);
+    sequencer->onInputWrite(onSkipInputWrite);
+    Zigbee.addEndpoint(sequencer);
 
-    // Temporarily remove our task from the watchdog before starting Zigbee,
-    // as Zigbee.begin() can block for a long time if the hub is not nearby.
-    Serial.println("Pausing watchdog for Zigbee initialization...");
-    esp_task_wdt_delete(NULL); // NULL means the current task
+    // One switch to stop every zone at once
+    allOff = new ZigbeeLight(ALL_OFF_ENDPOINT);
+    allOff->setManufacturerAndModel("SkynetIrrigation", "Controller");
+    allOff->onLightChange(handleAllOffChange);
+    Zigbee.addEndpoint(allOff);
 
-    // Attempt to start Zigbee. If it fails, the library state is indeterminate,
-    // and the safest action is to reboot and try again from a clean slate.
-    if (!Zigbee.begin()) {
-        Serial.println("Failed to start Zigbee. Rebooting to try again...");
-        delay(1000); // Brief delay to allow the serial message to send
+    // Join in the background; the loop (and its watchdog) runs from now on.
+    if (xTaskCreate(zigbeeStartTask, "zb_start", 4096, nullptr, 1, nullptr) != pdPASS) {
+        Serial.println("Failed to start the Zigbee task. Rebooting...");
+        delay(1000);
         ESP.restart();
     }
-    
-    // Re-add our task to the watchdog now that the blocking section is finished.
-    Serial.println("Resuming watchdog monitoring.");
-    esp_task_wdt_add(NULL); // NULL means the current task
-
-    Serial.println("Zigbee started. Waiting for connection...");
+    Serial.println("Zigbee starting. Waiting for connection...");
+    startSoakTest();
 }
 
 /********************* Main Loop ******************************/
 void loop() {
     // 1. "Pet" the watchdog to show the main loop is running correctly.
+    // The stall monitor times each pass from here, including the sleep at its end.
     esp_task_wdt_reset();
+    recordWatchdogFeed();
+    stallMonitor.busy(loopWatch);
+    loopWakes++;
 
     // 2. Handle initial valve/zone shutdown on first connect.
     handleInitialShutdown();
 
-    // 3. Update the status LED.
-    handleLedIndicator();
-
-    // 4. Check if the factory reset button is being pressed.
-    handleFactoryResetButton();
-
-    // 5. Check if any safety timers have expired and sync state.
-    handleSafetyTimeout();
+    // 3. Run every handler; each reports when it next needs attention.
+    // Wake at least a few times per watchdog period, and now and then to notice
+    // connection changes (the Zigbee library does not notify them).
+    uint32_t nextWakeMs = (WDT_TIMEOUT_SECONDS * 1000UL) / 3;
+    nextWakeMs = min(nextWakeMs, (uint32_t)ZIGBEE_CHECK_MS);
+    nextWakeMs = min(nextWakeMs, handleLedIndicator());
+    nextWakeMs = min(nextWakeMs, handleFactoryResetButton());
+    nextWakeMs = min(nextWakeMs, handleSafetyTimeout());
+    nextWakeMs = min(nextWakeMs, handleAllOff());
+    nextWakeMs = min(nextWakeMs, handleZoneQueue());
+    nextWakeMs = min(nextWakeMs, handleZoneReports());
+    nextWakeMs = min(nextWakeMs, handleZoneStore());
+    nextWakeMs = min(nextWakeMs, handleZoneMeter());
+    nextWakeMs = min(nextWakeMs, handleSkipRules());
+    nextWakeMs = min(nextWakeMs, handleSequence());
+    nextWakeMs = min(nextWakeMs, handleTiming());
+    nextWakeMs = min(nextWakeMs, handleDiagnostics());
+    nextWakeMs = min(nextWakeMs, handleDiagnosticsStatus());
+    nextWakeMs = min(nextWakeMs, handleStartupMetrics());
+    nextWakeMs = min(nextWakeMs, handleFirmwareUpdate());
+    updatePowerLock(isAnyZoneActive());
 
-    // 6. Add a small delay to reduce CPU usage and power consumption.
-    // This allows the processor to rest instead of running a tight loop.
-    delay(20);
+    // 4. Sleep until the next deadline, a button edge or a zone change.
+    // This allows the processor to rest instead of polling every few milliseconds.
+    armWakeTimer(nextWakeMs);
+    xTaskNotifyWait(0, UINT32_MAX, nullptr, portMAX_DELAY);
 }
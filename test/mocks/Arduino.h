@@ -0,0 +1,184 @@
+#pragma once
+
+#ifndef Arduino_h
+#define Arduino_h
+
+/**
+ * Host stand-in for the parts of Arduino-ESP32 the libraries under test use.
+ *
+ * Time is virtual: delay() and delayMicroseconds() move the clock that
+ * esp_timer_get_time() reads, and every digitalWrite() is recorded with its
+ * time, so a bit-banged frame leaves an exact edge timeline in mock::edges.
+ * Nothing here allocates.
+ */
+
+#include <algorithm>
+#include <array>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_timer.h"
+
+#define HIGH 0x1
+#define LOW 0x0
+#define OUTPUT 0x03
+#define IRAM_ATTR
+
+typedef uint8_t byte;
+
+using std::max;
+using std::min;
+
+namespace mock {
+
+struct Edge {
+    int64_t atUs;
+    uint8_t pin;
+    uint8_t level;
+};
+
+#define MOCK_MAX_EDGES 512
+
+inline std::array<Edge, MOCK_MAX_EDGES> edges;
+inline size_t edgeCount = 0;
+inline bool edgesOverflowed = false;
+
+/**
+ * Clear the timeline; the clock keeps running.
+ */
+inline void resetEdges() {
+    edgeCount = 0;
+    edgesOverflowed = false;
+}
+
+} // namespace mock
+
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+
+inline void digitalWrite(uint8_t pin, uint8_t level) {
+    if (mock::edgeCount >= MOCK_MAX_EDGES) {
+        mock::edgesOverflowed = true;
+        return;
+    }
+    mock::edges[mock::edgeCount++] = {mock::nowUs, pin, level};
+}
+
+inline void delayMicroseconds(uint32_t us) {
+    mock::nowUs += us;
+}
+
+inline void delay(uint32_t ms) {
+    mock::nowUs += ms * 1000LL;
+}
+
+// FreeRTOS, only what the libraries under test touch. Semaphores are counters.
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef int *SemaphoreHandle_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+namespace mock {
+inline int semaphores[4];
+inline size_t semaphoreCount = 0;
+} // namespace mock
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary() {
+    if (mock::semaphoreCount >= sizeof(mock::semaphores) / sizeof(mock::semaphores[0])) {
+        return nullptr;
+    }
+    int *semaphore = &mock::semaphores[mock::semaphoreCount++];
+    *semaphore = 0;
+    return semaphore;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    if (*semaphore == 0) {
+        return pdFALSE;
+    }
+    *semaphore = 0;
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    *semaphore = 1;
+    return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t *woken) {
+    return xSemaphoreGive(semaphore);
+}
+
+// Tasks: one at a time. xTaskCreate() only records it, mock::runTask() runs its
+// body on the calling thread until it waits for a notification with none left.
+typedef void (*TaskFunction_t)(void *arg);
+typedef int *TaskHandle_t;
+typedef unsigned int UBaseType_t;
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffu
+
+namespace mock {
+inline TaskFunction_t taskEntry = nullptr;
+inline void *taskArg = nullptr;
+inline int task;
+inline bool inTask = false;
+inline uint32_t notifications = 0;
+inline jmp_buf taskWaits;
+
+inline void runTask() {
+    if (taskEntry == nullptr) {
+        return;
+    }
+    if (setjmp(taskWaits) == 0) {
+        inTask = true;
+        taskEntry(taskArg);
+    }
+    inTask = false;
+}
+
+/**
+ * Forget the task and the semaphores, before a test creates new ones.
+ */
+inline void resetTasks() {
+    taskEntry = nullptr;
+    notifications = 0;
+    semaphoreCount = 0;
+}
+} // namespace mock
+
+inline BaseType_t xTaskCreate(TaskFunction_t entry, const char *name, uint32_t stackDepth, void *arg, UBaseType_t priority,
+                              TaskHandle_t *handle) {
+    mock::taskEntry = entry;
+    mock::taskArg = arg;
+    *handle = &mock::task;
+    return pdPASS;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return mock::inTask ? &mock::task : nullptr;
+}
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    mock::notifications++;
+    return pdPASS;
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    if (mock::notifications == 0) {
+        // Would block: hand control back to mock::runTask()
+        longjmp(mock::taskWaits, 1);
+    }
+    uint32_t count = mock::notifications;
+    mock::notifications = clear ? 0 : count - 1;
+    return count;
+}
+
+// Critical sections: the host tests run on one thread
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#ifndef rmt_rx_h
+#define rmt_rx_h
+
+/**
+ * Host stand-in for the RMT receive driver. Without SOC_RMT_SUPPORT_RX_PINGPONG
+ * (see soc/soc_caps.h) readback is never enabled, so only the types and the
+ * calls HunterRoam makes on its idle path are needed.
+ */
+
+#include "driver/rmt_tx.h"
+
+typedef struct {
+    size_t num_symbols;
+    struct {
+        uint32_t is_last : 1;
+    } flags;
+} rmt_rx_done_event_data_t;
+
+typedef struct {
+    uint32_t signal_range_min_ns;
+    uint32_t signal_range_max_ns;
+    struct {
+        uint32_t en_partial_rx : 1;
+    } flags;
+} rmt_receive_config_t;
+
+inline esp_err_t rmt_receive(rmt_channel_handle_t channel, void *buffer, size_t size, const rmt_receive_config_t *config) {
+    return ESP_FAIL;
+}
+
+#endif
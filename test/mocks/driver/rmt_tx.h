@@ -0,0 +1,138 @@
+#pragma once
+
+#ifndef rmt_tx_h
+#define rmt_tx_h
+
+/**
+ * Host stand-in for the RMT transmit driver. A channel can only be created
+ * while mock::rmtAvailable is set; rmt_transmit() keeps a copy of the symbols
+ * in mock::rmtSymbols and completes at once, calling on_trans_done.
+ *
+ * mock::rmtOnTransmit, if set, is called while a frame is on the bus, and
+ * mock::rmtHold keeps the next frame there (no on_trans_done) until it is aborted.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_timer.h"
+
+typedef int gpio_num_t;
+typedef int rmt_clock_source_t;
+#define RMT_CLK_SRC_DEFAULT 0
+
+typedef union {
+    struct {
+        uint16_t duration0 : 15;
+        uint16_t level0 : 1;
+        uint16_t duration1 : 15;
+        uint16_t level1 : 1;
+    };
+    uint32_t val;
+} rmt_symbol_word_t;
+
+typedef struct rmt_channel_t *rmt_channel_handle_t;
+typedef struct rmt_encoder_t *rmt_encoder_handle_t;
+
+typedef struct {
+    size_t num_symbols;
+} rmt_tx_done_event_data_t;
+
+typedef bool (*rmt_tx_done_callback_t)(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *ctx);
+
+typedef struct {
+    gpio_num_t gpio_num;
+    rmt_clock_source_t clk_src;
+    uint32_t resolution_hz;
+    size_t mem_block_symbols;
+    size_t trans_queue_depth;
+} rmt_tx_channel_config_t;
+
+typedef struct {
+} rmt_copy_encoder_config_t;
+
+typedef struct {
+    rmt_tx_done_callback_t on_trans_done;
+} rmt_tx_event_callbacks_t;
+
+typedef struct {
+    int loop_count;
+    struct {
+        uint32_t eot_level : 1;
+    } flags;
+} rmt_transmit_config_t;
+
+#define MOCK_MAX_SYMBOLS 256
+
+namespace mock {
+inline bool rmtAvailable = false;
+inline rmt_symbol_word_t rmtSymbols[MOCK_MAX_SYMBOLS];
+inline size_t rmtSymbolCount = 0;
+inline uint32_t rmtTransmits = 0;
+inline rmt_tx_done_callback_t rmtDone = nullptr;
+inline void *rmtDoneContext = nullptr;
+inline void (*rmtOnTransmit)() = nullptr;
+inline bool rmtHold = false;
+inline int rmtChannel;
+inline int rmtEncoder;
+} // namespace mock
+
+inline esp_err_t rmt_new_tx_channel(const rmt_tx_channel_config_t *config, rmt_channel_handle_t *channel) {
+    if (!mock::rmtAvailable) {
+        return ESP_FAIL;
+    }
+    *channel = (rmt_channel_handle_t)&mock::rmtChannel;
+    return ESP_OK;
+}
+
+inline esp_err_t rmt_new_copy_encoder(const rmt_copy_encoder_config_t *config, rmt_encoder_handle_t *encoder) {
+    *encoder = (rmt_encoder_handle_t)&mock::rmtEncoder;
+    return ESP_OK;
+}
+
+inline esp_err_t rmt_tx_register_event_callbacks(rmt_channel_handle_t channel, const rmt_tx_event_callbacks_t *callbacks, void *ctx) {
+    mock::rmtDone = callbacks->on_trans_done;
+    mock::rmtDoneContext = ctx;
+    return ESP_OK;
+}
+
+inline esp_err_t rmt_enable(rmt_channel_handle_t channel) {
+    return ESP_OK;
+}
+
+inline esp_err_t rmt_disable(rmt_channel_handle_t channel) {
+    return ESP_OK;
+}
+
+inline esp_err_t rmt_del_channel(rmt_channel_handle_t channel) {
+    return ESP_OK;
+}
+
+inline esp_err_t rmt_tx_wait_all_done(rmt_channel_handle_t channel, int timeoutMs) {
+    return ESP_OK;
+}
+
+inline esp_err_t rmt_transmit(rmt_channel_handle_t channel, rmt_encoder_handle_t encoder, const void *payload, size_t bytes,
+                              const rmt_transmit_config_t *config) {
+    size_t count = bytes / sizeof(rmt_symbol_word_t);
+    if (count > MOCK_MAX_SYMBOLS) {
+        return ESP_FAIL;
+    }
+    memcpy(mock::rmtSymbols, payload, bytes);
+    mock::rmtSymbolCount = count;
+    mock::rmtTransmits++;
+    if (mock::rmtOnTransmit != nullptr) {
+        mock::rmtOnTransmit();
+    }
+    if (mock::rmtHold) {
+        mock::rmtHold = false;
+        return ESP_OK;
+    }
+    if (mock::rmtDone != nullptr) {
+        rmt_tx_done_event_data_t event = {count};
+        mock::rmtDone(channel, &event, mock::rmtDoneContext);
+    }
+    return ESP_OK;
+}
+
+#endif
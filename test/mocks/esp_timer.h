@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef esp_timer_h
+#define esp_timer_h
+
+/**
+ * Host stand-in for esp_timer: the clock is virtual, moved by the test or by
+ * delay()/delayMicroseconds() (see Arduino.h), and timers never fire by themselves.
+ */
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+namespace mock {
+inline int64_t nowUs = 0;
+} // namespace mock
+
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+inline int64_t esp_timer_get_time() {
+    return mock::nowUs;
+}
+
+inline esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle) {
+    return ESP_FAIL;
+}
+
+inline esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeoutUs) {
+    return ESP_FAIL;
+}
+
+inline esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    return ESP_OK;
+}
+
+#endif
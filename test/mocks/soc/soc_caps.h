@@ -0,0 +1,3 @@
+#pragma once
+
+// Host build: no SoC capabilities, HunterRoam only compiles its transmit path.
@@ -0,0 +1,169 @@
+/**
+ * Host test that the HunterRoam command path never touches the heap, run with
+ * `pio test -e native`.
+ *
+ * The test binary replaces malloc and friends with counting wrappers around
+ * glibc's own allocator, so every allocation is seen: malloc, new, String or a
+ * container, from HunterRoam or from any header it pulls in. Each command is
+ * then sent in both bus modes (bit-banged and RMT) while counting.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <unity.h>
+#include "HunterRoam.h"
+
+#define TEST_PIN 5
+
+static volatile bool counting = false;
+static volatile size_t allocations = 0;
+
+#if defined(__GLIBC__)
+#define COUNT_ALLOCATIONS 1
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+static void counted() {
+    if (counting) {
+        allocations = allocations + 1;
+    }
+}
+
+void *malloc(size_t size) __THROW {
+    counted();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) __THROW {
+    counted();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) __THROW {
+    counted();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) __THROW {
+    counted();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) __THROW {
+    counted();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) __THROW {
+    counted();
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr != nullptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr) __THROW {
+    __libc_free(ptr);
+}
+}
+#else
+#define COUNT_ALLOCATIONS 0
+#endif
+
+static void startCounting() {
+    allocations = 0;
+    counting = true;
+}
+
+static size_t stopCounting() {
+    counting = false;
+    return allocations;
+}
+
+/**
+ * Every public command, valid and invalid, plus the encoders they use.
+ */
+static void runCommandPath(HunterRoam &hunter) {
+    for (uint8_t zone = 0; zone <= HUNTER_MAX_ZONES + 1; zone++) {
+        hunter.startZone(zone, zone);
+        hunter.stopZone(zone);
+        mock::resetEdges();
+    }
+    hunter.startZone(1, 241);
+    for (uint8_t program = 0; program <= HUNTER_MAX_PROGRAMS + 1; program++) {
+        hunter.startProgram(program);
+        mock::resetEdges();
+    }
+    for (uint8_t error = 0; error <= (uint8_t)HunterError::Unknown + 1; error++) {
+        HunterRoam::errorHint((HunterError)error);
+    }
+    hunter.waitForTransmit(1000);
+    hunter.verifyTransmit(1000);
+
+    HunterFrames::ZoneFrame frame;
+    static rmt_symbol_word_t symbols[HUNTER_RMT_MAX_SYMBOLS];
+    HunterRoam::encodeZone(HUNTER_MAX_ZONES, 240, frame);
+    HunterRoam::encodeSymbols(frame.data(), frame.size(), true, symbols, HUNTER_RMT_MAX_SYMBOLS);
+}
+
+void setUp() {
+    mock::resetEdges();
+    mock::rmtAvailable = false;
+#if !COUNT_ALLOCATIONS
+    TEST_IGNORE_MESSAGE("allocations are only counted with glibc");
+#endif
+}
+
+void tearDown() {
+    counting = false;
+}
+
+void test_counting_sees_allocations() {
+    startCounting();
+    void *volatile block = malloc(16);
+    free(block);
+    int *volatile value = new int(1);
+    delete value;
+    std::string text(64, 'x'); // longer than the small string buffer
+    size_t counted = stopCounting();
+
+    TEST_ASSERT_EQUAL_UINT32(3, counted);
+    TEST_ASSERT_EQUAL_UINT32(64, text.size());
+}
+
+void test_bitbanged_command_path_does_not_allocate() {
+    HunterRoam hunter(TEST_PIN);
+
+    startCounting();
+    runCommandPath(hunter);
+    size_t counted = stopCounting();
+
+    TEST_ASSERT_EQUAL_UINT32(0, counted);
+}
+
+void test_rmt_command_path_does_not_allocate() {
+    mock::rmtAvailable = true;
+    HunterRoam hunter(TEST_PIN);
+    TEST_ASSERT_TRUE(hunter.begin());
+    uint32_t transmits = mock::rmtTransmits;
+
+    startCounting();
+    runCommandPath(hunter);
+    size_t counted = stopCounting();
+
+    TEST_ASSERT_EQUAL_UINT32(0, counted);
+    TEST_ASSERT_TRUE(mock::rmtTransmits > transmits); // the frames did go through RMT
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_counting_sees_allocations);
+    RUN_TEST(test_bitbanged_command_path_does_not_allocate);
+    RUN_TEST(test_rmt_command_path_does_not_allocate);
+    return UNITY_END();
+}
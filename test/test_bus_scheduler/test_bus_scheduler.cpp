@@ -0,0 +1,133 @@
+/**
+ * Host tests of the bus command scheduler, run with `pio test -e native`.
+ *
+ * The bus task runs on the test thread (see mock::runTask()) against the RMT
+ * mock, and every result it reports is recorded in order. "All off" has to
+ * leave no program start behind: neither one still waiting, nor one whose
+ * frame the stops cut short.
+ */
+
+#include <unity.h>
+#include "BusScheduler.h"
+
+#define TEST_PIN 5
+#define STATIONS 3
+#define MAX_RESULTS 16
+
+struct Result {
+    BusAction action;
+    uint8_t target;
+    HunterError error;
+};
+
+static Result results[MAX_RESULTS];
+static size_t resultCount = 0;
+static BusScheduler *scheduler = nullptr;
+
+static void recordResult(const BusCommand &command, HunterError error, void *arg) {
+    if (resultCount < MAX_RESULTS) {
+        results[resultCount++] = {command.action, command.target, error};
+    }
+}
+
+static void stopAllDuringFrame() {
+    mock::rmtOnTransmit = nullptr;
+    scheduler->stopAll(STATIONS);
+}
+
+/**
+ * Every station got its stop, in order, and no program frame made it out.
+ */
+static void assertOnlyStopsSent(uint32_t transmitsBefore, uint32_t abortedFrames) {
+    size_t stops = 0;
+    size_t programs = 0;
+    for (size_t i = 0; i < resultCount; i++) {
+        if (results[i].action == BUS_START_PROGRAM) {
+            TEST_ASSERT_EQUAL((int)HunterError::TransmitAborted, (int)results[i].error);
+            programs++;
+        } else {
+            TEST_ASSERT_EQUAL(BUS_STOP_ZONE, results[i].action);
+            TEST_ASSERT_EQUAL_UINT8(++stops, results[i].target);
+            TEST_ASSERT_EQUAL((int)HunterError::None, (int)results[i].error);
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT32(STATIONS, stops);
+    TEST_ASSERT_EQUAL_UINT32(1, programs);
+    TEST_ASSERT_EQUAL_UINT32(abortedFrames + STATIONS, mock::rmtTransmits - transmitsBefore);
+}
+
+void setUp() {
+    mock::resetTasks();
+    mock::rmtAvailable = true;
+    mock::rmtHold = false;
+    mock::rmtOnTransmit = nullptr;
+    resultCount = 0;
+}
+
+void tearDown() {
+    scheduler = nullptr;
+}
+
+void test_stop_all_drops_waiting_program_start() {
+    HunterRoam hunter(TEST_PIN);
+    TEST_ASSERT_TRUE(hunter.begin());
+    BusScheduler bus(hunter);
+    TEST_ASSERT_TRUE(bus.begin(recordResult, nullptr));
+    uint32_t transmits = mock::rmtTransmits;
+
+    TEST_ASSERT_TRUE(bus.startProgram(2));
+    TEST_ASSERT_TRUE(bus.stopAll(STATIONS));
+    mock::runTask();
+
+    assertOnlyStopsSent(transmits, 0);
+    TEST_ASSERT_EQUAL_UINT8(2, results[0].target);
+
+    // Nothing left to send
+    transmits = mock::rmtTransmits;
+    xTaskNotifyGive(nullptr);
+    mock::runTask();
+    TEST_ASSERT_EQUAL_UINT32(transmits, mock::rmtTransmits);
+}
+
+void test_stop_all_does_not_resend_program_frame_it_aborted() {
+    HunterRoam hunter(TEST_PIN);
+    TEST_ASSERT_TRUE(hunter.begin());
+    BusScheduler bus(hunter);
+    TEST_ASSERT_TRUE(bus.begin(recordResult, nullptr));
+    scheduler = &bus;
+    uint32_t transmits = mock::rmtTransmits;
+
+    // The program frame is still on the bus when "all off" comes in
+    TEST_ASSERT_TRUE(bus.startProgram(1));
+    mock::rmtHold = true;
+    mock::rmtOnTransmit = stopAllDuringFrame;
+    mock::runTask();
+
+    assertOnlyStopsSent(transmits, 1);
+    TEST_ASSERT_EQUAL(BUS_START_PROGRAM, results[0].action);
+    TEST_ASSERT_EQUAL_UINT8(1, results[0].target);
+}
+
+void test_program_start_after_stop_all_is_sent() {
+    HunterRoam hunter(TEST_PIN);
+    TEST_ASSERT_TRUE(hunter.begin());
+    BusScheduler bus(hunter);
+    TEST_ASSERT_TRUE(bus.begin(recordResult, nullptr));
+
+    TEST_ASSERT_TRUE(bus.startProgram(3));
+    TEST_ASSERT_TRUE(bus.stopAll(STATIONS));
+    TEST_ASSERT_TRUE(bus.startProgram(3));
+    mock::runTask();
+
+    TEST_ASSERT_EQUAL_UINT32(STATIONS + 1, resultCount);
+    TEST_ASSERT_EQUAL(BUS_START_PROGRAM, results[STATIONS].action);
+    TEST_ASSERT_EQUAL((int)HunterError::None, (int)results[STATIONS].error);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_stop_all_drops_waiting_program_start);
+    RUN_TEST(test_stop_all_does_not_resend_program_frame_it_aborted);
+    RUN_TEST(test_program_start_after_stop_all_is_sent);
+    return UNITY_END();
+}
@@ -0,0 +1,229 @@
+/**
+ * Host tests of the SmartPort encoder, run with `pio test -e native`.
+ *
+ * The bit-banged writer runs against the mocks in test/mocks, which record
+ * every digitalWrite() on a virtual clock. Its edge timeline has to follow the
+ * bus intervals and carry the frame bit by bit, and the RMT symbols built by
+ * encodeSymbols() have to describe exactly the same timeline, for every zone,
+ * run time and program. The last test times the encoder on the host.
+ */
+
+#include <unity.h>
+#include <chrono>
+#include <stdio.h>
+#include "HunterRoam.h"
+
+#define TEST_PIN 5
+// Host time per zone frame (table copy, time patch and RMT symbols) above which
+// the benchmark fails. Far above the real figure, so only a regression trips it.
+#define ENCODE_BUDGET_NS 20000
+
+// A level held on the bus for a time
+struct Segment {
+    uint8_t level;
+    uint32_t us;
+};
+
+#define MAX_SEGMENTS 300
+
+static Segment written[MAX_SEGMENTS];
+static Segment encoded[MAX_SEGMENTS];
+static rmt_symbol_word_t symbols[HUNTER_RMT_MAX_SYMBOLS];
+
+/**
+ * Add a level to a timeline, merged with the previous segment if it has the same level.
+ */
+static void addSegment(Segment *segments, size_t &count, uint8_t level, uint32_t us) {
+    if (us == 0) {
+        return;
+    }
+    if (count > 0 && segments[count - 1].level == level) {
+        segments[count - 1].us += us;
+    } else if (count < MAX_SEGMENTS) {
+        segments[count++] = {level, us};
+    }
+}
+
+/**
+ * The timeline recorded by the digitalWrite() mock, up to endUs.
+ */
+static size_t writtenTimeline(Segment *segments, int64_t endUs) {
+    size_t count = 0;
+    for (size_t i = 0; i < mock::edgeCount; i++) {
+        int64_t untilUs = i + 1 < mock::edgeCount ? mock::edges[i + 1].atUs : endUs;
+        addSegment(segments, count, mock::edges[i].level, untilUs - mock::edges[i].atUs);
+    }
+    return count;
+}
+
+/**
+ * The timeline RMT symbols put on the bus (1 tick = 1 us).
+ */
+static size_t symbolTimeline(const rmt_symbol_word_t *words, size_t wordCount, Segment *segments) {
+    size_t count = 0;
+    for (size_t i = 0; i < wordCount; i++) {
+        addSegment(segments, count, words[i].level0, words[i].duration0);
+        addSegment(segments, count, words[i].level1, words[i].duration1);
+    }
+    return count;
+}
+
+static void assertSameTimeline(const Segment *expected, size_t expectedCount, const Segment *actual, size_t actualCount,
+                               const char *what) {
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(expectedCount, actualCount, what);
+    for (size_t i = 0; i < expectedCount; i++) {
+        TEST_ASSERT_EQUAL_UINT8_MESSAGE(expected[i].level, actual[i].level, what);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected[i].us, actual[i].us, what);
+    }
+}
+
+/**
+ * Bit-bang one zone frame and compare its timeline with the frame's symbols.
+ */
+static void checkZone(HunterRoam &hunter, uint8_t zone, uint8_t time) {
+    char what[48];
+    snprintf(what, sizeof(what), "zone %u, %u minutes", zone, time);
+
+    mock::resetEdges();
+    TEST_ASSERT_EQUAL_MESSAGE((int)HunterError::None, (int)hunter.startZone(zone, time), what);
+    TEST_ASSERT_FALSE_MESSAGE(mock::edgesOverflowed, what);
+    size_t writtenCount = writtenTimeline(written, mock::nowUs);
+
+    HunterFrames::ZoneFrame frame;
+    TEST_ASSERT_EQUAL_MESSAGE((int)HunterError::None, (int)HunterRoam::encodeZone(zone, time, frame), what);
+    size_t symbolCount = HunterRoam::encodeSymbols(frame.data(), frame.size(), true, symbols, HUNTER_RMT_MAX_SYMBOLS,
+                                                   hunter.timing());
+    size_t encodedCount = symbolTimeline(symbols, symbolCount, encoded);
+
+    assertSameTimeline(written, writtenCount, encoded, encodedCount, what);
+}
+
+void setUp() {
+    mock::resetEdges();
+    mock::rmtAvailable = false;
+}
+
+void tearDown() {}
+
+void test_bitbang_matches_symbols_for_every_zone_frame() {
+    HunterRoam hunter(TEST_PIN);
+    for (uint8_t zone = 1; zone <= HUNTER_MAX_ZONES; zone++) {
+        for (uint16_t time = 0; time <= 240; time++) {
+            checkZone(hunter, zone, time);
+        }
+    }
+}
+
+void test_bitbang_matches_symbols_with_short_reset() {
+    HunterRoam hunter(TEST_PIN);
+    TEST_ASSERT_TRUE(hunter.setTiming({HUNTER_MIN_RESET_HIGH_US, HUNTER_MIN_RESET_LOW_US}));
+    for (uint8_t zone = 1; zone <= HUNTER_MAX_ZONES; zone++) {
+        checkZone(hunter, zone, zone);
+    }
+}
+
+void test_bitbang_matches_symbols_for_every_program_frame() {
+    HunterRoam hunter(TEST_PIN);
+    for (uint8_t program = 1; program <= HUNTER_MAX_PROGRAMS; program++) {
+        mock::resetEdges();
+        TEST_ASSERT_EQUAL((int)HunterError::None, (int)hunter.startProgram(program));
+        size_t writtenCount = writtenTimeline(written, mock::nowUs);
+
+        const HunterFrames::ProgramFrame &frame = HunterFrames::programFrames[program - 1];
+        size_t symbolCount = HunterRoam::encodeSymbols(frame.data(), frame.size(), false, symbols, HUNTER_RMT_MAX_SYMBOLS);
+        size_t encodedCount = symbolTimeline(symbols, symbolCount, encoded);
+
+        assertSameTimeline(written, writtenCount, encoded, encodedCount, "program frame");
+    }
+}
+
+void test_bitbang_timeline_follows_bus_intervals() {
+    const uint8_t zone = 7;
+    const uint8_t time = 25;
+    HunterRoam hunter(TEST_PIN);
+    TEST_ASSERT_EQUAL((int)HunterError::None, (int)hunter.startZone(zone, time));
+    size_t count = writtenTimeline(written, mock::nowUs);
+
+    HunterFrames::ZoneFrame frame;
+    HunterRoam::encodeZone(zone, time, frame);
+    // Reset, start pulse, two segments per bit, the extra bit and the stop pulse
+    TEST_ASSERT_EQUAL_UINT32(2 + 2 + 2 * (8 * frame.size() + 1 + 1), count);
+
+    TEST_ASSERT_EQUAL_UINT8(HIGH, written[0].level);
+    TEST_ASSERT_EQUAL_UINT32(RESET_HIGH_MS * 1000UL, written[0].us);
+    TEST_ASSERT_EQUAL_UINT8(LOW, written[1].level);
+    TEST_ASSERT_EQUAL_UINT32(RESET_LOW_MS * 1000UL, written[1].us);
+    TEST_ASSERT_EQUAL_UINT8(HIGH, written[2].level);
+    TEST_ASSERT_EQUAL_UINT32(START_INTERVAL, written[2].us);
+    TEST_ASSERT_EQUAL_UINT32(SHORT_INTERVAL, written[3].us);
+
+    // Every bit is a high pulse and a low gap: long-short is a 1, short-long a 0
+    size_t bit = 0;
+    for (size_t i = 4; i + 1 < count; i += 2, bit++) {
+        TEST_ASSERT_EQUAL_UINT8(HIGH, written[i].level);
+        TEST_ASSERT_EQUAL_UINT8(LOW, written[i + 1].level);
+        bool high = written[i].us == LONG_INTERVAL;
+        TEST_ASSERT_EQUAL_UINT32(high ? LONG_INTERVAL : SHORT_INTERVAL, written[i].us);
+        TEST_ASSERT_EQUAL_UINT32(high ? SHORT_INTERVAL : LONG_INTERVAL, written[i + 1].us);
+
+        bool expected;
+        if (bit < 8 * frame.size()) {
+            expected = frame[bit / 8] & (0x80 >> (bit % 8)); // high order bits first
+        } else {
+            expected = bit == 8 * frame.size(); // extra 1 bit, then the 0 stop pulse
+        }
+        TEST_ASSERT_EQUAL(expected, high);
+    }
+
+    TEST_ASSERT_EQUAL_INT64(hunterFrameDurationUs(frame.size(), true), hunter.lastTransmitEnd() - hunter.lastTransmitStart());
+}
+
+void test_rmt_transmits_the_encoded_symbols() {
+    mock::rmtAvailable = true;
+    HunterRoam hunter(TEST_PIN);
+    TEST_ASSERT_TRUE(hunter.begin());
+
+    TEST_ASSERT_EQUAL((int)HunterError::None, (int)hunter.startZone(12, 90));
+    TEST_ASSERT_FALSE(hunter.isBusy());
+    TEST_ASSERT_EQUAL_UINT32(0, mock::edgeCount); // nothing bit-banged
+
+    HunterFrames::ZoneFrame frame;
+    HunterRoam::encodeZone(12, 90, frame);
+    size_t symbolCount = HunterRoam::encodeSymbols(frame.data(), frame.size(), true, symbols, HUNTER_RMT_MAX_SYMBOLS);
+    TEST_ASSERT_EQUAL_UINT32(hunterSymbolCount(frame.size(), true), symbolCount);
+    TEST_ASSERT_EQUAL_UINT32(symbolCount, mock::rmtSymbolCount);
+    TEST_ASSERT_EQUAL_MEMORY(symbols, mock::rmtSymbols, symbolCount * sizeof(rmt_symbol_word_t));
+}
+
+void test_encode_benchmark() {
+    uint32_t frames = 0;
+    volatile size_t sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint8_t zone = 1; zone <= HUNTER_MAX_ZONES; zone++) {
+        for (uint16_t time = 0; time <= 240; time++) {
+            HunterFrames::ZoneFrame frame;
+            HunterRoam::encodeZone(zone, time, frame);
+            sink = sink + HunterRoam::encodeSymbols(frame.data(), frame.size(), true, symbols, HUNTER_RMT_MAX_SYMBOLS);
+            frames++;
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    uint32_t perFrameNs = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / frames;
+
+    char message[80];
+    snprintf(message, sizeof(message), "encoder: %lu frames, %lu ns per frame", (unsigned long)frames, (unsigned long)perFrameNs);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_LESS_THAN_UINT32(ENCODE_BUDGET_NS, perFrameNs);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_bitbang_matches_symbols_for_every_zone_frame);
+    RUN_TEST(test_bitbang_matches_symbols_with_short_reset);
+    RUN_TEST(test_bitbang_matches_symbols_for_every_program_frame);
+    RUN_TEST(test_bitbang_timeline_follows_bus_intervals);
+    RUN_TEST(test_rmt_transmits_the_encoded_symbols);
+    RUN_TEST(test_encode_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,107 @@
+/**
+ * Host tests of the zone start admission, run with `pio test -e native`.
+ *
+ * Starts waiting on one controller have to come out of next() in the order
+ * they were asked for, also when a flow limit lets a later, smaller one fit
+ * first. A start that does not fit must not hold up one on another controller.
+ */
+
+#include <unity.h>
+#include "ZoneQueue.h"
+
+#define ZONES 6
+#define MAX_FLOW 40
+
+static ZoneQueue queue;
+
+/**
+ * Zones 0-2 on controller 0 and 3-5 on controller 1, one running per controller.
+ * Flows: 0 = 20, 1 = 30, 2 = 5, 3 = 15, 4 = 30, 5 = 5.
+ */
+void setUp() {
+    queue = ZoneQueue();
+    TEST_ASSERT_TRUE(queue.begin(ZONES, 1, MAX_FLOW));
+    const uint16_t flows[ZONES] = {20, 30, 5, 15, 30, 5};
+    for (uint8_t i = 0; i < ZONES; i++) {
+        queue.setZone(i, i < 3 ? 0 : 1, flows[i]);
+    }
+}
+
+void tearDown() {}
+
+void test_waiting_starts_keep_their_order_on_a_controller() {
+    uint8_t position;
+    TEST_ASSERT_TRUE(queue.request(3, 10, position));  // controller 1, flow 15
+    TEST_ASSERT_TRUE(queue.request(0, 10, position));  // controller 0, flow 20
+    TEST_ASSERT_FALSE(queue.request(1, 11, position)); // flow 30, waits
+    TEST_ASSERT_EQUAL_UINT8(1, position);
+    TEST_ASSERT_FALSE(queue.request(2, 12, position)); // flow 5, behind zone 1
+    TEST_ASSERT_EQUAL_UINT8(2, position);
+
+    // Zone 0 stops: zone 2 would fit the flow left (15 + 5), zone 1 does not (15 + 30)
+    queue.release(0);
+    uint8_t index;
+    uint8_t minutes;
+    TEST_ASSERT_FALSE(queue.ready());
+    TEST_ASSERT_FALSE(queue.next(index, minutes));
+    TEST_ASSERT_EQUAL_UINT8(1, queue.position(1));
+    TEST_ASSERT_EQUAL_UINT8(2, queue.position(2));
+
+    // Controller 1 stops: now zone 1 fits and goes first
+    queue.release(3);
+    TEST_ASSERT_TRUE(queue.ready());
+    TEST_ASSERT_TRUE(queue.next(index, minutes));
+    TEST_ASSERT_EQUAL_UINT8(1, index);
+    TEST_ASSERT_EQUAL_UINT8(11, minutes);
+
+    queue.release(1);
+    TEST_ASSERT_TRUE(queue.next(index, minutes));
+    TEST_ASSERT_EQUAL_UINT8(2, index);
+    TEST_ASSERT_EQUAL_UINT8(12, minutes);
+    TEST_ASSERT_EQUAL_UINT8(0, queue.waitingCount());
+}
+
+void test_waiting_start_does_not_hold_up_another_controller() {
+    uint8_t position;
+    TEST_ASSERT_TRUE(queue.request(0, 10, position));  // controller 0, flow 20
+    TEST_ASSERT_TRUE(queue.request(3, 10, position));  // controller 1, flow 15
+    TEST_ASSERT_FALSE(queue.request(4, 14, position)); // controller 1, flow 30
+    TEST_ASSERT_FALSE(queue.request(2, 12, position)); // controller 0, flow 5
+
+    // Controller 1 is free but zone 4 does not fit (20 + 30); zone 2 on controller 0 waits for zone 0
+    queue.release(3);
+    uint8_t index;
+    uint8_t minutes;
+    TEST_ASSERT_FALSE(queue.next(index, minutes));
+
+    // Controller 0 stops: zone 4 now fits, and zone 2 may go after it
+    queue.release(0);
+    TEST_ASSERT_TRUE(queue.next(index, minutes));
+    TEST_ASSERT_EQUAL_UINT8(4, index);
+    TEST_ASSERT_TRUE(queue.next(index, minutes));
+    TEST_ASSERT_EQUAL_UINT8(2, index);
+}
+
+void test_later_controller_goes_when_the_first_waiting_start_does_not_fit() {
+    uint8_t position;
+    TEST_ASSERT_TRUE(queue.request(0, 10, position));  // controller 0, flow 20
+    TEST_ASSERT_FALSE(queue.request(1, 11, position)); // controller 0, waits for zone 0
+    TEST_ASSERT_TRUE(queue.request(3, 10, position));  // controller 1, flow 15
+    TEST_ASSERT_FALSE(queue.request(5, 15, position)); // controller 1, waits for zone 3
+
+    // Zone 1 is first in line but its controller is busy; zone 5 fits (20 + 5)
+    queue.release(3);
+    uint8_t index;
+    uint8_t minutes;
+    TEST_ASSERT_TRUE(queue.next(index, minutes));
+    TEST_ASSERT_EQUAL_UINT8(5, index);
+    TEST_ASSERT_EQUAL_UINT8(1, queue.position(1));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_waiting_starts_keep_their_order_on_a_controller);
+    RUN_TEST(test_waiting_start_does_not_hold_up_another_controller);
+    RUN_TEST(test_later_controller_goes_when_the_first_waiting_start_does_not_fit);
+    return UNITY_END();
+}